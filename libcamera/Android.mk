@@ -8,12 +8,13 @@ include $(CLEAR_VARS)
 # When zero we link against libmmcamera; when 1, we dlopen libmmcamera.
 DLOPEN_LIBMMCAMERA := 1
 
-# Uncomment below line to enable smooth zoom
-#LOCAL_CFLAGS += -DCAMERA_SMOOTH_ZOOM
-
 LOCAL_SRC_FILES := \
     QualcommCamera.cpp \
-    QualcommCameraHardware.cpp
+    QualcommCameraHardware.cpp \
+    nv21_convert.c \
+    nv21_scale.c \
+    nv21_stats.c \
+    nv21_faces.c
 
 ifeq ($(TARGET_USES_ION),true)
     LOCAL_CFLAGS += -DUSE_ION
@@ -46,5 +47,63 @@ LOCAL_MODULE := camera.$(TARGET_BOARD_PLATFORM)
 LOCAL_MODULE_TAGS := optional
 include $(BUILD_SHARED_LIBRARY)
 
+# Preview kernel and face detector benchmark; checks the NEON
+# kernels against C on device.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    bench/nv21_bench.c \
+    nv21_convert.c \
+    nv21_scale.c \
+    nv21_stats.c \
+    nv21_faces.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+
+LOCAL_MODULE := nv21_bench
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+# Preview busy queue benchmark: the SPSC ring against the locked queue it
+# replaced.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bench/frame_queue_bench.c
+
+LOCAL_MODULE := frame_queue_bench
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+# Host builds of the benchmarks, which need nothing from the platform;
+# the C kernels are checked and timed on the build machine.
+ifeq ($(CAMERA_HOST_BENCH),true)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    bench/nv21_bench.c \
+    nv21_convert.c \
+    nv21_scale.c \
+    nv21_stats.c \
+    nv21_faces.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_LDLIBS += -lrt
+
+LOCAL_MODULE := nv21_bench
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bench/frame_queue_bench.c
+LOCAL_LDLIBS += -lpthread -lrt
+
+LOCAL_MODULE := frame_queue_bench
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+endif # CAMERA_HOST_BENCH
+
 endif # BOARD_USES_QCOM_HARDWARE
 endif # USE_CAMERA_STUB
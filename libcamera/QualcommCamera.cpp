@@ -364,9 +364,6 @@ int cancel_picture(struct camera_device * device)
 	return -1;
 }
 
-static CameraParameters g_param;
-static String8 g_str;
-
 int set_parameters(struct camera_device * device, const char *parms)
 {
 	ALOGV("%s", __FUNCTION__);
@@ -378,25 +375,23 @@ int set_parameters(struct camera_device * device, const char *parms)
 
 	QualcommCameraHardware *hardware = qcamera_get_hardware(device);
 	if (hardware) {
-		g_str = String8(parms);
-		g_param.unflatten(g_str);
-		return hardware->setParameters(g_param);
+		CameraParameters param;
+		param.unflatten(String8(parms));
+		return hardware->setParameters(param);
 	}
 
 	return -1;
 }
 
+/* The returned string is owned by the caller and released through
+ * put_parameters(). */
 char *get_parameters(struct camera_device * device)
 {
 	ALOGV("%s", __FUNCTION__);
 
-	CameraParameters param;
 	QualcommCameraHardware *hardware = qcamera_get_hardware(device);
-	if (hardware) {
-		g_param = hardware->getParameters();
-		g_str = g_param.flatten();
-		return (char *)g_str.string();
-	}
+	if (hardware)
+		return hardware->getParametersString();
 
 	return NULL;
 }
@@ -404,6 +399,8 @@ char *get_parameters(struct camera_device * device)
 void put_parameters(struct camera_device * device, char *parm)
 {
 	ALOGV("%s", __FUNCTION__);
+
+	free(parm);
 }
 
 int send_command(struct camera_device * device,
@@ -432,6 +429,11 @@ void release(struct camera_device * device)
 
 int dump(struct camera_device * device, int fd)
 {
-	/* dummy */
-	return 0;
+	ALOGV("%s", __FUNCTION__);
+
+	QualcommCameraHardware *hardware = qcamera_get_hardware(device);
+	if (hardware)
+		return hardware->dump(fd);
+
+	return -1;
 }
@@ -20,6 +20,10 @@
 
 #include "QualcommCameraHardware.h"
 #include <QComOMXMetadata.h>
+#include "nv21_convert.h"
+#include "nv21_faces.h"
+#include "nv21_scale.h"
+#include "nv21_stats.h"
 
 #include <cutils/properties.h>
 #include <math.h>
@@ -40,6 +44,8 @@ extern "C" {
 #define ACTIVE_ZSL_BUFFERS 3
 #define APP_ORIENTATION 90
 #define HDR_HAL_FRAME 2
+#define MAX_BURST_SHOTS 10
+#define RECORD_SLOT_MAGIC 0x52534c54 /* "RSLT" */
 
 #define FLASH_AUTO 24
 #define FLASH_SNAP 32
@@ -112,6 +118,13 @@ extern void (*mmcamera_liveshot_callback)(liveshot_status status, uint32_t jpeg_
 static uint32_t PREVIEW_SIZE_COUNT;
 static uint32_t HFR_SIZE_COUNT;
 
+/* Trails each metadata packet given to the encoder, so a packet coming
+ * back through releaseRecordingFrame() names its own slot. */
+struct record_slot_tag {
+    uint32_t magic;
+    int32_t slot;
+};
+
 static const board_property boardProperties[] = {
     { TARGET_MSM7625, 0x00000fff, false, false, false },
     { TARGET_MSM7625A, 0x00000fff, false, false, false },
@@ -201,13 +214,94 @@ static android::FPSRange FpsRangesSupported[] = {
 };
 #define FPS_RANGES_SUPPORTED_COUNT (sizeof(FpsRangesSupported) / sizeof(FpsRangesSupported[0]))
 
+/* attr_lookup() is called from nearly every setter. Each str_map table
+ * gets an open-addressed index the first time it is looked up: entry
+ * numbers keyed by an FNV-1a hash of the name, so a lookup costs one
+ * hash and, normally, a single strcmp. The names are defined in
+ * libcamera_client, so the index can't be built at compile time.
+ */
+#define ATTR_INDEX_SLOTS 32     /* power of two, >= 1.5x the largest table */
+#define ATTR_INDEX_TABLES 64    /* power of two, >= 2x the number of tables */
+
+struct attr_index {
+    volatile int32_t ready;
+    const str_map *arr;
+    uint32_t hash[ATTR_INDEX_SLOTS];
+    int8_t entry[ATTR_INDEX_SLOTS];
+};
+static attr_index attr_indexes[ATTR_INDEX_TABLES];
+static Mutex attr_index_lock;
+
+static uint32_t attr_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static attr_index *attr_index_find(const str_map arr[], int len)
+{
+    uint32_t start = ((uint32_t)(uintptr_t)arr >> 2) * 2654435761u;
+    int slot = -1;
+
+    for (int i = 0; i < ATTR_INDEX_TABLES; i++) {
+        attr_index *idx = &attr_indexes[(start + i) & (ATTR_INDEX_TABLES - 1)];
+        if (!android_atomic_acquire_load(&idx->ready)) {
+            slot = (start + i) & (ATTR_INDEX_TABLES - 1);
+            break;
+        }
+        if (idx->arr == arr)
+            return idx;
+    }
+    if (slot < 0 || len > ATTR_INDEX_SLOTS * 2 / 3)
+        return NULL;
+
+    Mutex::Autolock l(&attr_index_lock);
+    /* Another thread may have built it, or taken the free slot. */
+    for (int i = 0; i < ATTR_INDEX_TABLES; i++) {
+        attr_index *idx = &attr_indexes[(start + i) & (ATTR_INDEX_TABLES - 1)];
+        if (!idx->ready) {
+            idx->arr = arr;
+            memset(idx->entry, -1, sizeof(idx->entry));
+            for (int e = 0; e < len; e++) {
+                uint32_t h = attr_hash(arr[e].desc);
+                int s = h & (ATTR_INDEX_SLOTS - 1);
+                while (idx->entry[s] >= 0)
+                    s = (s + 1) & (ATTR_INDEX_SLOTS - 1);
+                idx->hash[s] = h;
+                idx->entry[s] = e;
+            }
+            android_atomic_release_store(1, &idx->ready);
+            return idx;
+        }
+        if (idx->arr == arr)
+            return idx;
+    }
+    return NULL;
+}
+
 static int attr_lookup(const str_map arr[], int len, const char *name)
 {
-    if (name) {
-        for (int i = 0; i < len; i++) {
-            if (!strcmp(arr[i].desc, name))
-                return arr[i].val;
+    if (!name)
+        return NOT_FOUND;
+
+    attr_index *idx = attr_index_find(arr, len);
+    if (idx != NULL) {
+        uint32_t h = attr_hash(name);
+        for (int s = h & (ATTR_INDEX_SLOTS - 1); idx->entry[s] >= 0;
+             s = (s + 1) & (ATTR_INDEX_SLOTS - 1)) {
+            if (idx->hash[s] == h && !strcmp(arr[idx->entry[s]].desc, name))
+                return arr[idx->entry[s]].val;
         }
+        return NOT_FOUND;
+    }
+
+    for (int i = 0; i < len; i++) {
+        if (!strcmp(arr[i].desc, name))
+            return arr[i].val;
     }
     return NOT_FOUND;
 }
@@ -455,6 +549,15 @@ static const str_map app_preview_formats[] = {
     { CameraParameters::PIXEL_FORMAT_YUV420P, HAL_PIXEL_FORMAT_YV12 }, //YV12
 };
 
+/* Formats served by converting the native NV21 frames for the data
+ * callback only; the display keeps getting NV21. */
+static const str_map converted_preview_formats[] = {
+    { CameraParameters::PIXEL_FORMAT_YUV420P, NV21_CONVERT_YV12 },
+    { "yuv420sp-nv12", NV21_CONVERT_NV12 },
+    { CameraParameters::PIXEL_FORMAT_RGB565, NV21_CONVERT_RGB565 },
+    { CameraParameters::PIXEL_FORMAT_RGBA8888, NV21_CONVERT_RGBA8888 },
+};
+
 static bool parameter_string_initialized = false;
 static String8 preview_size_values;
 static String8 hfr_size_values;
@@ -574,52 +677,6 @@ static String8 create_values_range_str(int min, int max)
     return str;
 }
 
-static struct fifo_queue g_busy_frame_queue =
-    { 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, (char *)"video_busy_q" };
-
-static void cam_frame_wait_video(void)
-{
-    ALOGV("cam_frame_wait_video E ");
-    if (g_busy_frame_queue.num_of_frames <= 0) {
-        pthread_cond_wait(&(g_busy_frame_queue.wait), &(g_busy_frame_queue.mut));
-    }
-    ALOGV("cam_frame_wait_video X");
-}
-
-static void cam_frame_flush_video(void)
-{
-    ALOGV("cam_frame_flush_video: in n = %d\n", g_busy_frame_queue.num_of_frames);
-    pthread_mutex_lock(&(g_busy_frame_queue.mut));
-
-    while (g_busy_frame_queue.front) {
-        //dequeue from the busy queue
-        struct fifo_node *node  = dequeue (&g_busy_frame_queue);
-        if (node)
-            free(node);
-
-        ALOGV("cam_frame_flush_video: node \n");
-    }
-    pthread_mutex_unlock(&(g_busy_frame_queue.mut));
-    ALOGV("cam_frame_flush_video: out n = %d\n", g_busy_frame_queue.num_of_frames);
-}
-
-static struct msm_frame *cam_frame_get_video(void)
-{
-    struct msm_frame *p = NULL;
-    ALOGV("cam_frame_get_video... in\n");
-    ALOGV("cam_frame_get_video... got lock\n");
-    if (g_busy_frame_queue.front) {
-        //dequeue
-        struct fifo_node *node  = dequeue (&g_busy_frame_queue);
-        if (node) {
-            p = (struct msm_frame *)node->f;
-            free (node);
-        }
-        ALOGV("cam_frame_get_video... out = %lx\n", p->buffer);
-    }
-    return p;
-}
-
 // Parse string like "(1, 2, 3, 4, ..., N)"
 // num is pointer to an allocated array of size N
 static int parseNDimVector_HAL(const char *str, int *num, int N, char delim = ',')
@@ -708,37 +765,229 @@ static int checkAreaParameters(const char *str)
     return 0;
 }
 
-static void cam_frame_post_video(struct msm_frame *p)
+QualcommCameraHardware::VideoFrameQueue::VideoFrameQueue()
 {
-    if (!p) {
-        ALOGE("post video , buffer is null");
-        return;
+    mExit = false;
+    mHead = 0;
+    mCount = 0;
+    mCapacity = kMaxSize;
+}
+
+void QualcommCameraHardware::VideoFrameQueue::init(int capacity)
+{
+    Mutex::Autolock l(&mQueueLock);
+    if (capacity <= 0 || capacity > kMaxSize) {
+        ALOGW("%s: capacity %d out of range, using %d", __FUNCTION__, capacity, kMaxSize);
+        capacity = kMaxSize;
     }
+    mCapacity = capacity;
+    mHead = 0;
+    mCount = 0;
+}
 
-    ALOGV("cam_frame_post_video... in = %x\n", (unsigned int)(p->buffer));
-    pthread_mutex_lock(&(g_busy_frame_queue.mut));
-    ALOGV("post_video got lock. q count before enQ %d", g_busy_frame_queue.num_of_frames);
-    //enqueue to busy queue
-    struct fifo_node *node = (struct fifo_node *)malloc(sizeof(struct fifo_node));
-    if (node) {
-        ALOGV(" post video , enqueing in busy queue");
-        node->f = p;
-        node->next = NULL;
-        enqueue(&g_busy_frame_queue, node);
-        ALOGV("post_video got lock. q count after enQ %d", g_busy_frame_queue.num_of_frames);
-    } else {
-        ALOGE("cam_frame_post_video error... out of memory\n");
+bool QualcommCameraHardware::VideoFrameQueue::post(struct msm_frame *frame)
+{
+    Mutex::Autolock l(&mQueueLock);
+    if (mCount >= mCapacity) {
+        ALOGE("%s: video busy queue full, dropping %p", __FUNCTION__, frame);
+        return false;
+    }
+    mRing[(mHead + mCount) % kMaxSize] = frame;
+    mCount++;
+    mQueueWait.signal();
+    return true;
+}
+
+/* Non-blocking; returns NULL when the queue is empty. */
+struct msm_frame *QualcommCameraHardware::VideoFrameQueue::get()
+{
+    Mutex::Autolock l(&mQueueLock);
+    if (mCount == 0)
+        return NULL;
+    struct msm_frame *frame = mRing[mHead];
+    mHead = (mHead + 1) % kMaxSize;
+    mCount--;
+    return frame;
+}
+
+/* Blocks until frames are queued, then takes up to max of them in one
+ * go. Returns the number taken, or -1 once requestExit() was called. */
+int QualcommCameraHardware::VideoFrameQueue::drain(struct msm_frame **frames, int max)
+{
+    Mutex::Autolock l(&mQueueLock);
+    while (mCount == 0 && !mExit)
+        mQueueWait.wait(mQueueLock);
+    if (mExit)
+        return -1;
+    int n = mCount < max ? mCount : max;
+    for (int i = 0; i < n; i++) {
+        frames[i] = mRing[mHead];
+        mHead = (mHead + 1) % kMaxSize;
     }
+    mCount -= n;
+    return n;
+}
+
+void QualcommCameraHardware::VideoFrameQueue::requestExit()
+{
+    Mutex::Autolock l(&mQueueLock);
+    mExit = true;
+    mQueueWait.signal();
+}
+
+/* Called before starting a new video thread. */
+void QualcommCameraHardware::VideoFrameQueue::resetExit()
+{
+    Mutex::Autolock l(&mQueueLock);
+    mExit = false;
+}
+
+void QualcommCameraHardware::VideoFrameQueue::flush()
+{
+    Mutex::Autolock l(&mQueueLock);
+    mHead = 0;
+    mCount = 0;
+}
+
+int QualcommCameraHardware::VideoFrameQueue::count()
+{
+    Mutex::Autolock l(&mQueueLock);
+    return mCount;
+}
+
+#define TB_PACK(back, ready, front) ((back) | ((ready) << 2) | ((front) << 4))
+#define TB_BACK(s) ((s) & 3)
+#define TB_READY(s) (((s) >> 2) & 3)
+#define TB_FRONT(s) (((s) >> 4) & 3)
+#define TB_FRESH 0x40
+
+QualcommCameraHardware::TripleBuffer::TripleBuffer()
+{
+    mState = TB_PACK(0, 1, 2);
+}
+
+void QualcommCameraHardware::TripleBuffer::reset()
+{
+    android_atomic_release_store(TB_PACK(0, 1, 2), &mState);
+}
+
+/* Only publish() moves the back slot, so the producer can hold on to it. */
+int QualcommCameraHardware::TripleBuffer::back()
+{
+    return TB_BACK(android_atomic_acquire_load(&mState));
+}
+
+/* Returns whether a published slot was replaced before anyone took it. */
+bool QualcommCameraHardware::TripleBuffer::publish()
+{
+    int32_t old, next;
+    do {
+        old = android_atomic_acquire_load(&mState);
+        next = TB_PACK(TB_READY(old), TB_BACK(old), TB_FRONT(old)) | TB_FRESH;
+    } while (android_atomic_release_cas(old, next, &mState) != 0);
+    return (old & TB_FRESH) != 0;
+}
+
+/* Returns the newest published slot, or -1 if none came since last time. */
+int QualcommCameraHardware::TripleBuffer::acquire()
+{
+    int32_t old, next;
+    do {
+        old = android_atomic_acquire_load(&mState);
+        if (!(old & TB_FRESH))
+            return -1;
+        next = TB_PACK(TB_BACK(old), TB_FRONT(old), TB_READY(old));
+    } while (android_atomic_release_cas(old, next, &mState) != 0);
+    return TB_READY(old);
+}
+
+QualcommCameraHardware::PreviewCallbackQueue::PreviewCallbackQueue()
+{
+    mExit = false;
+    mLatestOnly = true;
+    mHead = 0;
+    mCount = 0;
+    mCapacity = 1;
+}
+
+void QualcommCameraHardware::PreviewCallbackQueue::init(int capacity, bool latestOnly)
+{
+    Mutex::Autolock l(&mQueueLock);
+    if (capacity <= 0 || capacity > kMaxSize)
+        capacity = kMaxSize;
+    mCapacity = latestOnly ? 1 : capacity;
+    mLatestOnly = latestOnly;
+    mExit = false;
+    mHead = 0;
+    mCount = 0;
+}
+
+/* Returns the slot that was dropped to stay within bounds, or -1. */
+int QualcommCameraHardware::PreviewCallbackQueue::post(int slot)
+{
+    Mutex::Autolock l(&mQueueLock);
+    int dropped = -1;
+    if (mExit)
+        return slot;
+    if (mCount >= mCapacity) {
+        if (!mLatestOnly)
+            return slot;
+        dropped = mRing[mHead];
+        mHead = (mHead + 1) % kMaxSize;
+        mCount--;
+    }
+    mRing[(mHead + mCount) % kMaxSize] = slot;
+    mCount++;
+    mQueueWait.signal();
+    return dropped;
+}
+
+/* Blocks for the next slot; -1 once requestExit() was called. */
+int QualcommCameraHardware::PreviewCallbackQueue::get()
+{
+    Mutex::Autolock l(&mQueueLock);
+    while (mCount == 0 && !mExit)
+        mQueueWait.wait(mQueueLock);
+    if (mExit)
+        return -1;
+    int slot = mRing[mHead];
+    mHead = (mHead + 1) % kMaxSize;
+    mCount--;
+    return slot;
+}
+
+/* Non-blocking; -1 when empty. */
+int QualcommCameraHardware::PreviewCallbackQueue::take()
+{
+    Mutex::Autolock l(&mQueueLock);
+    if (mCount == 0)
+        return -1;
+    int slot = mRing[mHead];
+    mHead = (mHead + 1) % kMaxSize;
+    mCount--;
+    return slot;
+}
 
-    pthread_mutex_unlock(&(g_busy_frame_queue.mut));
-    pthread_cond_signal(&(g_busy_frame_queue.wait));
+void QualcommCameraHardware::PreviewCallbackQueue::requestExit()
+{
+    Mutex::Autolock l(&mQueueLock);
+    mExit = true;
+    mQueueWait.signal();
+}
 
-    ALOGV("cam_frame_post_video... out = %lx\n", p->buffer);
+int QualcommCameraHardware::PreviewCallbackQueue::count()
+{
+    Mutex::Autolock l(&mQueueLock);
+    return mCount;
 }
 
 QualcommCameraHardware::FrameQueue::FrameQueue()
 {
     mInitialized = false;
+    mWaiting = false;
+    mHead = 0;
+    mTail = 0;
+    mCapacity = kMaxSize;
 }
 
 QualcommCameraHardware::FrameQueue::~FrameQueue()
@@ -746,60 +995,88 @@ QualcommCameraHardware::FrameQueue::~FrameQueue()
     flush();
 }
 
-void QualcommCameraHardware::FrameQueue::init()
+void QualcommCameraHardware::FrameQueue::init(int capacity)
 {
     Mutex::Autolock l(&mQueueLock);
-    mInitialized = true;
+    if (capacity <= 0 || capacity > kMaxSize) {
+        ALOGW("%s: capacity %d out of range, using %d", __FUNCTION__, capacity, kMaxSize);
+        capacity = kMaxSize;
+    }
+    mCapacity = capacity;
+    android_atomic_release_store(true, &mInitialized);
     mQueueWait.signal();
 }
 
 void QualcommCameraHardware::FrameQueue::deinit()
 {
     Mutex::Autolock l(&mQueueLock);
-    mInitialized = false;
+    android_atomic_release_store(false, &mInitialized);
     mQueueWait.signal();
 }
 
 bool QualcommCameraHardware::FrameQueue::isInitialized()
 {
-    Mutex::Autolock l(&mQueueLock);
-    return mInitialized;
+    return android_atomic_acquire_load(&mInitialized);
 }
 
+/* Producer side, called from the frame thread. */
 bool QualcommCameraHardware::FrameQueue::add(struct msm_frame *element)
 {
-    Mutex::Autolock l(&mQueueLock);
-    if (mInitialized == false)
+    if (!android_atomic_acquire_load(&mInitialized))
         return false;
 
-    mContainer.add(element);
-    mQueueWait.signal();
+    int32_t tail = mTail;
+    if ((uint32_t)(tail - android_atomic_acquire_load(&mHead)) >= (uint32_t)mCapacity)
+        return false;
+
+    mRing[tail & (kMaxSize - 1)] = element;
+    android_atomic_release_store((int32_t)((uint32_t)tail + 1), &mTail);
+
+    /* Pairs with the barrier in get(): either we see the consumer is
+     * about to sleep, or the consumer sees the new tail. */
+    android_memory_barrier();
+    if (android_atomic_acquire_load(&mWaiting)) {
+        Mutex::Autolock l(&mQueueLock);
+        mQueueWait.signal();
+    }
     return true;
 }
 
+/* Consumer side, called from the preview thread. */
 struct msm_frame *QualcommCameraHardware::FrameQueue::get()
 {
-    struct msm_frame *frame;
-    mQueueLock.lock();
-    while (mInitialized && mContainer.isEmpty()) {
-        mQueueWait.wait(mQueueLock);
-    }
+    for (;;) {
+        if (!android_atomic_acquire_load(&mInitialized))
+            return NULL;
+
+        int32_t head = mHead;
+        if (head != android_atomic_acquire_load(&mTail)) {
+            struct msm_frame *frame = mRing[head & (kMaxSize - 1)];
+            android_atomic_release_store((int32_t)((uint32_t)head + 1), &mHead);
+            return frame;
+        }
 
-    if (!mInitialized) {
+        mQueueLock.lock();
+        android_atomic_release_store(true, &mWaiting);
+        android_memory_barrier();
+        while (mInitialized && head == android_atomic_acquire_load(&mTail)) {
+            mQueueWait.wait(mQueueLock);
+        }
+        android_atomic_release_store(false, &mWaiting);
         mQueueLock.unlock();
-        return NULL;
     }
-
-    frame = mContainer.itemAt(0);
-    mContainer.removeAt(0);
-    mQueueLock.unlock();
-    return frame;
 }
 
+/* Drops every queued frame. Must not race with get(). */
 void QualcommCameraHardware::FrameQueue::flush()
 {
-    Mutex::Autolock l(&mQueueLock);
-    mContainer.clear();
+    android_atomic_release_store(android_atomic_acquire_load(&mTail), &mHead);
+}
+
+int QualcommCameraHardware::FrameQueue::count()
+{
+    return (int)((uint32_t)android_atomic_acquire_load(&mTail) -
+        (uint32_t)android_atomic_acquire_load(&mHead));
 }
 
 void QualcommCameraHardware::storeTargetType(void)
@@ -952,10 +1229,22 @@ QualcommCameraHardware::QualcommCameraHardware()
       mZslFlashEnable(false),
       mSnapshotCancel(false),
       mHFRMode(false),
+      mHFRDivisor(1),
+      mHFRFrameCount(0),
       mActualPictWidth(0),
       mActualPictHeight(0),
       mPreviewStopping(false),
       mInHFRThread(false),
+      mStreamWindow(NULL),
+      mStreamWidth(0),
+      mStreamHeight(0),
+      mStreamFormat(0),
+      mStreamPostviews(0),
+      mPreviewActiveMask(0),
+      mRetainBuffers(false),
+      mStreamReconfigs(0),
+      mStreamRestarts(0),
+      mLastModeSwitchTime(0),
       mHdrMode(false),
       mExpBracketMode(false),
       mRecordingState(0)
@@ -973,6 +1262,101 @@ QualcommCameraHardware::QualcommCameraHardware()
     property_get("persist.camera.hal.multitouchaf", value, "0");
     mMultiTouch = atoi(value);
 
+    /* Hand finished JPEGs to the app without copying them */
+    property_get("persist.camera.hal.jpeg_zerocopy", value, "0");
+    mJpegZeroCopy = atoi(value) != 0;
+
+    /* Keep snapshot heaps between captures */
+    property_get("persist.camera.hal.snapshot_pool", value, "1");
+    mSnapshotPoolEnabled = atoi(value) != 0;
+    mSnapshotPoolSize = 0;
+    mSnapshotPoolCbCrOffset = 0;
+    mSnapshotPoolYOffset = 0;
+    mSnapshotPoolHits = 0;
+    mSnapshotPoolMisses = 0;
+
+    /* App preview callbacks: "latest" keeps only the newest pending
+     * frame, "backlog" queues up to preview_cb_depth of them. */
+    property_get("persist.camera.hal.preview_cb_policy", value, "latest");
+    mPreviewCbLatestOnly = strcmp(value, "backlog") != 0;
+    property_get("persist.camera.hal.preview_cb_depth", value, "2");
+    mPreviewCbDepth = atoi(value);
+    if (mPreviewCbDepth < 1 || mPreviewCbDepth > PreviewCallbackQueue::kMaxSize)
+        mPreviewCbDepth = 2;
+    mPreviewCbThreadRunning = false;
+    mPreviewConvert = NV21_CONVERT_NONE;
+    mPreviewConvertName = CameraParameters::PIXEL_FORMAT_YUV420SP;
+    for (int i = 0; i < kConvertBufferCount; i++)
+        mConvertMapped[i] = NULL;
+    mConvertNext = 0;
+    mConvertSize = 0;
+    mConvertFrames = 0;
+    mConvertTime = 0;
+    mPreviewCbWidth = 0;
+    mPreviewCbHeight = 0;
+    mScaleScratch = NULL;
+    mScaleScratchSize = 0;
+    mPostviewFramesScaled = 0;
+
+    /* Histogram from the preview frames when the VFE has no stats, or
+     * when forced with persist.camera.hal.sw_histogram. */
+    property_get("persist.camera.hal.sw_histogram", value, "0");
+    mStatsSoftware = atoi(value) != 0;
+    mStatsOn = CAMERA_HISTOGRAM_DISABLE;
+    mStatsRequested = 0;
+    mStatsPublished = 0;
+    mStatsDelivered = 0;
+    mStatsOverwritten = 0;
+
+    /* Face detection results every fd_interval preview frames */
+    property_get("persist.camera.hal.fd_interval", value, "6");
+    mFaceInterval = atoi(value);
+    if (mFaceInterval < 1)
+        mFaceInterval = 6;
+    mFaceDetectOn = false;
+    mFaceSoftware = true;
+    mFaceFrameCount = 0;
+    mFaceSlot = -1;
+    mFaceThreadRunning = false;
+    mFaceThreadExit = false;
+    mFacesLast = 0;
+    mNextFaceId = 1;
+    mFaceMetaMem = NULL;
+    mFaceScratch = NULL;
+    mFaceFramesAnalysed = 0;
+    mFaceFramesSkipped = 0;
+    mFacesFound = 0;
+    mFaceTime = 0;
+
+    /* Smooth zoom crosses the whole zoom range in smooth_zoom_ms; 0 turns
+     * it off. */
+    property_get("persist.camera.hal.smooth_zoom_ms", value, "1000");
+    mSmoothZoomRangeMs = atoi(value);
+    if (mSmoothZoomRangeMs < 0)
+        mSmoothZoomRangeMs = 0;
+    mTargetSmoothZoom = 0;
+    mSmoothZoomPending = -1;
+    mSmoothZoomLevel = 0;
+    mSmoothZoomSteps = 0;
+    mSmoothZoomRetargets = 0;
+    mSmoothZoomCoalesced = 0;
+
+    /* Snapshot buffers kept in flight during a burst. Two are enough for
+     * readout of one shot to overlap encode of the previous one; a third
+     * costs another full-size snapshot buffer and is opt-in. */
+    property_get("persist.camera.hal.burst_depth", value, "0");
+    mBurstDepth = atoi(value);
+    if (mBurstDepth < 1)
+        mBurstDepth = kBurstDepth;
+    if (mBurstDepth > MAX_SNAPSHOT_BUFFERS)
+        mBurstDepth = MAX_SNAPSHOT_BUFFERS;
+    mBurstShots = 1;
+    mBurstRoundShots = 1;
+    mBurstShotsLeft = 0;
+    mBurstsTaken = 0;
+    mLastBurstShots = 0;
+    mLastBurstTime = 0;
+
     storeTargetType();
 
     mRawSnapshotMapped = NULL;
@@ -982,6 +1366,8 @@ QualcommCameraHardware::QualcommCameraHardware()
     for (int i = 0; i < MAX_SNAPSHOT_BUFFERS; i++) {
         mRawMapped[i] = NULL;
         mJpegMapped[i] = NULL;
+        mJpegfd[i] = -1;
+        mJpegLent[i] = false;
         mThumbnailMapped[i] = NULL;
         mThumbnailBuffer[i] = NULL;
     }
@@ -1020,7 +1406,42 @@ QualcommCameraHardware::QualcommCameraHardware()
             record_buffers_tracking_flag = new bool[kRecordBufferCount];
         }
     }
+    if (kRecordBufferCount > 0)
+        mVideoBusyQueue.init(kRecordBufferCount);
     mTotalPreviewBufferCount = kTotalPreviewBufferCount;
+    for (int i = 0; i < kTotalPreviewBufferCount; i++) {
+        mPreviewMapped[i] = NULL;
+        mPreviewCbMapped[i] = NULL;
+    }
+    resetPreviewStats();
+    mRecordStartTime = 0;
+    mRecordFramesReceived = 0;
+    mRecordFramesDropped = 0;
+    mVideoBatches = 0;
+    mVideoBatchMax = 0;
+    mRecordReturned = 0;
+    mRecordReturns = 0;
+    mRecordReturnsDeferred = 0;
+    for (int i = 0; i < RECORD_BUFFERS; i++)
+        mRecordSlotOwner[i] = SLOT_DRIVER;
+    mShotStartTime = 0;
+    mLastShotTime = 0;
+    mJpegZeroCopyCount = 0;
+    mJpegCopyCount = 0;
+    mParamsApplied = 0;
+    mParamsSkipped = 0;
+    mParamsInvalid = 0;
+    mParamGeneration = 0;
+    mFlatParamsGeneration = -1;
+    mFlatParamsBuilt = 0;
+    mFlatParamsReused = 0;
+    memset(&mSettings, 0, sizeof(mSettings));
+    mSettings.focusMode = mSettings.flashMode = NOT_FOUND;
+    mSettings.isoMode = mSettings.hfrMode = NOT_FOUND;
+    for (int i = 0; i < LOCK_MAX; i++) {
+        mLockAcquired[i] = 0;
+        mLockContended[i] = 0;
+    }
     if (mCurrentTarget != TARGET_MSM7630 && mCurrentTarget != TARGET_QSD8250
         && mCurrentTarget != TARGET_MSM8660) {
         for (int i = 0; i < mTotalPreviewBufferCount; i++)
@@ -1223,11 +1644,9 @@ void QualcommCameraHardware::initDefaultParameters()
         if (mCurrentTarget == TARGET_MSM8660)
             hdr_values = create_values_str(
                 hdr,sizeof(hdr)/sizeof(str_map));
-        //Currently Enabling Histogram for 8x60
-        if (mCurrentTarget == TARGET_MSM8660) {
-            histogram_values = create_values_str(
-                histogram,sizeof(histogram)/sizeof(str_map));
-        }
+        // 8x60 has VFE stats; elsewhere the preview frames are counted
+        histogram_values = create_values_str(
+            histogram,sizeof(histogram)/sizeof(str_map));
         //Currently Enabling Skin Tone Enhancement for 8x60 and 7630
         if ((mCurrentTarget == TARGET_MSM8660)||(mCurrentTarget == TARGET_MSM7630)) {
             skinToneEnhancement_values = create_values_str(
@@ -1346,10 +1765,8 @@ void QualcommCameraHardware::initDefaultParameters()
     mParameters.set(CameraParameters::KEY_SUPPORTED_JPEG_THUMBNAIL_SIZES,
                 valuesStr.string());
 
-    // Define CAMERA_SMOOTH_ZOOM in Android.mk file , to enable smoothzoom
-#ifdef CAMERA_SMOOTH_ZOOM
-    mParameters.set(CameraParameters::KEY_SMOOTH_ZOOM_SUPPORTED, "true");
-#endif
+    mParameters.set(CameraParameters::KEY_SMOOTH_ZOOM_SUPPORTED,
+                    supportsSmoothZoom() ? "true" : "false");
 
     if (zoomSupported) {
         mParameters.set(CameraParameters::KEY_ZOOM_SUPPORTED, "true");
@@ -1395,6 +1812,9 @@ void QualcommCameraHardware::initDefaultParameters()
     } else {
         preview_format_values = create_values_str(
             preview_formats, sizeof(preview_formats) / sizeof(str_map));
+        preview_format_values.append(",");
+        preview_format_values.append(create_values_str(converted_preview_formats,
+            sizeof(converted_preview_formats) / sizeof(str_map)));
         mParameters.set(CameraParameters::KEY_SUPPORTED_PREVIEW_FORMATS,
                 preview_format_values.string());
     }
@@ -1540,6 +1960,11 @@ void QualcommCameraHardware::initDefaultParameters()
                     CameraParameters::FACE_DETECTION_OFF);
     mParameters.set(CameraParameters::KEY_SUPPORTED_FACE_DETECTION,
                     facedetection_values);
+    mFaceSoftware = !supportsFaceDetection();
+    mParameters.set(CameraParameters::KEY_MAX_NUM_DETECTED_FACES_HW,
+                    mFaceSoftware ? 0 : MAX_ROI);
+    mParameters.set(CameraParameters::KEY_MAX_NUM_DETECTED_FACES_SW,
+                    mFaceSoftware ? NV21_MAX_FACES : 0);
     mParameters.set(CameraParameters::KEY_REDEYE_REDUCTION,
                     CameraParameters::REDEYE_REDUCTION_DISABLE);
     mParameters.set(CameraParameters::KEY_SUPPORTED_REDEYE_REDUCTION,
@@ -1572,6 +1997,9 @@ void QualcommCameraHardware::initDefaultParameters()
             numCapture = 1;
         mParameters.set("capture-burst-captures-values", maxSnapshot);
         mParameters.set("capture-burst-interval-supported", "false");
+    } else {
+        mParameters.set("capture-burst-captures-values", MAX_BURST_SHOTS);
+        mParameters.set("capture-burst-interval-supported", "false");
     }
     mParameters.set("num-snaps-per-shutter", numCapture);
     ALOGI("%s: setting num-snaps-per-shutter to %d", __FUNCTION__, numCapture);
@@ -1595,6 +2023,8 @@ void QualcommCameraHardware::initDefaultParameters()
             break;
     }
 
+    paramsChanged();
+    loadSettings();
     if (setParameters(mParameters) != NO_ERROR) {
         ALOGE("Failed to set default parameters?!");
     }
@@ -1711,7 +2141,6 @@ static bool native_stop_ops(mm_camera_ops_type_t type, void *value)
 
 /*==========================================================================*/
 
-#define GPS_PROCESSING_METHOD_SIZE  101
 #define FOCAL_LENGTH_DECIMAL_PRECISON 100
 
 static const char ExifAsciiPrefix[] = { 0x41, 0x53, 0x43, 0x49, 0x49, 0x0, 0x0, 0x0 };
@@ -1761,10 +2190,9 @@ static void addExifTag(exif_tag_id_t tagid, exif_tag_type_t type,
     exif_table_numEntries++;
 }
 
-static void parseLatLong(const char *latlonString, uint32_t *pDegrees,
+static void parseLatLong(double value, uint32_t *pDegrees,
     uint32_t *pMinutes, uint32_t *pSeconds)
 {
-    double value = atof(latlonString);
     value = fabs(value);
     int degrees = (int) value;
 
@@ -1777,11 +2205,11 @@ static void parseLatLong(const char *latlonString, uint32_t *pDegrees,
     *pSeconds = seconds;
 }
 
-static void setLatLon(exif_tag_id_t tag, const char *latlonString)
+static void setLatLon(exif_tag_id_t tag, double latlon)
 {
     uint32_t degrees, minutes, seconds;
 
-    parseLatLong(latlonString, &degrees, &minutes, &seconds);
+    parseLatLong(latlon, &degrees, &minutes, &seconds);
 
     rat_t value[3] = {
         { degrees, 1 },
@@ -1797,55 +2225,46 @@ static void setLatLon(exif_tag_id_t tag, const char *latlonString)
     }
 }
 
-void QualcommCameraHardware::setGpsParameters(void)
+void QualcommCameraHardware::setGpsParameters(const Settings& s)
 {
-    const char *str = NULL;
-
-    str = mParameters.get(CameraParameters::KEY_GPS_PROCESSING_METHOD);
-    if (str) {
+    if (s.gpsProcessingMethod[0]) {
         memcpy(gpsProcessingMethod, ExifAsciiPrefix, EXIF_ASCII_PREFIX_SIZE);
-        strncpy(gpsProcessingMethod + EXIF_ASCII_PREFIX_SIZE, str,
-            GPS_PROCESSING_METHOD_SIZE - 1);
-        gpsProcessingMethod[EXIF_ASCII_PREFIX_SIZE + GPS_PROCESSING_METHOD_SIZE-1] = '\0';
+        strlcpy(gpsProcessingMethod + EXIF_ASCII_PREFIX_SIZE, s.gpsProcessingMethod,
+            GPS_PROCESSING_METHOD_SIZE);
         addExifTag(EXIFTAGID_GPS_PROCESSINGMETHOD, EXIF_ASCII,
             EXIF_ASCII_PREFIX_SIZE + strlen(gpsProcessingMethod + EXIF_ASCII_PREFIX_SIZE) + 1,
             1, gpsProcessingMethod);
     }
 
     // set latitude
-    str = mParameters.get(CameraParameters::KEY_GPS_LATITUDE);
-    if (str) {
-        setLatLon(EXIFTAGID_GPS_LATITUDE, str);
+    if (s.hasGpsLatitude) {
+        setLatLon(EXIFTAGID_GPS_LATITUDE, s.gpsLatitude);
         //set latitude ref
-        float latitudeValue = mParameters.getFloat(CameraParameters::KEY_GPS_LATITUDE);
-        if (latitudeValue < 0)
+        if (s.gpsLatitude < 0)
             latref[0] = 'S';
         else
             latref[0] = 'N';
         latref[1] = '\0';
-        mParameters.set(CameraParameters::KEY_GPS_LATITUDE_REF, latref);
+        setParamIfChanged(CameraParameters::KEY_GPS_LATITUDE_REF, latref);
         addExifTag(EXIFTAGID_GPS_LATITUDE_REF, EXIF_ASCII, 2, 1, latref);
     }
 
     // set longitude
-    str = mParameters.get(CameraParameters::KEY_GPS_LONGITUDE);
-    if (str) {
-        setLatLon(EXIFTAGID_GPS_LONGITUDE, str);
+    if (s.hasGpsLongitude) {
+        setLatLon(EXIFTAGID_GPS_LONGITUDE, s.gpsLongitude);
         // set longitude ref
-        float longitudeValue = mParameters.getFloat(CameraParameters::KEY_GPS_LONGITUDE);
-        if (longitudeValue < 0)
+        if (s.gpsLongitude < 0)
             lonref[0] = 'W';
         else
             lonref[0] = 'E';
         lonref[1] = '\0';
-        mParameters.set(CameraParameters::KEY_GPS_LONGITUDE_REF, lonref);
+        setParamIfChanged(CameraParameters::KEY_GPS_LONGITUDE_REF, lonref);
         addExifTag(EXIFTAGID_GPS_LONGITUDE_REF, EXIF_ASCII, 2, 1, lonref);
     }
 
     // set altitude
-    str = mParameters.get(CameraParameters::KEY_GPS_ALTITUDE);
-    if (str) {
-        double value = atof(str);
+    if (s.hasGpsAltitude) {
+        double value = s.gpsAltitude;
         int ref = 0;
         if (value < 0) {
             ref = 1;
@@ -1856,18 +2275,16 @@ void QualcommCameraHardware::setGpsParameters(void)
         memcpy(&altitude, &alt_value, sizeof(altitude));
         addExifTag(EXIFTAGID_GPS_ALTITUDE, EXIF_RATIONAL, 1, 1, &altitude);
         // set altitude ref
-        mParameters.set(CameraParameters::KEY_GPS_ALTITUDE_REF, ref);
+        setParamIfChanged(CameraParameters::KEY_GPS_ALTITUDE_REF, ref ? "1" : "0");
         addExifTag(EXIFTAGID_GPS_ALTITUDE_REF, EXIF_BYTE, 1, 1, &ref);
     }
 
     // set gps timestamp
-    str = mParameters.get(CameraParameters::KEY_GPS_TIMESTAMP);
-    if (str) {
-        long value = atol(str);
+    if (s.hasGpsTimestamp) {
         time_t unixTime;
         struct tm *UTCTimestamp;
 
-        unixTime = (time_t)value;
+        unixTime = (time_t)s.gpsTimestamp;
         UTCTimestamp = gmtime(&unixTime);
 
         strftime(gpsDatestamp, sizeof(gpsDatestamp), "%Y:%m:%d", UTCTimestamp);
@@ -1892,10 +2309,11 @@ void QualcommCameraHardware::setExifInfo(void)
     property_get("ro.product.model", exif_model, "QCAM-AA");
     addExifTag(EXIFTAGID_MODEL, EXIF_ASCII, strlen(exif_model) + 1, 1, exif_model);
 
+    Settings s = settings();
+
     // set timestamp
-    const char *date_str = mParameters.get(CameraParameters::KEY_EXIF_DATETIME);
-    if (date_str) {
-        strncpy(exif_date, date_str, 20);
+    if (s.exifDateTime[0]) {
+        memcpy(exif_date, s.exifDateTime, sizeof(exif_date));
         addExifTag(EXIFTAGID_EXIF_DATE_TIME_ORIGINAL, EXIF_ASCII, strlen(exif_date) + 1, 1, exif_date);
         addExifTag(EXIFTAGID_EXIF_DATE_TIME_CREATED, EXIF_ASCII, strlen(exif_date) + 1, 1, exif_date);
     } else {
@@ -1917,23 +2335,22 @@ void QualcommCameraHardware::setExifInfo(void)
     }
 
     // set gps
-    setGpsParameters();
+    setGpsParameters(s);
 
     // set flash
-    const char *flash_str = mParameters.get(CameraParameters::KEY_FLASH_MODE);
-    if (flash_str) {
+    if (s.flashMode != NOT_FOUND) {
         int is_flash_fired = 0;
         if (mCfgControl.mm_camera_get_parm(CAMERA_PARM_QUERY_FALSH4SNAP,
             &is_flash_fired) != MM_CAMERA_SUCCESS) {
             flashMode = FLASH_SNAP; //for No Flash support,bit 5 will be 1
         } else {
-            if (!strcmp(flash_str, "on"))
+            if (s.flashMode == LED_MODE_ON)
                 flashMode = 1;
 
-            if (!strcmp(flash_str, "off"))
+            if (s.flashMode == LED_MODE_OFF)
                 flashMode = 0;
 
-            if (!strcmp(flash_str, "auto")) {
+            if (s.flashMode == LED_MODE_AUTO) {
                 //for AUTO bits 3 and 4 will be 1
                 //for flash fired bit 0 will be 1, else 0
                 flashMode = FLASH_AUTO;
@@ -1944,17 +2361,16 @@ void QualcommCameraHardware::setExifInfo(void)
         addExifTag(EXIFTAGID_FLASH, EXIF_SHORT, 1, 1, &flashMode);
     }
     // set focal length
-    uint32_t focalLengthValue = (mParameters.getFloat(
-        CameraParameters::KEY_FOCAL_LENGTH) * FOCAL_LENGTH_DECIMAL_PRECISON);
+    uint32_t focalLengthValue = (s.focalLength * FOCAL_LENGTH_DECIMAL_PRECISON);
     rat_t focalLengthRational = {focalLengthValue, FOCAL_LENGTH_DECIMAL_PRECISON};
     memcpy(&focalLength, &focalLengthRational, sizeof(focalLengthRational));
     addExifTag(EXIFTAGID_FOCAL_LENGTH, EXIF_RATIONAL, 1, 1, &focalLength);
 
     // set iso speed rating
-    const char *iso_str = mParameters.get(CameraParameters::KEY_ISO_MODE);
-    int iso_value = attr_lookup(iso, sizeof(iso) / sizeof(str_map), iso_str);
-    isoMode = iso_arr[iso_value];
-    addExifTag(EXIFTAGID_ISO_SPEED_RATING, EXIF_SHORT, 1, 1, &isoMode);
+    if (s.isoMode != NOT_FOUND) {
+        isoMode = iso_arr[s.isoMode];
+        addExifTag(EXIFTAGID_ISO_SPEED_RATING, EXIF_SHORT, 1, 1, &isoMode);
+    }
 }
 
 bool QualcommCameraHardware::initZslParameter(void)
@@ -1982,11 +2398,44 @@ bool QualcommCameraHardware::initZslParameter(void)
     return true;
 }
 
+/* Pushes again what initRaw() and initImageEncodeParameters() gave the
+ * driver after mm_camera_init, for the later rounds of a burst which
+ * re-initialise the capture ops. The encode parameters themselves, EXIF
+ * included, are handed to every mm_camera_start. */
+bool QualcommCameraHardware::setCaptureParms()
+{
+    Settings s = settings();
+    if (!native_set_parms(CAMERA_PARM_DIMENSION, sizeof(cam_ctrl_dimension_t), &mDimension))
+        return false;
+
+    int rotation = mIs3DModeOn ? 0 : s.rotation;
+    if (!native_set_parms(CAMERA_PARM_JPEG_ROTATION, sizeof(int), &rotation))
+        return false;
+
+    // Zero is not accepted by the camera stack; see initImageEncodeParameters().
+    int quality = s.jpegQuality;
+    if (quality >= 0) {
+        if (quality == 0)
+            quality = 85;
+        if (!native_set_parms(CAMERA_PARM_JPEG_MAINIMG_QUALITY, sizeof(int), &quality))
+            return false;
+    }
+    quality = s.thumbnailQuality;
+    if (quality >= 0) {
+        if (quality == 0)
+            quality = 85;
+        if (!native_set_parms(CAMERA_PARM_JPEG_THUMB_QUALITY, sizeof(int), &quality))
+            return false;
+    }
+    return true;
+}
+
 bool QualcommCameraHardware::initImageEncodeParameters(int size)
 {
     ALOGV("%s: E", __FUNCTION__);
     memset(&mImageEncodeParms, 0, sizeof(encode_params_t));
-    int jpeg_quality = mParameters.getInt(CameraParameters::KEY_JPEG_QUALITY);
+    Settings s = settings();
+    int jpeg_quality = s.jpegQuality;
     bool ret;
     if (jpeg_quality >= 0) {
         ALOGV("initJpegParameters, current jpeg main img quality =%d",
@@ -2005,7 +2454,7 @@ bool QualcommCameraHardware::initImageEncodeParameters(int size)
         }
     }
 
-    int thumbnail_quality = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY);
+    int thumbnail_quality = s.thumbnailQuality;
     if (thumbnail_quality >= 0) {
         //Application can pass quality of zero
         //when there is no back sensor connected.
@@ -2024,7 +2473,7 @@ bool QualcommCameraHardware::initImageEncodeParameters(int size)
         }
     }
 
-    int rotation = mParameters.getInt(CameraParameters::KEY_ROTATION);
+    int rotation = s.rotation;
 
     if (mIs3DModeOn)
         rotation = 0;
@@ -2054,6 +2503,7 @@ bool QualcommCameraHardware::initImageEncodeParameters(int size)
         mEncodeOutputBuffer[i].offset = 0;
     }
     mImageEncodeParms.p_output_buffer = mEncodeOutputBuffer;
+    mImageEncodeParms.buffer_count = size;
     mImageEncodeParms.exif_data = exif_data;
     mImageEncodeParms.exif_numEntries = exif_table_numEntries;
 
@@ -2143,7 +2593,8 @@ void QualcommCameraHardware::runFrameThread(void *data)
     //startPreview is called again with the same ANativeWindow object (snapshot case). If the
     //ANativeWindow is a new one(camera-camcorder switch case) because the app passed a new
     //surface then buffers will be re-allocated and not returned from the old pool.
-    relinquishBuffers();
+    if (!mRetainBuffers)
+        relinquishBuffers();
     mPreviewBusyQueue.flush();
     /* Flush the Free Q */
     LINK_camframe_release_all_frames(CAM_PREVIEW_FRAME);
@@ -2211,7 +2662,6 @@ void QualcommCameraHardware::runFrameThread(void *data)
 
 void QualcommCameraHardware::runPreviewThread(void *data)
 {
-    static int hfr_count = 0;
     msm_frame *frame = NULL;
     status_t retVal = NO_ERROR;
     android_native_buffer_t *buffer;
@@ -2219,7 +2669,11 @@ void QualcommCameraHardware::runPreviewThread(void *data)
     int bufferIndex = 0;
 
     while ((frame = mPreviewBusyQueue.get()) != NULL) {
-        mCallbackLock.lock();
+        nsecs_t dequeued = systemTime();
+        // Only a buffer dequeued from the window in this iteration is
+        // given back below.
+        handle = NULL;
+        lockCounted(mCallbackLock, LOCK_CALLBACK);
         int msgEnabled = mMsgEnabled;
         camera_data_callback pcb = mDataCallback;
         void *pdata = mCallbackCookie;
@@ -2229,13 +2683,6 @@ void QualcommCameraHardware::runPreviewThread(void *data)
         void *mdata = mCallbackCookie;
         mCallbackLock.unlock();
 
-        // signal smooth zoom thread , that a new preview frame is available
-        mSmoothzoomThreadWaitLock.lock();
-        if (mSmoothzoomThreadRunning) {
-            mSmoothzoomThreadWait.signal();
-        }
-        mSmoothzoomThreadWaitLock.unlock();
-
         // Find the offset within the heap of the current buffer.
         ssize_t offset_addr = 0; // TODO , use proper value
         common_crop_t *crop = (common_crop_t *) (frame->cropinfo);
@@ -2288,60 +2735,66 @@ void QualcommCameraHardware::runPreviewThread(void *data)
 
         bufferIndex = mapBuffer(frame);
         if (bufferIndex >= 0) {
+            nsecs_t received = mPreviewReceivedAt[bufferIndex];
+            computeSoftwareStats(bufferIndex);
+            postFaceFrame(bufferIndex, frame);
+            mPreviewLatency[PREVIEW_STAGE_QUEUE].record(dequeued - mPreviewQueuedAt[bufferIndex]);
+            // This thread holds one reference until the window has the
+            // buffer, when it becomes the display's; the callback worker
+            // takes another.
+            android_atomic_inc(&mPreviewRefs[bufferIndex]);
             if (pcb != NULL && (msgEnabled & CAMERA_MSG_PREVIEW_FRAME)) {
-                int previewBufSize;
-                /* for CTS : Forcing preview memory buffer lenth to be
-                    'previewWidth * previewHeight * 3/2'. Needed when gralloc allocated extra memory.*/
-                if ( mPreviewFormat == CAMERA_YUV_420_NV21) {
-                    previewBufSize = previewWidth * previewHeight * 3/2;
-                    camera_memory_t *previewMem = mGetMemory(frames[bufferIndex].fd, previewBufSize, 1, mCallbackCookie);
-                    if (!previewMem || !previewMem->data) {
-                        ALOGE("%s: mGetMemory failed.\n", __func__);
-                    } else {
-                        pcb(CAMERA_MSG_PREVIEW_FRAME,previewMem,0,NULL,pdata);
-                        previewMem->release(previewMem);
+                if (mPreviewCbThreadRunning) {
+                    android_atomic_inc(&mPreviewRefs[bufferIndex]);
+                    int dropped = mPreviewCallbackQueue.post(bufferIndex);
+                    if (dropped >= 0) {
+                        android_atomic_inc(&mPreviewDrops[PREVIEW_DROP_CALLBACK]);
+                        releasePreviewRef(dropped);
                     }
-                } else
-                    pcb(CAMERA_MSG_PREVIEW_FRAME,(camera_memory_t *) mPreviewMapped[bufferIndex],0,NULL,pdata);
+                } else {
+                    nsecs_t cbStart = systemTime();
+                    deliverPreviewFrame(pcb, pdata, bufferIndex);
+                    mPreviewLatency[PREVIEW_STAGE_CALLBACK].record(systemTime() - cbStart);
+                }
             }
 
             // TODO : may have to reutn proper frame as pcb
-            mDisplayLock.lock();
-            if (mPreviewWindow != NULL) {
-                const char *str = mParameters.get(CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE);
-                if (str != NULL) {
-                    int is_hfr_off = 0;
-                    hfr_count++;
-                    if (!strcmp(str, CameraParameters::VIDEO_HFR_OFF)) {
-                        is_hfr_off = 1;
-                        retVal = mPreviewWindow->enqueue_buffer(mPreviewWindow,
-                                            frame_buffer[bufferIndex].buffer);
-                    } else if (!strcmp(str, CameraParameters::VIDEO_HFR_2X)) {
-                        hfr_count %= 2;
-                    } else if (!strcmp(str, CameraParameters::VIDEO_HFR_3X)) {
-                        hfr_count %= 3;
-                    } else if (!strcmp(str, CameraParameters::VIDEO_HFR_4X)) {
-                        hfr_count %= 4;
-                    }
-                    if (hfr_count == 0)
-                        retVal = mPreviewWindow->enqueue_buffer(mPreviewWindow,
-                                            frame_buffer[bufferIndex].buffer);
-                    else if (!is_hfr_off)
-                        retVal = mPreviewWindow->cancel_buffer(mPreviewWindow,
+            lockCounted(mDisplayLock, LOCK_DISPLAY);
+            if (mPreviewWindow == NULL) {
+                releasePreviewRef(bufferIndex);
+            } else {
+                nsecs_t enqueueStart = systemTime();
+                bool displayed = true;
+                int32_t divisor = android_atomic_acquire_load(&mHFRDivisor);
+                if (divisor > 1 && (++mHFRFrameCount % divisor) != 0) {
+                    displayed = false;
+                    retVal = mPreviewWindow->cancel_buffer(mPreviewWindow,
                                             frame_buffer[bufferIndex].buffer);
                 } else
                     retVal = mPreviewWindow->enqueue_buffer(mPreviewWindow,
                                             frame_buffer[bufferIndex].buffer);
-                if (retVal != NO_ERROR)
+                nsecs_t enqueueEnd = systemTime();
+                if (retVal != NO_ERROR) {
                     ALOGE("%s: Failed while queueing buffer %d for display."
                         " Error = %d", __FUNCTION__, frames[bufferIndex].fd, retVal);
+                    android_atomic_inc(&mPreviewDrops[PREVIEW_DROP_DISPLAY]);
+                    // The window never took it; give the driver it back.
+                    releasePreviewRef(bufferIndex);
+                } else if (!displayed) {
+                    mPreviewSlotOwner[bufferIndex] = SLOT_DISPLAY;
+                    android_atomic_inc(&mPreviewDrops[PREVIEW_DROP_HFR]);
+                } else {
+                    mPreviewSlotOwner[bufferIndex] = SLOT_DISPLAY;
+                    mPreviewLatency[PREVIEW_STAGE_ENQUEUE].record(enqueueEnd - enqueueStart);
+                    mPreviewLatency[PREVIEW_STAGE_DISPLAY].record(enqueueEnd - received);
+                }
                 int stride;
                 retVal = mPreviewWindow->dequeue_buffer(mPreviewWindow,
                                             &handle,&stride);
-                private_handle_t *bhandle = (private_handle_t *)(*handle);
                 if (retVal != NO_ERROR) {
                     ALOGE("%s: Failed while dequeueing buffer from display."
                         " Error = %d", __FUNCTION__, retVal);
+                    handle = NULL;
                 } else {
                     retVal = mPreviewWindow->lock_buffer(mPreviewWindow,handle);
                     //yyan todo use handle to find out buffer
@@ -2349,10 +2802,14 @@ void QualcommCameraHardware::runPreviewThread(void *data)
                         ALOGE("%s: Failed while dequeueing buffer from"
                             "display. Error = %d", __FUNCTION__, retVal);
                 }
+                if (retVal == NO_ERROR)
+                    mPreviewLatency[PREVIEW_STAGE_DEQUEUE].record(systemTime() - enqueueEnd);
             }
             mDisplayLock.unlock();
-        } else
+        } else {
             ALOGE("Could not find the buffer");
+            android_atomic_inc(&mPreviewDrops[PREVIEW_DROP_UNMAPPED]);
+        }
 
         // If output  is NOT enabled (targets otherthan 7x30 , 8x50 and 8x60 currently..)
 
@@ -2382,38 +2839,14 @@ void QualcommCameraHardware::runPreviewThread(void *data)
             }
         }
 
-        if (mCurrentTarget == TARGET_MSM8660) {
-            mMetaDataWaitLock.lock();
-            if (mFaceDetectOn == true && mSendMetaData == true) {
-                mSendMetaData = false;
-                fd_roi_t *fd = (fd_roi_t *)(frame->roi_info.info);
-                int faces_detected = fd->rect_num;
-                int max_faces_detected = MAX_ROI * 4;
-                int array[max_faces_detected + 1];
-
-                array[0] = faces_detected * 4;
-                for (int i = 1, j = 0;j < MAX_ROI; j++, i = i + 4) {
-                    if (j < faces_detected) {
-                        array[i]   = fd->faces[j].x;
-                        array[i+1] = fd->faces[j].y;
-                        array[i+2] = fd->faces[j].dx;
-                        array[i+3] = fd->faces[j].dx;
-                    } else {
-                        array[i]   = -1;
-                        array[i+1] = -1;
-                        array[i+2] = -1;
-                        array[i+3] = -1;
-                    }
-                }
-            } else {
-                mMetaDataWaitLock.unlock();
-            }
-        }
+        if (handle == NULL)
+            continue;
         bufferIndex = mapFrame(handle);
         if (bufferIndex >= 0) {
-            LINK_camframe_add_frame(CAM_PREVIEW_FRAME, &frames[bufferIndex]);
+            releasePreviewRef(bufferIndex);
         } else {
             ALOGE("Could not find the Frame");
+            android_atomic_inc(&mPreviewDrops[PREVIEW_DROP_UNMAPPED]);
 
             // Special Case: Stoppreview is issued which causes thumbnail buffer
             // to be cancelled. Frame thread has still not exited. In preview thread
@@ -2430,96 +2863,654 @@ void QualcommCameraHardware::runPreviewThread(void *data)
             mDisplayLock.unlock();
         }
     }
+
+    // The callback worker gives back what it still holds before the frame
+    // thread releases all preview frames.
+    mPreviewCallbackQueue.requestExit();
+    mPreviewCbThreadWaitLock.lock();
+    while (mPreviewCbThreadRunning)
+        mPreviewCbThreadWait.wait(mPreviewCbThreadWaitLock);
+    mPreviewCbThreadWaitLock.unlock();
+
+    // Likewise the face worker; detection ends with the preview.
+    mMetaDataWaitLock.lock();
+    if (mFaceSoftware)
+        mFaceDetectOn = false;
+    mFaceThreadExit = true;
+    mFaceWait.signal();
+    while (mFaceThreadRunning)
+        mFaceThreadWait.wait(mMetaDataWaitLock);
+    mMetaDataWaitLock.unlock();
+
+    String8 stats;
+    dumpPreviewStats(stats);
+    ALOGV("preview thread exiting, pipeline stats:\n%s", stats.string());
+
     mPreviewThreadWaitLock.lock();
     mPreviewThreadRunning = false;
     mPreviewThreadWait.signal();
     mPreviewThreadWaitLock.unlock();
 }
 
-int QualcommCameraHardware::mapBuffer(struct msm_frame *frame)
+BufferIndexMap::BufferIndexMap()
 {
-    int ret = -1;
-    for (int cnt = 0; cnt < mTotalPreviewBufferCount; cnt++) {
-        if (frame_buffer[cnt].frame->buffer == frame->buffer) {
-            ret = cnt;
-            break;
-        }
-    }
-    return ret;
+    clear();
 }
 
-int QualcommCameraHardware::mapvideoBuffer(struct msm_frame *frame)
+void BufferIndexMap::clear()
 {
-    int ret = -1;
-    for (int cnt = 0; cnt < kRecordBufferCount; cnt++) {
-        if ((unsigned int)mRecordMapped[cnt]->data == (unsigned int)frame->buffer) {
-            ret = cnt;
-            ALOGE("found match returning %d", ret);
-            break;
-        }
+    for (int i = 0; i < kSize; i++) {
+        mKeys[i] = NULL;
+        mIndex[i] = -1;
     }
-    return ret;
 }
 
-int QualcommCameraHardware::mapRawBuffer(struct msm_frame *frame)
+static inline uint32_t buffer_index_hash(const void *key)
 {
-    int ret = -1;
-    for (int cnt = 0; cnt < (mZslEnable? MAX_SNAPSHOT_BUFFERS : numCapture); cnt++) {
-        if ((unsigned int)mRawMapped[cnt]->data == (unsigned int)frame->buffer) {
-            ret = cnt;
-            ALOGE("found match returning %d", ret);
-            break;
-        }
-    }
-    return ret;
+    /* Buffers are at least word aligned; drop the low bits and mix. */
+    return ((uint32_t)(uintptr_t)key >> 2) * 2654435761u;
 }
 
-int QualcommCameraHardware::mapThumbnailBuffer(struct msm_frame *frame)
+bool BufferIndexMap::add(const void *key, int index)
 {
-    int ret = -1;
-    for (int cnt = 0; cnt < (mZslEnable? MAX_SNAPSHOT_BUFFERS : numCapture); cnt++) {
-        if ((unsigned int)(uint8_t *)mThumbnailMapped[cnt] == (unsigned int)frame->buffer) {
-            ret = cnt;
-            ALOGE("found match returning %d", ret);
-            break;
+    if (key == NULL)
+        return false;
+    uint32_t h = buffer_index_hash(key);
+    for (int i = 0; i < kSize; i++) {
+        int slot = (h + i) & (kSize - 1);
+        if (mKeys[slot] == NULL || mKeys[slot] == key) {
+            mKeys[slot] = key;
+            mIndex[slot] = index;
+            return true;
         }
     }
-    if (ret < 0) ALOGE("mapThumbnailBuffer, could not find match");
-        return ret;
+    ALOGE("%s: buffer index map full", __FUNCTION__);
+    return false;
 }
 
-int QualcommCameraHardware::mapJpegBuffer(mm_camera_buffer_t *encode_buffer)
+int BufferIndexMap::lookup(const void *key) const
 {
-    int ret = -1;
-    for (int cnt = 0; cnt < (mZslEnable? MAX_SNAPSHOT_BUFFERS : numCapture); cnt++) {
-        if ((unsigned int)mJpegMapped[cnt]->data == (unsigned int)encode_buffer->ptr) {
-            ret = cnt;
-            ALOGE("found match returning %d", ret);
+    if (key == NULL)
+        return -1;
+    uint32_t h = buffer_index_hash(key);
+    for (int i = 0; i < kSize; i++) {
+        int slot = (h + i) & (kSize - 1);
+        if (mKeys[slot] == key)
+            return mIndex[slot];
+        if (mKeys[slot] == NULL)
             break;
-        }
     }
-    return ret;
+    return -1;
 }
 
-int QualcommCameraHardware::mapFrame(buffer_handle_t *buffer)
+LatencyHistogram::LatencyHistogram()
 {
-    int ret = -1;
-    for (int cnt = 0; cnt < mTotalPreviewBufferCount; cnt++) {
-        if (frame_buffer[cnt].buffer == buffer) {
-            ret = cnt;
-            break;
-        }
-    }
-    return ret;
+    reset();
 }
 
-void *preview_thread(void *user)
+void LatencyHistogram::reset()
 {
-    ALOGI("preview_thread E");
-    QualcommCameraHardware  *obj = QualcommCameraHardware::getInstance();
-    if (obj != 0) {
-        obj->runPreviewThread(user);
-    }
+    for (int i = 0; i < kBuckets; i++)
+        android_atomic_release_store(0, &mBuckets[i]);
+    android_atomic_release_store(0, &mMax);
+    android_atomic_release_store(0, &mCount);
+}
+
+int LatencyHistogram::bucketFor(uint32_t usecs)
+{
+    if (usecs < 16)
+        return usecs;
+    int msb = 31 - __builtin_clz(usecs);
+    int bucket = 16 + (msb - 4) * 4 + ((usecs >> (msb - 2)) & 3);
+    return bucket < kBuckets ? bucket : kBuckets - 1;
+}
+
+/* Exclusive upper bound of a bucket, in microseconds. */
+uint32_t LatencyHistogram::bucketLimit(int bucket)
+{
+    if (bucket < 16)
+        return bucket + 1;
+    int msb = 4 + (bucket - 16) / 4;
+    return (uint32_t)(5 + (bucket - 16) % 4) << (msb - 2);
+}
+
+void LatencyHistogram::record(nsecs_t delta)
+{
+    uint32_t usecs = delta > 0 ? (uint32_t)(delta / 1000LL) : 0;
+    if (usecs > 0x7fffffff)
+        usecs = 0x7fffffff;
+    android_atomic_inc(&mBuckets[bucketFor(usecs)]);
+    android_atomic_inc(&mCount);
+
+    int32_t old;
+    do {
+        old = android_atomic_acquire_load(&mMax);
+        if ((int32_t)usecs <= old)
+            break;
+    } while (android_atomic_cmpxchg(old, (int32_t)usecs, &mMax));
+}
+
+int32_t LatencyHistogram::count() const
+{
+    return android_atomic_acquire_load(&mCount);
+}
+
+uint32_t LatencyHistogram::max() const
+{
+    return android_atomic_acquire_load(&mMax);
+}
+
+uint32_t LatencyHistogram::percentile(int pct) const
+{
+    int32_t total = 0;
+    int32_t counts[kBuckets];
+    for (int i = 0; i < kBuckets; i++) {
+        counts[i] = android_atomic_acquire_load(&mBuckets[i]);
+        total += counts[i];
+    }
+    if (total == 0)
+        return 0;
+
+    int64_t target = ((int64_t)total * pct + 99) / 100;
+    int64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += counts[i];
+        if (seen >= target) {
+            uint32_t limit = bucketLimit(i) - 1;
+            return limit < max() ? limit : max();
+        }
+    }
+    return max();
+}
+
+void LatencyHistogram::format(String8 &out, const char *name) const
+{
+    out.appendFormat("    %-10s n=%d p50=%uus p95=%uus p99=%uus max=%uus\n",
+        name, count(), percentile(50), percentile(95), percentile(99), max());
+}
+
+void QualcommCameraHardware::resetPreviewStats()
+{
+    for (int i = 0; i < PREVIEW_STAGE_MAX; i++)
+        mPreviewLatency[i].reset();
+    for (int i = 0; i < PREVIEW_DROP_MAX; i++)
+        android_atomic_release_store(0, &mPreviewDrops[i]);
+    android_atomic_release_store(0, &mPreviewFramesReceived);
+    memset(mPreviewReceivedAt, 0, sizeof(mPreviewReceivedAt));
+    memset(mPreviewQueuedAt, 0, sizeof(mPreviewQueuedAt));
+
+    /* The driver starts with the preview buffers, the window keeps the
+     * undequeued ones. Retained buffers keep whatever owner they had. */
+    if (!mRetainBuffers)
+        for (int i = 0; i < kTotalPreviewBufferCount; i++)
+            mPreviewSlotOwner[i] = i < kPreviewBufferCount ? SLOT_DRIVER : SLOT_DISPLAY;
+    for (int i = 0; i < kTotalPreviewBufferCount; i++)
+        mPreviewRefs[i] = mPreviewSlotOwner[i] == SLOT_DISPLAY ? 1 : 0;
+    mPreviewStartTime = systemTime();
+}
+
+void QualcommCameraHardware::lockCounted(Mutex &lock, int which)
+{
+    android_atomic_inc(&mLockAcquired[which]);
+    if (lock.tryLock() != NO_ERROR) {
+        android_atomic_inc(&mLockContended[which]);
+        lock.lock();
+    }
+}
+
+void QualcommCameraHardware::dumpPreviewStats(String8 &out)
+{
+    static const char *stage_names[PREVIEW_STAGE_MAX] = {
+        "receive", "queue", "callback", "enqueue", "dequeue", "display", "return"
+    };
+
+    out.appendFormat("  preview frames received: %d\n",
+        android_atomic_acquire_load(&mPreviewFramesReceived));
+    out.appendFormat("  preview drops: stopped=%d queue=%d unmapped=%d hfr=%d display=%d callback=%d\n",
+        android_atomic_acquire_load(&mPreviewDrops[PREVIEW_DROP_STOPPED]),
+        android_atomic_acquire_load(&mPreviewDrops[PREVIEW_DROP_QUEUE]),
+        android_atomic_acquire_load(&mPreviewDrops[PREVIEW_DROP_UNMAPPED]),
+        android_atomic_acquire_load(&mPreviewDrops[PREVIEW_DROP_HFR]),
+        android_atomic_acquire_load(&mPreviewDrops[PREVIEW_DROP_DISPLAY]),
+        android_atomic_acquire_load(&mPreviewDrops[PREVIEW_DROP_CALLBACK]));
+    out.appendFormat("  preview callbacks: %s, depth %d, %d pending\n",
+        mPreviewCbLatestOnly ? "latest-only" : "backlog",
+        mPreviewCbLatestOnly ? 1 : mPreviewCbDepth, mPreviewCallbackQueue.count());
+    if (mPreviewConvert != NV21_CONVERT_NONE || mPreviewCbWidth > 0)
+        out.appendFormat("  preview conversion: %s %dx%d (%s/%s), %d frames, %lld us avg\n",
+            mPreviewConvertName,
+            mPreviewCbWidth > 0 ? mPreviewCbWidth : previewWidth,
+            mPreviewCbWidth > 0 ? mPreviewCbHeight : previewHeight,
+            nv21_convert_impl(), nv21_scale_impl(), mConvertFrames,
+            mConvertFrames ? (long long)(mConvertTime / 1000 / mConvertFrames) : 0LL);
+    out.appendFormat("  postview frames scaled: %d\n", mPostviewFramesScaled);
+    out.appendFormat("  histogram: %s (%s), published %d, delivered %d, overwritten %d\n",
+        android_atomic_acquire_load(&mStatsOn) ? "on" : "off",
+        mStatsSoftware ? "software" : "vfe",
+        android_atomic_acquire_load(&mStatsPublished),
+        android_atomic_acquire_load(&mStatsDelivered),
+        android_atomic_acquire_load(&mStatsOverwritten));
+    out.appendFormat("  face detection: %s (%s), every %d frames, analysed %d, skipped %d, faces %d, %lld us avg\n",
+        mFaceDetectOn ? "on" : "off", mFaceSoftware ? "software" : "vfe", mFaceInterval,
+        mFaceFramesAnalysed, mFaceFramesSkipped, mFacesFound,
+        mFaceFramesAnalysed ? (long long)(mFaceTime / 1000 / mFaceFramesAnalysed) : 0LL);
+    out.appendFormat("  smooth zoom: %s, %d ms range, %d steps, %d retargets, %d coalesced\n",
+        supportsSmoothZoom() ? "on" : "off", mSmoothZoomRangeMs,
+        mSmoothZoomSteps, mSmoothZoomRetargets, mSmoothZoomCoalesced);
+    out.append("  preview latency:\n");
+    for (int i = 0; i < PREVIEW_STAGE_MAX; i++)
+        mPreviewLatency[i].format(out, stage_names[i]);
+}
+
+int QualcommCameraHardware::mapBuffer(struct msm_frame *frame)
+{
+    return mPreviewIndex.lookup((const void *)frame->buffer);
+}
+
+int QualcommCameraHardware::mapvideoBuffer(struct msm_frame *frame)
+{
+    return mRecordIndex.lookup((const void *)frame->buffer);
+}
+
+int QualcommCameraHardware::mapRawBuffer(struct msm_frame *frame)
+{
+    return mRawIndex.lookup((const void *)frame->buffer);
+}
+
+int QualcommCameraHardware::mapThumbnailBuffer(struct msm_frame *frame)
+{
+    return mThumbnailIndex.lookup((const void *)frame->buffer);
+}
+
+int QualcommCameraHardware::mapJpegBuffer(mm_camera_buffer_t *encode_buffer)
+{
+    return mJpegIndex.lookup(encode_buffer->ptr);
+}
+
+int QualcommCameraHardware::mapFrame(buffer_handle_t *buffer)
+{
+    return mDisplayIndex.lookup(buffer);
+}
+
+/* Hands one preview slot to the app's data callback. */
+void QualcommCameraHardware::deliverPreviewFrame(camera_data_callback pcb, void *pdata, int bufferIndex)
+{
+    mPreviewSlotOwner[bufferIndex] = SLOT_APP;
+    if (mPreviewConvert != NV21_CONVERT_NONE || mPreviewCbWidth > 0) {
+        camera_memory_t *mem = convertPreviewFrame(bufferIndex);
+        if (mem != NULL)
+            pcb(CAMERA_MSG_PREVIEW_FRAME, mem, 0, NULL, pdata);
+        return;
+    }
+    int previewBufSize;
+    /* for CTS : Forcing preview memory buffer lenth to be
+        'previewWidth * previewHeight * 3/2'. Needed when gralloc allocated extra memory.*/
+    if (mPreviewFormat == CAMERA_YUV_420_NV21 && mPreviewCbMapped[bufferIndex] != NULL) {
+        pcb(CAMERA_MSG_PREVIEW_FRAME, mPreviewCbMapped[bufferIndex], 0, NULL, pdata);
+    } else if ( mPreviewFormat == CAMERA_YUV_420_NV21) {
+        previewBufSize = previewWidth * previewHeight * 3/2;
+        camera_memory_t *previewMem = mGetMemory(frames[bufferIndex].fd, previewBufSize, 1, mCallbackCookie);
+        if (!previewMem || !previewMem->data) {
+            ALOGE("%s: mGetMemory failed.\n", __func__);
+        } else {
+            pcb(CAMERA_MSG_PREVIEW_FRAME,previewMem,0,NULL,pdata);
+            previewMem->release(previewMem);
+        }
+    } else
+        pcb(CAMERA_MSG_PREVIEW_FRAME,(camera_memory_t *) mPreviewMapped[bufferIndex],0,NULL,pdata);
+}
+
+/* Scales and/or converts a preview slot into the next buffer of a
+ * two-deep ring, so the frame handed to the app last time is not
+ * overwritten while it may still be read. Only called from the callback
+ * worker. */
+camera_memory_t *QualcommCameraHardware::convertPreviewFrame(int slot)
+{
+    int32_t convert = mPreviewConvert;
+    int width = mPreviewCbWidth, height = mPreviewCbHeight;
+    bool scaling = width > 0 && height > 0;
+    if (!scaling) {
+        width = previewWidth;
+        height = previewHeight;
+    }
+    size_t size = nv21_converted_size(convert, width, height);
+    if (size != mConvertSize) {
+        releaseConvertBuffers();
+        mConvertSize = size;
+    }
+    camera_memory_t *&mem = mConvertMapped[mConvertNext];
+    if (mem == NULL) {
+        mem = mGetMemory(-1, size, 1, mCallbackCookie);
+        if (mem == NULL || mem->data == NULL) {
+            ALOGE("%s: mGetMemory failed for %d bytes", __FUNCTION__, (int)size);
+            if (mem != NULL)
+                mem->release(mem);
+            mem = NULL;
+            return NULL;
+        }
+    }
+    mConvertNext = (mConvertNext + 1) % kConvertBufferCount;
+
+    const uint8_t *y = (const uint8_t *)frames[slot].buffer;
+    const uint8_t *vu = y + frames[slot].cbcr_off;
+    uint8_t *out = (uint8_t *)mem->data;
+    nsecs_t start = systemTime();
+    if (scaling) {
+        /* Scale straight into the app's buffer unless it is converted
+         * afterwards. Bilinear holds up to half size; box beyond that. */
+        uint8_t *scaled = out;
+        if (convert != NV21_CONVERT_NONE) {
+            size_t need = (size_t)width * height * 3 / 2;
+            if (mScaleScratchSize < need) {
+                free(mScaleScratch);
+                mScaleScratch = (uint8_t *)malloc(need);
+                mScaleScratchSize = mScaleScratch != NULL ? need : 0;
+            }
+            scaled = mScaleScratch;
+        }
+        int filter = (width * 2 >= previewWidth && height * 2 >= previewHeight) ?
+            NV21_SCALE_BILINEAR : NV21_SCALE_BOX;
+        if (scaled == NULL || nv21_scale(filter, y, vu, previewWidth, previewHeight,
+                previewWidth, scaled, width, height) != 0) {
+            ALOGE("%s: scaling %dx%d to %dx%d failed", __FUNCTION__,
+                previewWidth, previewHeight, width, height);
+            return NULL;
+        }
+        y = scaled;
+        vu = scaled + width * height;
+    }
+    if (convert != NV21_CONVERT_NONE)
+        nv21_convert(convert, y, vu, width, height, out);
+    mConvertTime += systemTime() - start;
+    mConvertFrames++;
+    return mem;
+}
+
+void QualcommCameraHardware::releaseConvertBuffers()
+{
+    for (int i = 0; i < kConvertBufferCount; i++) {
+        if (mConvertMapped[i] != NULL) {
+            mConvertMapped[i]->release(mConvertMapped[i]);
+            mConvertMapped[i] = NULL;
+        }
+    }
+    mConvertNext = 0;
+    mConvertSize = 0;
+    free(mScaleScratch);
+    mScaleScratch = NULL;
+    mScaleScratchSize = 0;
+}
+
+bool QualcommCameraHardware::supportsConvertedPreview()
+{
+    return mCurrentTarget == TARGET_MSM7630 || mCurrentTarget == TARGET_QSD8250 ||
+        mCurrentTarget == TARGET_MSM8660;
+}
+
+/* Drops one reference to a preview slot; the last one returns it to the
+ * driver. */
+void QualcommCameraHardware::releasePreviewRef(int slot)
+{
+    if (android_atomic_dec(&mPreviewRefs[slot]) != 1)
+        return;
+    mPreviewSlotOwner[slot] = SLOT_DRIVER;
+    LINK_camframe_add_frame(CAM_PREVIEW_FRAME, &frames[slot]);
+    if (mPreviewReceivedAt[slot] != 0)
+        mPreviewLatency[PREVIEW_STAGE_RETURN].record(systemTime() - mPreviewReceivedAt[slot]);
+}
+
+void QualcommCameraHardware::runPreviewCallbackThread()
+{
+    int slot;
+    while ((slot = mPreviewCallbackQueue.get()) >= 0) {
+        lockCounted(mCallbackLock, LOCK_CALLBACK);
+        int msgEnabled = mMsgEnabled;
+        camera_data_callback pcb = mDataCallback;
+        void *pdata = mCallbackCookie;
+        mCallbackLock.unlock();
+
+        // The app may have turned callbacks off while the frame waited.
+        if (pcb != NULL && (msgEnabled & CAMERA_MSG_PREVIEW_FRAME)) {
+            nsecs_t cbStart = systemTime();
+            deliverPreviewFrame(pcb, pdata, slot);
+            mPreviewLatency[PREVIEW_STAGE_CALLBACK].record(systemTime() - cbStart);
+        }
+        releasePreviewRef(slot);
+    }
+    while ((slot = mPreviewCallbackQueue.take()) >= 0)
+        releasePreviewRef(slot);
+    releaseConvertBuffers();
+
+    mPreviewCbThreadWaitLock.lock();
+    mPreviewCbThreadRunning = false;
+    mPreviewCbThreadWait.signal();
+    mPreviewCbThreadWaitLock.unlock();
+}
+
+void *preview_cb_thread(void *user)
+{
+    ALOGI("preview_cb_thread E");
+    QualcommCameraHardware  *obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runPreviewCallbackThread();
+    }
+    else ALOGE("not starting preview callback thread: the object went away!");
+    ALOGI("preview_cb_thread X");
+    return NULL;
+}
+
+/* Maps a rectangle in a width x height frame to the [-1000, 1000] space
+ * faces are reported in. Neither detector finds eyes or mouths; the id is
+ * assigned by deliverFaces(). */
+static void fill_face(camera_face_t *face, int left, int top, int right, int bottom,
+                      int score, int width, int height)
+{
+    face->rect[0] = left * 2000 / width - 1000;
+    face->rect[1] = top * 2000 / height - 1000;
+    face->rect[2] = right * 2000 / width - 1000;
+    face->rect[3] = bottom * 2000 / height - 1000;
+    for (int i = 0; i < 4; i++) {
+        if (face->rect[i] > 1000)
+            face->rect[i] = 1000;
+        else if (face->rect[i] < -1000)
+            face->rect[i] = -1000;
+    }
+    face->score = score;
+    face->id = -1;
+    face->left_eye[0] = face->left_eye[1] = -2000;
+    face->right_eye[0] = face->right_eye[1] = -2000;
+    face->mouth[0] = face->mouth[1] = -2000;
+}
+
+/* Feeds face detection every mFaceInterval preview frames: the VFE's
+ * regions where the board has a detector, otherwise a slot for the
+ * worker, which is skipped rather than queued while it is busy. */
+void QualcommCameraHardware::postFaceFrame(int slot, struct msm_frame *frame)
+{
+    mMetaDataWaitLock.lock();
+    if (!mFaceDetectOn || ++mFaceFrameCount < mFaceInterval) {
+        mMetaDataWaitLock.unlock();
+        return;
+    }
+    if (mFaceSoftware) {
+        if (mFaceSlot >= 0 || !mFaceThreadRunning ||
+            mPreviewFormat != CAMERA_YUV_420_NV21) {
+            mFaceFramesSkipped++;
+        } else {
+            mFaceFrameCount = 0;
+            android_atomic_inc(&mPreviewRefs[slot]);
+            mFaceSlot = slot;
+            mFaceWait.signal();
+        }
+        mMetaDataWaitLock.unlock();
+        return;
+    }
+    mFaceFrameCount = 0;
+    mMetaDataWaitLock.unlock();
+
+    camera_face_t faces[MAX_ROI];
+    fd_roi_t *fd = (fd_roi_t *)(frame->roi_info.info);
+    int count = fd->rect_num < 0 ? 0 : fd->rect_num > MAX_ROI ? MAX_ROI : fd->rect_num;
+    for (int i = 0; i < count; i++) {
+        const fd_rect_t &r = fd->faces[i];
+        fill_face(&faces[i], r.x, r.y, r.x + r.dx, r.y + r.dy, 100,
+            previewWidth, previewHeight);
+    }
+    deliverFaces(faces, count);
+}
+
+/* Runs the detector on a small box-filtered copy of a preview slot. The
+ * slot goes back as soon as it has been scaled. */
+void QualcommCameraHardware::analyzeFaces(int slot)
+{
+    int width = previewWidth < kFaceAnalysisWidth ? previewWidth : kFaceAnalysisWidth;
+    int height = (previewHeight * width / previewWidth) & ~1;
+    // The preview size is fixed for the life of the worker.
+    if (mFaceScratch == NULL) {
+        mFaceScratch = (uint8_t *)malloc(width * height * 3 / 2);
+        if (mFaceScratch == NULL) {
+            releasePreviewRef(slot);
+            return;
+        }
+    }
+
+    nsecs_t start = systemTime();
+    const uint8_t *y = (const uint8_t *)frames[slot].buffer;
+    int rc = nv21_scale(NV21_SCALE_BOX, y, y + frames[slot].cbcr_off,
+        previewWidth, previewHeight, previewWidth, mFaceScratch, width, height);
+    releasePreviewRef(slot);
+    if (rc != 0) {
+        ALOGE("%s: scaling %dx%d to %dx%d failed", __FUNCTION__,
+            previewWidth, previewHeight, width, height);
+        return;
+    }
+
+    nv21_face_t found[NV21_MAX_FACES];
+    int count = nv21_detect_faces(mFaceScratch, mFaceScratch + width * height,
+        width, height, found, NV21_MAX_FACES);
+    mFaceTime += systemTime() - start;
+    mFaceFramesAnalysed++;
+    mFacesFound += count;
+
+    camera_face_t faces[NV21_MAX_FACES];
+    for (int i = 0; i < count; i++)
+        fill_face(&faces[i], found[i].left, found[i].top, found[i].right,
+            found[i].bottom, found[i].score, width, height);
+    deliverFaces(faces, count);
+}
+
+static int face_overlap(const camera_face_t *a, const camera_face_t *b)
+{
+    int w = (a->rect[2] < b->rect[2] ? a->rect[2] : b->rect[2]) -
+        (a->rect[0] > b->rect[0] ? a->rect[0] : b->rect[0]);
+    int h = (a->rect[3] < b->rect[3] ? a->rect[3] : b->rect[3]) -
+        (a->rect[1] > b->rect[1] ? a->rect[1] : b->rect[1]);
+    return w > 0 && h > 0 ? w * h : 0;
+}
+
+/* Gives each face the id of the previous face it overlaps most, or a new
+ * one. Called with mMetaDataWaitLock held. */
+void QualcommCameraHardware::assignFaceIds(camera_face_t *faces, int count)
+{
+    bool taken[kMaxFaces];
+    memset(taken, 0, sizeof(taken));
+    for (int i = 0; i < count; i++) {
+        int best = -1, bestArea = 0;
+        for (int j = 0; j < mFacesLast && j < kMaxFaces; j++) {
+            int area = taken[j] ? 0 : face_overlap(&faces[i], &mFacesPrev[j]);
+            if (area > bestArea) {
+                best = j;
+                bestArea = area;
+            }
+        }
+        if (best >= 0) {
+            taken[best] = true;
+            faces[i].id = mFacesPrev[best].id;
+        } else {
+            faces[i].id = mNextFaceId;
+            mNextFaceId = mNextFaceId == 0x7fffffff ? 1 : mNextFaceId + 1;
+        }
+    }
+    for (int i = 0; i < count && i < kMaxFaces; i++)
+        mFacesPrev[i] = faces[i];
+}
+
+void QualcommCameraHardware::deliverFaces(camera_face_t *faces, int count)
+{
+    mMetaDataWaitLock.lock();
+    bool on = mFaceDetectOn;
+    // An empty result is only sent once, so the app can clear its overlay.
+    bool send = on && (count > 0 || mFacesLast > 0);
+    if (send) {
+        assignFaceIds(faces, count);
+        mFacesLast = count;
+    }
+    mMetaDataWaitLock.unlock();
+    if (!send || mFaceMetaMem == NULL)
+        return;
+
+    lockCounted(mCallbackLock, LOCK_CALLBACK);
+    int msgEnabled = mMsgEnabled;
+    camera_data_callback mcb = mDataCallback;
+    void *mdata = mCallbackCookie;
+    mCallbackLock.unlock();
+    if (mcb == NULL || !(msgEnabled & CAMERA_MSG_PREVIEW_METADATA))
+        return;
+
+    camera_frame_metadata_t metadata;
+    metadata.number_of_faces = count;
+    metadata.faces = faces;
+    mcb(CAMERA_MSG_PREVIEW_METADATA, mFaceMetaMem, 0, &metadata, mdata);
+}
+
+void QualcommCameraHardware::runFaceThread()
+{
+    mMetaDataWaitLock.lock();
+    for (;;) {
+        while (mFaceSlot < 0 && !mFaceThreadExit)
+            mFaceWait.wait(mMetaDataWaitLock);
+        int slot = mFaceSlot;
+        if (mFaceThreadExit) {
+            // Give back a slot that was posted but not looked at.
+            mFaceSlot = -1;
+            mMetaDataWaitLock.unlock();
+            if (slot >= 0)
+                releasePreviewRef(slot);
+            break;
+        }
+        mMetaDataWaitLock.unlock();
+        analyzeFaces(slot);
+        mMetaDataWaitLock.lock();
+        mFaceSlot = -1;
+    }
+    free(mFaceScratch);
+    mFaceScratch = NULL;
+
+    mMetaDataWaitLock.lock();
+    mFaceThreadRunning = false;
+    mFaceThreadWait.signal();
+    mMetaDataWaitLock.unlock();
+}
+
+void *face_thread(void *user)
+{
+    ALOGI("face_thread E");
+    QualcommCameraHardware  *obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runFaceThread();
+    }
+    else ALOGE("not starting face thread: the object went away!");
+    ALOGI("face_thread X");
+    return NULL;
+}
+
+void *preview_thread(void *user)
+{
+    ALOGI("preview_thread E");
+    QualcommCameraHardware  *obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runPreviewThread(user);
+    }
     else ALOGE("not starting preview thread: the object went away!");
     ALOGI("preview_thread X");
     return NULL;
@@ -2541,57 +3532,73 @@ void QualcommCameraHardware::runHFRThread(void *data)
 {
     ALOGD("runHFRThread E");
     mInHFRThread = true;
+    nsecs_t switchStart = systemTime();
 
-    ALOGI("%s: stopping Preview", __FUNCTION__);
-    stopPreviewInternal();
+    /* HFR only changes the sensor mode; when the preview geometry stays
+     * the same the display and postview buffers are kept across the
+     * restart and only re-registered with the driver. */
+    mRetainBuffers = streamGeometryUnchanged();
 
-    // Release thumbnail Buffers
-    if ( mPreviewWindow != NULL ) {
-        private_handle_t *handle;
-        for (int cnt = 0; cnt < (mZslEnable? (MAX_SNAPSHOT_BUFFERS-2) : numCapture); cnt++) {
-            if (mPreviewWindow != NULL && mThumbnailBuffer[cnt] != NULL) {
-                handle = (private_handle_t *)(*mThumbnailBuffer[cnt]);
-                ALOGV("%s:  Cancelling postview buffer %d ", __FUNCTION__, handle->fd);
-                ALOGV("runHfrThread : display lock");
-                mDisplayLock.lock();
+    ALOGI("%s: stopping Preview (%s buffers)", __FUNCTION__,
+        mRetainBuffers ? "keeping" : "releasing");
+    stopPreviewInternal();
 
-                status_t retVal = mPreviewWindow->cancel_buffer(mPreviewWindow,
-                                                              mThumbnailBuffer[cnt]);
-                if (retVal != NO_ERROR)
-                    ALOGE("%s: cancelBuffer failed for postview buffer %d",
-                                                     __FUNCTION__, handle->fd);
-                // unregister , unmap and release as well
-                int mBufferSize = previewWidth * previewHeight * 3/2;
-                int mCbCrOffset = PAD_TO_WORD(previewWidth * previewHeight);
-                if (mThumbnailMapped[cnt] && (mSnapshotFormat == PICTURE_FORMAT_JPEG)) {
-                    ALOGE("%s:  Unregistering Thumbnail Buffer %d ", __FUNCTION__, handle->fd);
-                    register_buf(mBufferSize,
-                        mCbCrOffset, 0,
-                        handle->fd,
-                        0,
-                        (uint8_t *)mThumbnailMapped[cnt],
-                        MSM_PMEM_THUMBNAIL,
-                        false, false);
-                    if (munmap(mThumbnailMapped[cnt],handle->size ) == -1) {
-                      ALOGE("StopPreview : Error un-mmapping the thumbnail buffer %p", index);
+    if (!mRetainBuffers) {
+        // Release thumbnail Buffers
+        if ( mPreviewWindow != NULL ) {
+            private_handle_t *handle;
+            for (int cnt = 0; cnt < mStreamPostviews; cnt++) {
+                if (mPreviewWindow != NULL && mThumbnailBuffer[cnt] != NULL) {
+                    handle = (private_handle_t *)(*mThumbnailBuffer[cnt]);
+                    ALOGV("%s:  Cancelling postview buffer %d ", __FUNCTION__, handle->fd);
+                    ALOGV("runHfrThread : display lock");
+                    mDisplayLock.lock();
+
+                    status_t retVal = mPreviewWindow->cancel_buffer(mPreviewWindow,
+                                                                  mThumbnailBuffer[cnt]);
+                    if (retVal != NO_ERROR)
+                        ALOGE("%s: cancelBuffer failed for postview buffer %d",
+                                                         __FUNCTION__, handle->fd);
+                    // unregister , unmap and release as well
+                    int mBufferSize = previewWidth * previewHeight * 3/2;
+                    int mCbCrOffset = PAD_TO_WORD(previewWidth * previewHeight);
+                    if (mThumbnailMapped[cnt] && (mSnapshotFormat == PICTURE_FORMAT_JPEG)) {
+                        ALOGE("%s:  Unregistering Thumbnail Buffer %d ", __FUNCTION__, handle->fd);
+                        register_buf(mBufferSize,
+                            mCbCrOffset, 0,
+                            handle->fd,
+                            0,
+                            (uint8_t *)mThumbnailMapped[cnt],
+                            MSM_PMEM_THUMBNAIL,
+                            false, false);
+                        if (munmap(mThumbnailMapped[cnt],handle->size ) == -1) {
+                          ALOGE("StopPreview : Error un-mmapping the thumbnail buffer %p", index);
+                        }
+                        mThumbnailMapped[cnt] = NULL;
                     }
-                    mThumbnailMapped[cnt] = NULL;
-                }
-                mThumbnailBuffer[cnt] = NULL;
-                ALOGV("runHfrThread : display unlock");
-                mDisplayLock.unlock();
-          }
-       }
+                    mThumbnailBuffer[cnt] = NULL;
+                    ALOGV("runHfrThread : display unlock");
+                    mDisplayLock.unlock();
+              }
+           }
+        }
     }
 
     ALOGV("%s: setting parameters", __FUNCTION__);
+    invalidateParams();
     setParameters(mParameters);
     ALOGV("%s: starting Preview", __FUNCTION__);
     if ( mPreviewWindow == NULL) {
         startPreviewInternal();
+    } else if (mRetainBuffers) {
+        restartPreviewWithBuffers();
+        mStreamReconfigs++;
     } else {
         getBuffersAndStartPreview();
+        mStreamRestarts++;
     }
+    mRetainBuffers = false;
+    mLastModeSwitchTime = systemTime() - switchStart;
 
     mHFRMode = false;
     mInHFRThread = false;
@@ -2600,74 +3607,48 @@ void QualcommCameraHardware::runHFRThread(void *data)
 void QualcommCameraHardware::runVideoThread(void *data)
 {
     ALOGD("runVideoThread E");
-    msm_frame* vframe = NULL;
-
-    while (true) {
-        pthread_mutex_lock(&(g_busy_frame_queue.mut));
-
-        // Exit the thread , in case of stop recording..
-        mVideoThreadWaitLock.lock();
-        if (mVideoThreadExit) {
-            ALOGV("Exiting video thread..");
-            mVideoThreadWaitLock.unlock();
-            pthread_mutex_unlock(&(g_busy_frame_queue.mut));
-            break;
-        }
-        mVideoThreadWaitLock.unlock();
-
-        ALOGV("in video_thread : wait for video frame ");
-        // check if any frames are available in busyQ and give callback to
-        // services/video encoder
-        cam_frame_wait_video();
-        ALOGV("video_thread, wait over..");
-
-        // Exit the thread , in case of stop recording..
-        mVideoThreadWaitLock.lock();
-        if (mVideoThreadExit) {
-            ALOGV("Exiting video thread..");
-            mVideoThreadWaitLock.unlock();
-            pthread_mutex_unlock(&(g_busy_frame_queue.mut));
-            break;
-        }
-        mVideoThreadWaitLock.unlock();
+    msm_frame *batch[VideoFrameQueue::kMaxSize];
+    int n;
 
-        // Get the video frame to be encoded
-        vframe = cam_frame_get_video ();
-        pthread_mutex_unlock(&(g_busy_frame_queue.mut));
-        ALOGE("in video_thread : got video frame %p",vframe);
+    // Several frames can be pending when the encoder fell behind; they are
+    // taken and delivered together, with one look at the callbacks.
+    while ((n = mVideoBusyQueue.drain(batch, VideoFrameQueue::kMaxSize)) >= 0) {
+        mVideoBatches++;
+        if (n > mVideoBatchMax)
+            mVideoBatchMax = n;
 
-        if (vframe != NULL) {
-            /* Extract the timestamp of this frame */
-            nsecs_t timeStamp = nsecs_t(vframe->ts.tv_sec)*1000000000LL + vframe->ts.tv_nsec;
+        lockCounted(mCallbackLock, LOCK_CALLBACK);
+        int msgEnabled = mMsgEnabled;
+        camera_data_timestamp_callback rcb = mDataCallbackTimestamp;
+        void *rdata = mCallbackCookie;
+        mCallbackLock.unlock();
 
-            ALOGV("in video_thread : got video frame, before if check giving frame to services/encoder");
-            mCallbackLock.lock();
-            int msgEnabled = mMsgEnabled;
-            camera_data_timestamp_callback rcb = mDataCallbackTimestamp;
-            void *rdata = mCallbackCookie;
-            mCallbackLock.unlock();
-
-            /* When 3D mode is ON, the video thread will be ON even in preview
-             * mode. We need to distinguish when recording is started. So, when
-             * 3D mode is ON, check for the recordingState (which will be set
-             * with start recording and reset in stop recording), before
-             * calling rcb.
-             */
+        /* When 3D mode is ON, the video thread will be ON even in preview
+         * mode. We need to distinguish when recording is started. So, when
+         * 3D mode is ON, check for the recordingState (which will be set
+         * with start recording and reset in stop recording), before
+         * calling rcb.
+         */
+        for (int i = 0; i < n && !mIs3DModeOn; i++) {
+            msm_frame *vframe = batch[i];
             int index = mapvideoBuffer(vframe);
-            if (!mIs3DModeOn) {
-                record_buffers_tracking_flag[index] = true;
-                if (rcb != NULL && (msgEnabled & CAMERA_MSG_VIDEO_FRAME) ) {
-                    ALOGV("in video_thread : got video frame, giving frame to services/encoder index = %d", index);
-                    if (mStoreMetaDataInFrame) {
-                        rcb(timeStamp, CAMERA_MSG_VIDEO_FRAME, metadata_memory[index],0,rdata);
-                    } else {
-                        rcb(timeStamp, CAMERA_MSG_VIDEO_FRAME, mRecordMapped[index],0,rdata);
-                    }
+            if (index < 0) {
+                ALOGE("%s: unknown video frame %p", __FUNCTION__, vframe);
+                LINK_camframe_add_frame(CAM_VIDEO_FRAME, vframe);
+                continue;
+            }
+            nsecs_t timeStamp = nsecs_t(vframe->ts.tv_sec)*1000000000LL + vframe->ts.tv_nsec;
+            record_buffers_tracking_flag[index] = true;
+            mRecordSlotOwner[index] = SLOT_APP;
+            if (rcb != NULL && (msgEnabled & CAMERA_MSG_VIDEO_FRAME)) {
+                if (mStoreMetaDataInFrame) {
+                    rcb(timeStamp, CAMERA_MSG_VIDEO_FRAME, metadata_memory[index],0,rdata);
+                } else {
+                    rcb(timeStamp, CAMERA_MSG_VIDEO_FRAME, mRecordMapped[index],0,rdata);
                 }
             }
-        } else ALOGE("in video_thread get frame returned null");
-
-    } // end of while loop
+        }
+    }
 
     mVideoThreadWaitLock.lock();
     mVideoThreadRunning = false;
@@ -2722,11 +3703,211 @@ static int parse_size(const char *str, int &width, int &height)
 }
 
 #ifdef USE_ION
+/* ION memory held by the HAL, for dump(). Every allocation opens its own
+ * ion client, so the client fd identifies it on release. */
+#define MAX_ION_ALLOCS 64
+static Mutex ion_stats_lock;
+static struct {
+    int client_fd;
+    int len;
+    int heap;
+} ion_allocs[MAX_ION_ALLOCS];
+static int ion_allocs_in_use;
+static int ion_bytes_in_use;
+static int ion_allocs_untracked;
+
+static void ion_stats_add(int client_fd, int len, int heap)
+{
+    Mutex::Autolock l(&ion_stats_lock);
+    for (int i = 0; i < MAX_ION_ALLOCS; i++) {
+        if (ion_allocs[i].len == 0) {
+            ion_allocs[i].client_fd = client_fd;
+            ion_allocs[i].len = len;
+            ion_allocs[i].heap = heap;
+            ion_allocs_in_use++;
+            ion_bytes_in_use += len;
+            return;
+        }
+    }
+    /* Still usable; it is freed rather than cached on release since its
+     * length is unknown then. */
+    ion_allocs_untracked++;
+    ALOGE("%s: more than %d ION allocations, %d bytes on fd %d untracked",
+        __FUNCTION__, MAX_ION_ALLOCS, len, client_fd);
+}
+
+/* Returns the length of the allocation and its heap, or 0 if unknown. */
+static int ion_stats_remove(int client_fd, int *heap)
+{
+    Mutex::Autolock l(&ion_stats_lock);
+    for (int i = 0; i < MAX_ION_ALLOCS; i++) {
+        if (ion_allocs[i].len != 0 && ion_allocs[i].client_fd == client_fd) {
+            int len = ion_allocs[i].len;
+            *heap = ion_allocs[i].heap;
+            ion_allocs_in_use--;
+            ion_bytes_in_use -= len;
+            ion_allocs[i].len = 0;
+            return len;
+        }
+    }
+    return 0;
+}
+
+/* Freed buffers are parked here instead of going back to the heap, so
+ * preview/record restarts and HFR reconfiguration reuse them. Buffers are
+ * allocated at their page-rounded size; a request may take a cached
+ * buffer up to one size class larger (four classes per power of two above
+ * 64KB, so at most ~25% over). The cache keeps the ion client and handle;
+ * the share fd is re-exported on reuse since callers close theirs before
+ * freeing. Shared by every instance, and emptied after a capture and when
+ * recording stops. */
+#define ION_CACHE_ENTRIES 8
+#define ION_CACHE_IDLE_NS seconds(30)
+struct ion_cache_entry {
+    int client_fd;
+    struct ion_handle *handle;
+    int len;
+    int heap;
+    nsecs_t parked;
+};
+static struct ion_cache_entry ion_cache[ION_CACHE_ENTRIES];
+static int ion_cache_count;
+static int ion_cache_bytes;
+static int ion_cache_limit = -1;
+static int ion_cache_hits;
+static int ion_cache_misses;
+
+static int ion_size_class(int size)
+{
+    int len = (size + 4095) & ~4095;
+    if (len <= 65536)
+        return len;
+    int step = 1 << (31 - __builtin_clz(len) - 2);
+    return (len + step - 1) & ~(step - 1);
+}
+
+static void ion_free_handle(int client_fd, struct ion_handle *handle)
+{
+    struct ion_handle_data handle_data;
+    handle_data.handle = handle;
+    ioctl(client_fd, ION_IOC_FREE, &handle_data);
+    close(client_fd);
+}
+
+/* Caller holds ion_stats_lock; the entry is freed by the caller once
+ * the lock is dropped. */
+static struct ion_cache_entry ion_cache_evict(int i)
+{
+    struct ion_cache_entry victim = ion_cache[i];
+    ion_cache_bytes -= victim.len;
+    ion_cache[i] = ion_cache[--ion_cache_count];
+    return victim;
+}
+
+/* Frees cached buffers, oldest first, until at most keep_bytes remain.
+ * Entries idle for longer than ION_CACHE_IDLE_NS go regardless. The
+ * ioctls run after ion_stats_lock is dropped, so dump() and other
+ * allocations don't wait on them. */
+static void ion_cache_trim(int keep_bytes)
+{
+    struct ion_cache_entry victims[ION_CACHE_ENTRIES];
+    int count = 0;
+
+    ion_stats_lock.lock();
+    nsecs_t now = systemTime();
+    for (int i = 0; i < ion_cache_count; ) {
+        if (now - ion_cache[i].parked > ION_CACHE_IDLE_NS)
+            victims[count++] = ion_cache_evict(i);
+        else
+            i++;
+    }
+    while (ion_cache_bytes > keep_bytes) {
+        int oldest = 0;
+        for (int i = 1; i < ion_cache_count; i++)
+            if (ion_cache[i].parked < ion_cache[oldest].parked)
+                oldest = i;
+        victims[count++] = ion_cache_evict(oldest);
+    }
+    ion_stats_lock.unlock();
+
+    for (int i = 0; i < count; i++)
+        ion_free_handle(victims[i].client_fd, victims[i].handle);
+}
+
+static int ion_cache_limit_bytes()
+{
+    if (ion_cache_limit < 0) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("persist.camera.hal.ion_cache_kb", value, "4096");
+        ion_cache_limit = atoi(value) * 1024;
+        if (ion_cache_limit < 0)
+            ion_cache_limit = 0;
+    }
+    return ion_cache_limit;
+}
+
+/* Takes the smallest cached buffer of at least len bytes that is no
+ * more than one size class larger. Returns its length, or 0. */
+static int ion_cache_take(int heap, int len, int *client_fd, struct ion_handle **handle)
+{
+    Mutex::Autolock l(&ion_stats_lock);
+    int limit = ion_size_class(len);
+    int best = -1;
+    for (int i = 0; i < ion_cache_count; i++) {
+        if (ion_cache[i].heap == heap && ion_cache[i].len >= len &&
+            ion_cache[i].len <= limit &&
+            (best < 0 || ion_cache[i].len < ion_cache[best].len))
+            best = i;
+    }
+    if (best < 0) {
+        ion_cache_misses++;
+        return 0;
+    }
+    struct ion_cache_entry entry = ion_cache_evict(best);
+    *client_fd = entry.client_fd;
+    *handle = entry.handle;
+    ion_cache_hits++;
+    return entry.len;
+}
+
+static bool ion_cache_park(int client_fd, struct ion_handle *handle, int len, int heap)
+{
+    int limit = ion_cache_limit_bytes();
+    if (len > limit)
+        return false;
+    ion_cache_trim(limit - len);
+    Mutex::Autolock l(&ion_stats_lock);
+    if (ion_cache_count == ION_CACHE_ENTRIES)
+        return false;
+    ion_cache[ion_cache_count].client_fd = client_fd;
+    ion_cache[ion_cache_count].handle = handle;
+    ion_cache[ion_cache_count].len = len;
+    ion_cache[ion_cache_count].heap = heap;
+    ion_cache[ion_cache_count].parked = systemTime();
+    ion_cache_count++;
+    ion_cache_bytes += len;
+    return true;
+}
+
 int QualcommCameraHardware::allocate_ion_memory(int *main_ion_fd, struct ion_allocation_data* alloc,
      struct ion_fd_data* ion_info_fd, int ion_type, int size, int *memfd)
 {
     int rc = 0;
     struct ion_handle_data handle_data;
+    int len = (size + 4095) & ~4095;
+    int cached = ion_cache_take(ion_type, len, main_ion_fd, &alloc->handle);
+
+    if (cached > 0) {
+        alloc->len = cached;
+        ion_info_fd->handle = alloc->handle;
+        if (ioctl(*main_ion_fd, ION_IOC_SHARE, ion_info_fd) == 0) {
+            *memfd = ion_info_fd->fd;
+            ion_stats_add(*main_ion_fd, cached, ion_type);
+            return 0;
+        }
+        ALOGE("ION re-share failed %s\n", strerror(errno));
+        ion_free_handle(*main_ion_fd, alloc->handle);
+    }
 
     *main_ion_fd = open("/dev/ion", O_RDONLY | O_SYNC);
     if (*main_ion_fd < 0) {
@@ -2734,14 +3915,17 @@ int QualcommCameraHardware::allocate_ion_memory(int *main_ion_fd, struct ion_all
       ALOGE("Error is %s\n", strerror(errno));
       goto ION_OPEN_FAILED;
     }
-    alloc->len = size;
-    /* to make it page size aligned */
-    alloc->len = (alloc->len + 4095) & (~4095);
+    alloc->len = len;
     alloc->align = 4096;
     alloc->heap_mask = (0x1 << ion_type);
     alloc->flags = ~ION_SECURE;
 
     rc = ioctl(*main_ion_fd, ION_IOC_ALLOC, alloc);
+    if (rc < 0) {
+      /* Cached buffers of other sizes may be what is crowding the heap. */
+      ion_cache_trim(0);
+      rc = ioctl(*main_ion_fd, ION_IOC_ALLOC, alloc);
+    }
     if (rc < 0) {
       ALOGE("ION allocation failed\n");
       goto ION_ALLOC_FAILED;
@@ -2754,6 +3938,7 @@ int QualcommCameraHardware::allocate_ion_memory(int *main_ion_fd, struct ion_all
       goto ION_MAP_FAILED;
     }
     *memfd = ion_info_fd->fd;
+    ion_stats_add(*main_ion_fd, alloc->len, ion_type);
     return 0;
 
 ION_MAP_FAILED:
@@ -2765,15 +3950,18 @@ ION_OPEN_FAILED:
     return -1;
 }
 
-int QualcommCameraHardware::deallocate_ion_memory(int *main_ion_fd, struct ion_fd_data* ion_info_fd)
+/* Buffers whose mappings may outlive this call (views lent to the app)
+ * must pass reusable = false so they are never handed out again. */
+int QualcommCameraHardware::deallocate_ion_memory(int *main_ion_fd, struct ion_fd_data* ion_info_fd,
+     bool reusable)
 {
-    struct ion_handle_data handle_data;
-    int rc = 0;
+    int heap = 0;
+    int len = ion_stats_remove(*main_ion_fd, &heap);
 
-    handle_data.handle = ion_info_fd->handle;
-    ioctl(*main_ion_fd, ION_IOC_FREE, &handle_data);
-    close(*main_ion_fd);
-    return rc;
+    if (!reusable || len == 0 ||
+        !ion_cache_park(*main_ion_fd, ion_info_fd->handle, len, heap))
+        ion_free_handle(*main_ion_fd, ion_info_fd->handle);
+    return 0;
 }
 #endif
 
@@ -2800,6 +3988,7 @@ bool QualcommCameraHardware::initPreview()
                  previewWidth = videoWidth;
                  previewHeight = videoHeight;
                  mParameters.setPreviewSize(previewWidth, previewHeight);
+                 paramsChanged();
              }
              if ( (mCurrentTarget != TARGET_MSM7630)
                  && (mCurrentTarget != TARGET_QSD8250)
@@ -2808,6 +3997,7 @@ bool QualcommCameraHardware::initPreview()
                  previewWidth = videoWidth;
                  previewHeight = videoHeight;
                  mParameters.setPreviewSize(previewWidth, previewHeight);
+                 paramsChanged();
              }
          } else {
              ALOGE("initPreview X: failed to parse parameter record-size (%s)", recordSize);
@@ -2923,10 +4113,36 @@ bool QualcommCameraHardware::initPreview()
 
     if (ret) {
         if (mIs3DModeOn != true) {
-            mPreviewBusyQueue.init();
-            LINK_camframe_release_all_frames(CAM_PREVIEW_FRAME);
-            for (int i= ACTIVE_PREVIEW_BUFFERS; i < kPreviewBufferCount; i++)
-                LINK_camframe_add_frame(CAM_PREVIEW_FRAME,&frames[i]);
+            mPreviewBusyQueue.init(mTotalPreviewBufferCount);
+            resetPreviewStats();
+            queueFreePreviewBuffers();
+
+            // Without the worker, callbacks are made from the preview thread.
+            mPreviewCallbackQueue.init(mPreviewCbDepth, mPreviewCbLatestOnly);
+            mPreviewCbThreadWaitLock.lock();
+            pthread_attr_t cattr;
+            pthread_attr_init(&cattr);
+            pthread_attr_setdetachstate(&cattr, PTHREAD_CREATE_DETACHED);
+            mPreviewCbThreadRunning = !pthread_create(&mPreviewCbThread,
+                                      &cattr,
+                                      preview_cb_thread,
+                                      (void*)NULL);
+            mPreviewCbThreadWaitLock.unlock();
+
+            if (mFaceSoftware) {
+                mMetaDataWaitLock.lock();
+                mFaceSlot = -1;
+                mFaceThreadExit = false;
+                mFaceFrameCount = 0;
+                pthread_attr_t fattr;
+                pthread_attr_init(&fattr);
+                pthread_attr_setdetachstate(&fattr, PTHREAD_CREATE_DETACHED);
+                mFaceThreadRunning = !pthread_create(&mFaceThread,
+                                          &fattr,
+                                          face_thread,
+                                          (void*)NULL);
+                mMetaDataWaitLock.unlock();
+            }
 
             mPreviewThreadWaitLock.lock();
             pthread_attr_t pattr;
@@ -3112,12 +4328,8 @@ bool QualcommCameraHardware::deinitZslBuffers()
 #endif
         }
     }
-    for (int cnt = 0; cnt < (mZslEnable? (MAX_SNAPSHOT_BUFFERS) : numCapture); cnt++) {
-        if (mJpegMapped[cnt]) {
-            mJpegMapped[cnt]->release(mJpegMapped[cnt]);
-            mJpegMapped[cnt] = NULL;
-        }
-    }
+    for (int cnt = 0; cnt < (mZslEnable? (MAX_SNAPSHOT_BUFFERS) : numCapture); cnt++)
+        deinitJpegHeap(cnt);
     ALOGE("deinitZslBuffers X");
     return true;
 }
@@ -3138,8 +4350,30 @@ bool QualcommCameraHardware::createSnapshotMemory (int numberOfRawBuffers, int n
 #endif
 
     if (snapshotFormat == PICTURE_FORMAT_JPEG) {
+        /* Reuse pooled heaps if they were laid out for this picture. */
+        if (mZslEnable || mJpegMaxSize != mSnapshotPoolSize ||
+            mCbCrOffsetRaw != mSnapshotPoolCbCrOffset || mYOffset != mSnapshotPoolYOffset)
+            releaseSnapshotPool();
+        mSnapshotPoolSize = mJpegMaxSize;
+        mSnapshotPoolCbCrOffset = mCbCrOffsetRaw;
+        mSnapshotPoolYOffset = mYOffset;
+        if (mRawMapped[0] != NULL)
+            mSnapshotPoolHits++;
+        else
+            mSnapshotPoolMisses++;
+        /* Registered buffers the capture won't use would confuse the driver. */
+        for (int cnt = numberOfRawBuffers; cnt < MAX_SNAPSHOT_BUFFERS; cnt++)
+            deinitRawHeap(cnt);
+        for (int cnt = initJpegHeap ? numberOfJpegBuffers : 0; cnt < MAX_SNAPSHOT_BUFFERS; cnt++)
+            deinitJpegHeap(cnt);
+
         // Create Raw memory for snapshot
+        mRawIndex.clear();
         for (int cnt = 0; cnt < numberOfRawBuffers; cnt++) {
+            if (mRawMapped[cnt] != NULL) {
+                mRawIndex.add(mRawMapped[cnt]->data, cnt);
+                continue;
+            }
 #ifdef USE_ION
             if (allocate_ion_memory(&raw_main_ion_fd[cnt], &raw_alloc[cnt], &raw_ion_info_fd[cnt],
                                     ion_heap, mJpegMaxSize, &mRawfd[cnt]) < 0) {
@@ -3162,6 +4396,7 @@ bool QualcommCameraHardware::createSnapshotMemory (int numberOfRawBuffers, int n
                 ALOGE("Received following info for raw mapped data:%p,handle:%p, size:%d,release:%p",
                 mRawMapped[cnt]->data ,mRawMapped[cnt]->handle, mRawMapped[cnt]->size, mRawMapped[cnt]->release);
             }
+            mRawIndex.add(mRawMapped[cnt]->data, cnt);
             // Register Raw frames
             ALOGE("Registering buffer %d with fd :%d with kernel",cnt,mRawfd[cnt]);
             int active = (cnt < ACTIVE_ZSL_BUFFERS);  // TODO check ?
@@ -3175,9 +4410,23 @@ bool QualcommCameraHardware::createSnapshotMemory (int numberOfRawBuffers, int n
         }
         // Create Jpeg memory for snapshot
         if (initJpegHeap) {
+            mJpegIndex.clear();
             for (int cnt = 0; cnt < numberOfJpegBuffers; cnt++) {
+                if (mJpegMapped[cnt] != NULL) {
+                    mJpegIndex.add(mJpegMapped[cnt]->data, cnt);
+                    continue;
+                }
+#ifdef USE_ION
+                /* An fd backed heap lets receiveJpegPicture hand out a
+                 * view of the encoded image instead of a copy. */
+                if (mJpegZeroCopy && allocate_ion_memory(&jpeg_main_ion_fd[cnt], &jpeg_alloc[cnt],
+                        &jpeg_ion_info_fd[cnt], ion_heap, mJpegMaxSize, &mJpegfd[cnt]) < 0) {
+                    ALOGE("%s: allocate ion memory for jpeg failed, copying instead", __func__);
+                    mJpegfd[cnt] = -1;
+                }
+#endif
                 ALOGE("%s  Jpeg memory index: %d , fd is %d ", __func__, cnt, mJpegfd[cnt]);
-                mJpegMapped[cnt] = mGetMemory(-1, mJpegMaxSize, 1, mCallbackCookie);
+                mJpegMapped[cnt] = mGetMemory(mJpegfd[cnt], mJpegMaxSize, 1, mCallbackCookie);
                 if (mJpegMapped[cnt] == NULL) {
                     ALOGE("Failed to get camera memory for mJpegMapped heap index: %d", cnt);
                     return false;
@@ -3185,10 +4434,12 @@ bool QualcommCameraHardware::createSnapshotMemory (int numberOfRawBuffers, int n
                     ALOGE("Received following info for jpeg mapped data:%p,handle:%p, size:%d,release:%p",
                         mJpegMapped[cnt]->data ,mJpegMapped[cnt]->handle, mJpegMapped[cnt]->size, mJpegMapped[cnt]->release);
                 }
+                mJpegIndex.add(mJpegMapped[cnt]->data, cnt);
             }
         }
         // Lock Thumbnail buffers, and register them
         ALOGE("Locking and registering Thumbnail buffer(s)");
+        mThumbnailIndex.clear();
         for (int cnt = 0; cnt < (mZslEnable? (MAX_SNAPSHOT_BUFFERS-2) : numCapture); cnt++) {
             // TODO : change , lock all thumbnail buffers
             if ((mPreviewWindow != NULL) && (mThumbnailBuffer[cnt] != NULL)) {
@@ -3221,6 +4472,7 @@ bool QualcommCameraHardware::createSnapshotMemory (int numberOfRawBuffers, int n
                     ALOGE(" Couldnt map Thumbnail buffer %d", errno);
                     return false;
                 }
+                mThumbnailIndex.add(mThumbnailMapped[cnt], cnt);
                 register_buf(mBufferSize,
                     mCbCrOffset, 0,
                     thumbnailHandle->fd,
@@ -3279,7 +4531,9 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     int postViewBufferSize;
     uint32_t pictureAspectRatio;
     uint32_t i;
-    mParameters.getPictureSize(&mPictureWidth, &mPictureHeight);
+    Settings s = settings();
+    mPictureWidth = s.pictureWidth;
+    mPictureHeight = s.pictureHeight;
     mActualPictWidth = mPictureWidth;
     mActualPictHeight = mPictureHeight;
     if (updatePictureDimension(mParameters, mPictureWidth, mPictureHeight)) {
@@ -3389,7 +4643,7 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
         }
     }
 
-    int rotation = mParameters.getInt(CameraParameters::KEY_ROTATION);
+    int rotation = s.rotation;
 
     if (mIs3DModeOn)
         rotation = 0;
@@ -3437,9 +4691,7 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     mImageCaptureParms.postview_width = mPostviewWidth;
     mImageCaptureParms.postview_height = mPostviewHeight;
 
-    int width = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH);
-    int height = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT);
-    if ((width != 0) && (height != 0)) {
+    if ((s.thumbnailWidth != 0) && (s.thumbnailHeight != 0)) {
         mImageCaptureParms.thumbnail_width = mThumbnailWidth;
         mImageCaptureParms.thumbnail_height = mThumbnailHeight;
     } else {
@@ -3487,34 +4739,21 @@ void QualcommCameraHardware::deinitRawSnapshot()
 void QualcommCameraHardware::deinitRaw()
 {
     ALOGV("deinitRaw E");
-    ALOGV("deinitRaw , clearing raw memory and jpeg memory");
-    for (int cnt = 0; cnt < (mZslEnable ? MAX_SNAPSHOT_BUFFERS : numCapture); cnt++) {
-        if (NULL != mRawMapped[cnt]) {
-            ALOGE("Unregister MAIN_IMG");
-            register_buf(mJpegMaxSize,
-                mCbCrOffsetRaw, 0,
-                mRawfd[cnt], 0,
-                (uint8_t *)mRawMapped[cnt]->data,
-                MSM_PMEM_MAINIMG,
-                0, 0);
-            mRawMapped[cnt]->release(mRawMapped[cnt]);
-            mRawMapped[cnt] = NULL;
-            close(mRawfd[cnt]);
-#ifdef USE_ION
-            deallocate_ion_memory(&raw_main_ion_fd[cnt], &raw_ion_info_fd[cnt]);
-#endif
-        }
-    }
-    for (int cnt = 0; cnt < (mZslEnable ? MAX_SNAPSHOT_BUFFERS : numCapture); cnt++) {
-        if (NULL != mJpegMapped[cnt]) {
-            mJpegMapped[cnt]->release(mJpegMapped[cnt]);
-            mJpegMapped[cnt] = NULL;
+    if (mZslEnable || !mSnapshotPoolEnabled) {
+        ALOGV("deinitRaw , clearing raw memory and jpeg memory");
+        releaseSnapshotPool();
+    } else {
+        /* Heaps stay pooled for the next capture, except JPEG buffers the
+         * app still has a zero-copy view of. */
+        for (int cnt = 0; cnt < MAX_SNAPSHOT_BUFFERS; cnt++) {
+            if (mJpegLent[cnt])
+                deinitJpegHeap(cnt);
         }
     }
     if ( mPreviewWindow != NULL ) {
         ALOGE("deinitRaw , clearing/cancelling thumbnail buffers:");
         private_handle_t *handle;
-        for (int cnt = 0; cnt < (mZslEnable? (MAX_SNAPSHOT_BUFFERS-2) : numCapture); cnt++) {
+        for (int cnt = 0; cnt < mStreamPostviews; cnt++) {
             if (mPreviewWindow != NULL && mThumbnailBuffer[cnt] != NULL) {
                 handle = (private_handle_t *)(*mThumbnailBuffer[cnt]);
                 ALOGE("%s:  Cancelling postview buffer %d ", __FUNCTION__, handle->fd);
@@ -3560,6 +4799,52 @@ void QualcommCameraHardware::deinitRaw()
     ALOGV("deinitRaw X");
 }
 
+void QualcommCameraHardware::deinitRawHeap(int cnt)
+{
+    if (NULL != mRawMapped[cnt]) {
+        ALOGE("Unregister MAIN_IMG");
+        register_buf(mSnapshotPoolSize,
+            mSnapshotPoolCbCrOffset, 0,
+            mRawfd[cnt], 0,
+            (uint8_t *)mRawMapped[cnt]->data,
+            MSM_PMEM_MAINIMG,
+            0, 0);
+        mRawMapped[cnt]->release(mRawMapped[cnt]);
+        mRawMapped[cnt] = NULL;
+        close(mRawfd[cnt]);
+#ifdef USE_ION
+        deallocate_ion_memory(&raw_main_ion_fd[cnt], &raw_ion_info_fd[cnt]);
+#endif
+    }
+}
+
+/* Frees every raw and JPEG snapshot heap, pooled or not. */
+void QualcommCameraHardware::releaseSnapshotPool()
+{
+    for (int cnt = 0; cnt < MAX_SNAPSHOT_BUFFERS; cnt++) {
+        deinitRawHeap(cnt);
+        deinitJpegHeap(cnt);
+    }
+    mSnapshotPoolSize = 0;
+}
+
+void QualcommCameraHardware::deinitJpegHeap(int cnt)
+{
+    if (NULL != mJpegMapped[cnt]) {
+        mJpegMapped[cnt]->release(mJpegMapped[cnt]);
+        mJpegMapped[cnt] = NULL;
+    }
+#ifdef USE_ION
+    /* Views already delivered to the app keep their own reference. */
+    if (mJpegfd[cnt] >= 0) {
+        close(mJpegfd[cnt]);
+        deallocate_ion_memory(&jpeg_main_ion_fd[cnt], &jpeg_ion_info_fd[cnt], !mJpegLent[cnt]);
+        mJpegfd[cnt] = -1;
+    }
+#endif
+    mJpegLent[cnt] = false;
+}
+
 void QualcommCameraHardware::relinquishBuffers()
 {
     status_t retVal;
@@ -3585,6 +4870,12 @@ void QualcommCameraHardware::relinquishBuffers()
     } else {
       ALOGV(" PreviewWindow is null, will not cancelBuffers ");
     }
+    for (int cnt = 0; cnt < kTotalPreviewBufferCount; cnt++) {
+        if (mPreviewCbMapped[cnt] != NULL) {
+            mPreviewCbMapped[cnt]->release(mPreviewCbMapped[cnt]);
+            mPreviewCbMapped[cnt] = NULL;
+        }
+    }
     mDisplayLock.unlock();
     ALOGV("%s: X ", __FUNCTION__);
 }
@@ -3644,22 +4935,23 @@ status_t QualcommCameraHardware::getBuffersAndStartPreview() {
         }
         mTotalPreviewBufferCount = kPreviewBufferCount + numMinUndequeuedBufs;
 
-        const char *str = mParameters.getPreviewFormat();
-        int32_t previewFormat = attr_lookup(app_preview_formats,
-            sizeof(app_preview_formats) / sizeof(str_map), str);
-        if (previewFormat == NOT_FOUND) {
-            previewFormat = HAL_PIXEL_FORMAT_YCrCb_420_SP;
-        }
+        int32_t previewFormat = windowPreviewFormat();
+
+        /* Postview buffers are dequeued below for one burst round;
+         * takePicture() sizes its rounds to what was dequeued. */
+        int postviews = postviewCount();
 
         retVal = mPreviewWindow->set_buffer_count(mPreviewWindow,
-            mTotalPreviewBufferCount +
-            (mZslEnable? (MAX_SNAPSHOT_BUFFERS-2) : numCapture) );
+            mTotalPreviewBufferCount + postviews);
 
         if (retVal != NO_ERROR) {
             ALOGE("%s: Error while setting buffer count to %d ", __FUNCTION__, kPreviewBufferCount + 1);
             return retVal;
         }
         mParameters.getPreviewSize(&previewWidth, &previewHeight);
+        mStreamWidth = previewWidth;
+        mStreamHeight = previewHeight;
+        mStreamFormat = previewFormat;
 
         retVal = mPreviewWindow->set_buffers_geometry(mPreviewWindow,
             previewWidth, previewHeight, previewFormat);
@@ -3675,6 +4967,8 @@ status_t QualcommCameraHardware::getBuffersAndStartPreview() {
         int CbCrOffset = PAD_TO_WORD(previewWidth * previewHeight);
         int cnt = 0, active = 1;
         int mBufferSize = previewWidth * previewHeight * 3/2;
+        mPreviewIndex.clear();
+        mDisplayIndex.clear();
         for (cnt = 0; cnt < mTotalPreviewBufferCount; cnt++) {
             buffer_handle_t *bhandle = NULL;
             retVal = mPreviewWindow->dequeue_buffer(mPreviewWindow,
@@ -3726,6 +5020,23 @@ status_t QualcommCameraHardware::getBuffersAndStartPreview() {
                     frame_buffer[cnt].frame = &frames[cnt];
                     frame_buffer[cnt].buffer = bhandle;
                     frame_buffer[cnt].size = handle->size;
+
+                    /* Map the data callback wrapper once here instead of
+                     * for every preview frame. */
+                    if (mPreviewCbMapped[cnt] != NULL)
+                        mPreviewCbMapped[cnt]->release(mPreviewCbMapped[cnt]);
+                    mPreviewCbMapped[cnt] = NULL;
+                    if (mPreviewFormat == CAMERA_YUV_420_NV21) {
+                        mPreviewCbMapped[cnt] = mGetMemory(handle->fd, mBufferSize, 1, mCallbackCookie);
+                        if (mPreviewCbMapped[cnt] == NULL || mPreviewCbMapped[cnt]->data == NULL) {
+                            ALOGE("%s: mGetMemory failed for callback buffer %d", __FUNCTION__, cnt);
+                            if (mPreviewCbMapped[cnt] != NULL)
+                                mPreviewCbMapped[cnt]->release(mPreviewCbMapped[cnt]);
+                            mPreviewCbMapped[cnt] = NULL;
+                        }
+                    }
+                    mPreviewIndex.add((const void *)frames[cnt].buffer, cnt);
+                    mDisplayIndex.add(bhandle, cnt);
                     active = (cnt < ACTIVE_PREVIEW_BUFFERS);
 
                     ALOGE("Registering buffer %d with fd :%d with kernel",cnt,handle->fd);
@@ -3747,7 +5058,7 @@ status_t QualcommCameraHardware::getBuffersAndStartPreview() {
         }
 
         // Dequeue Thumbnail/Postview  Buffers here , Consider ZSL/Multishot cases
-        for (cnt = 0; cnt < (mZslEnable? (MAX_SNAPSHOT_BUFFERS-2) : numCapture); cnt++) {
+        for (cnt = 0; cnt < postviews; cnt++) {
             retVal = mPreviewWindow->dequeue_buffer(mPreviewWindow,
                 &mThumbnailBuffer[cnt], &(stride));
             private_handle_t* handle = (private_handle_t *)(*mThumbnailBuffer[cnt]);
@@ -3769,10 +5080,12 @@ status_t QualcommCameraHardware::getBuffersAndStartPreview() {
         ALOGE("%s: Could not get Buffer from Surface", __FUNCTION__);
         return UNKNOWN_ERROR;
     }
-    mPreviewBusyQueue.init();
-    LINK_camframe_release_all_frames(CAM_PREVIEW_FRAME);
-    for (int i = ACTIVE_PREVIEW_BUFFERS; i < kPreviewBufferCount; i++)
-        LINK_camframe_add_frame(CAM_PREVIEW_FRAME,&frames[i]);
+    mStreamWindow = mPreviewWindow;
+    mStreamPostviews = postviewCount();
+    mPreviewActiveMask = (1 << ACTIVE_PREVIEW_BUFFERS) - 1;
+    mPreviewBusyQueue.init(mTotalPreviewBufferCount);
+    resetPreviewStats();
+    queueFreePreviewBuffers();
 
     mBuffersInitialized = true;
 
@@ -3783,6 +5096,98 @@ status_t QualcommCameraHardware::getBuffersAndStartPreview() {
     return NO_ERROR;
 }
 
+/* Hands the preview buffers the HAL holds to the driver's free queue;
+ * those registered active are already the VFE's. */
+void QualcommCameraHardware::queueFreePreviewBuffers()
+{
+    LINK_camframe_release_all_frames(CAM_PREVIEW_FRAME);
+    for (int i = 0; i < mTotalPreviewBufferCount; i++) {
+        if ((mPreviewActiveMask & (1 << i)) || mPreviewSlotOwner[i] == SLOT_DISPLAY)
+            continue;
+        mPreviewSlotOwner[i] = SLOT_DRIVER;
+        LINK_camframe_add_frame(CAM_PREVIEW_FRAME, &frames[i]);
+    }
+}
+
+/* Postview buffers dequeued from the window along with the preview ones. */
+int QualcommCameraHardware::postviewCount()
+{
+    if (mZslEnable)
+        return MAX_SNAPSHOT_BUFFERS - 2;
+    if (!mHdrMode && !mExpBracketMode)
+        return mBurstShots < mBurstDepth ? mBurstShots : mBurstDepth;
+    return numCapture;
+}
+
+/* The gralloc format of the display buffers. Converted formats are only
+ * produced for the data callback; the window always gets NV21 for them. */
+int32_t QualcommCameraHardware::windowPreviewFormat()
+{
+    if (mPreviewConvert != NV21_CONVERT_NONE)
+        return HAL_PIXEL_FORMAT_YCrCb_420_SP;
+    int32_t format = attr_lookup(app_preview_formats,
+        sizeof(app_preview_formats) / sizeof(str_map), mParameters.getPreviewFormat());
+    return format == NOT_FOUND ? HAL_PIXEL_FORMAT_YCrCb_420_SP : format;
+}
+
+/* Whether the buffers dequeued by getBuffersAndStartPreview() still fit
+ * the stream mParameters describes. */
+bool QualcommCameraHardware::streamGeometryUnchanged()
+{
+    if (!mBuffersInitialized || mPreviewWindow == NULL ||
+        mPreviewWindow != mStreamWindow || mIs3DModeOn)
+        return false;
+
+    int width, height;
+    mParameters.getPreviewSize(&width, &height);
+    int32_t format = windowPreviewFormat();
+
+    return width == mStreamWidth && height == mStreamHeight &&
+        format == mStreamFormat && postviewCount() == mStreamPostviews;
+}
+
+/* Restarts preview on the buffers still dequeued from the window. The
+ * frame thread unregistered them on exit; they are registered again, the
+ * first held ones active, while those queued to the display come back
+ * through the preview thread as usual. */
+status_t QualcommCameraHardware::restartPreviewWithBuffers()
+{
+    ALOGI(" %s : E ", __FUNCTION__);
+    mFrameThreadWaitLock.lock();
+    while (mFrameThreadRunning) {
+        ALOGV("%s: waiting for old frame thread to complete.", __FUNCTION__);
+        mFrameThreadWait.wait(mFrameThreadWaitLock);
+    }
+    mFrameThreadWaitLock.unlock();
+
+    int CbCrOffset = PAD_TO_WORD(previewWidth * previewHeight);
+    int mBufferSize = previewWidth * previewHeight * 3/2;
+    int active = 0;
+    mPreviewActiveMask = 0;
+    for (int cnt = 0; cnt < mTotalPreviewBufferCount; cnt++) {
+        bool vfe = mPreviewSlotOwner[cnt] != SLOT_DISPLAY && active < ACTIVE_PREVIEW_BUFFERS;
+        if (vfe) {
+            mPreviewActiveMask |= 1 << cnt;
+            mPreviewSlotOwner[cnt] = SLOT_DRIVER;
+            active++;
+        }
+        register_buf(mBufferSize,
+            CbCrOffset, 0,
+            frames[cnt].fd,
+            0,
+            (uint8_t *)frames[cnt].buffer,
+            MSM_PMEM_PREVIEW,
+            vfe);
+    }
+    if (active < ACTIVE_PREVIEW_BUFFERS)
+        ALOGW("%s: only %d preview buffers held for the VFE", __FUNCTION__, active);
+
+    /* initPreview() queues the remaining held buffers. */
+    status_t rc = startPreviewInternal();
+    ALOGI(" %s : X ", __FUNCTION__);
+    return rc;
+}
+
 void QualcommCameraHardware::release()
 {
     ALOGI("release E");
@@ -3823,11 +5228,20 @@ void QualcommCameraHardware::release()
     {
         Mutex::Autolock l (&mRawPictureHeapLock);
         deinitRaw();
+        releaseSnapshotPool();
     }
 
     deinitRawSnapshot();
+#ifdef USE_ION
+    ion_cache_trim(0);
+#endif
     ALOGI("release: clearing resources done.");
     LINK_mm_camera_deinit();
+    releaseStatsBuffers();
+    if (mFaceMetaMem != NULL) {
+        mFaceMetaMem->release(mFaceMetaMem);
+        mFaceMetaMem = NULL;
+    }
 
     ALOGI("release X: mCameraRunning = %d, mFrameThreadRunning = %d", mCameraRunning, mFrameThreadRunning);
     ALOGI("mVideoThreadRunning = %d, mSnapshotThreadRunning = %d, mJpegThreadRunning = %d", mVideoThreadRunning, mSnapshotThreadRunning, mJpegThreadRunning);
@@ -3841,6 +5255,133 @@ void QualcommCameraHardware::release()
     mFrameThreadWaitLock.unlock();
 }
 
+static float frames_per_second(int32_t frames, nsecs_t start)
+{
+    nsecs_t elapsed = systemTime() - start;
+    if (start == 0 || elapsed <= 0)
+        return 0.0f;
+    return frames * 1000000000.0f / elapsed;
+}
+
+/* Called from dumpsys, possibly while the HAL is wedged: never blocks on
+ * the main or parameters lock. Counters are read without locks; the
+ * plain-int ones may be a little stale, which is fine for a snapshot, but
+ * nothing that can be reallocated under it is touched unlocked. */
+status_t QualcommCameraHardware::dump(int fd)
+{
+    static const char *owner_names[] = { "driver", "hal", "display", "app" };
+    String8 out;
+
+    out.appendFormat("QualcommCameraHardware %p (target %d)\n", this, mCurrentTarget);
+    out.appendFormat("  state: running=%d preview_initialized=%d recording=%d 3d=%d zsl=%d hfr=%d\n",
+        mCameraRunning, mPreviewInitialized, mRecordingState, mIs3DModeOn,
+        mZslEnable, mHFRMode);
+    out.appendFormat("  threads: frame=%d preview=%d video=%d snapshot=%d jpeg=%d liveshot=%d\n",
+        mFrameThreadRunning, mPreviewThreadRunning, mVideoThreadRunning,
+        mSnapshotThreadRunning, mJpegThreadRunning, liveshot_state);
+    out.appendFormat("  msg enabled: 0x%x\n", mMsgEnabled);
+    out.appendFormat("  parameter setters: %d applied, %d skipped\n",
+        mParamsApplied, mParamsSkipped);
+    out.appendFormat("  flattened parameters: generation %d, %d built, %d reused\n",
+        mParamGeneration, mFlatParamsBuilt, mFlatParamsReused);
+
+    // mParameters is also written under mParametersLock alone, e.g. by
+    // the smooth zoom worker, so the main lock is not enough to read it.
+    if (mLock.tryLock() == NO_ERROR) {
+        if (mParametersLock.tryLock() == NO_ERROR) {
+            const char *hfr = mParameters.get(CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE);
+            int pictureWidth, pictureHeight;
+            mParameters.getPictureSize(&pictureWidth, &pictureHeight);
+            out.appendFormat("  preview %dx%d fmt %d, video %dx%d, picture %dx%d, hfr %s\n",
+                previewWidth, previewHeight, mPreviewFormat, videoWidth, videoHeight,
+                pictureWidth, pictureHeight, hfr ? hfr : "off");
+            mParametersLock.unlock();
+        } else {
+            out.append("  (parameters busy, skipped)\n");
+        }
+        mLock.unlock();
+    } else {
+        out.append("  (parameters busy, skipped)\n");
+    }
+
+    out.appendFormat("  preview: %.1f fps, busy queue %d\n",
+        frames_per_second(android_atomic_acquire_load(&mPreviewFramesReceived), mPreviewStartTime),
+        mPreviewBusyQueue.count());
+    out.append("  preview slots:");
+    for (int i = 0; i < kTotalPreviewBufferCount; i++)
+        out.appendFormat(" %d:%s", i, owner_names[mPreviewSlotOwner[i] & 3]);
+    out.append("\n");
+    dumpPreviewStats(out);
+    out.appendFormat("  stream: %dx%d format %d, %d postview; mode switches: %d kept buffers, %d reallocated",
+        mStreamWidth, mStreamHeight, mStreamFormat, mStreamPostviews,
+        mStreamReconfigs, mStreamRestarts);
+    if (mLastModeSwitchTime > 0)
+        out.appendFormat(", last took %lld ms", mLastModeSwitchTime / 1000000LL);
+    out.append("\n");
+
+    if (kRecordBufferCount > 0) {
+        out.appendFormat("  video: %d frames, %.1f fps, %d dropped, busy queue %d, %d batches (max %d)\n",
+            android_atomic_acquire_load(&mRecordFramesReceived),
+            mRecordingState ? frames_per_second(
+                android_atomic_acquire_load(&mRecordFramesReceived), mRecordStartTime) : 0.0f,
+            android_atomic_acquire_load(&mRecordFramesDropped),
+            mVideoBusyQueue.count(), mVideoBatches, mVideoBatchMax);
+        out.appendFormat("  encoder returns: %d, %d deferred to the frame thread\n",
+            android_atomic_acquire_load(&mRecordReturns),
+            android_atomic_acquire_load(&mRecordReturnsDeferred));
+        out.append("  video slots:");
+        for (int i = 0; i < kRecordBufferCount; i++)
+            out.appendFormat(" %d:%s", i, owner_names[mRecordSlotOwner[i] & 3]);
+        out.append("\n");
+    }
+
+    out.append("  snapshot:\n");
+    mShotToRaw.format(out, "raw");
+    mShotToJpeg.format(out, "jpeg");
+    mShotToShot.format(out, "shot2shot");
+    mJpegDelivery.format(out, "deliver");
+    out.appendFormat("    jpeg delivered: %d zero-copy, %d copied\n",
+        android_atomic_acquire_load(&mJpegZeroCopyCount),
+        android_atomic_acquire_load(&mJpegCopyCount));
+    out.appendFormat("    buffer pool: %s, %d reused, %d allocated, %d bytes per heap\n",
+        mSnapshotPoolEnabled ? "on" : "off", mSnapshotPoolHits, mSnapshotPoolMisses,
+        mSnapshotPoolSize);
+    out.appendFormat("    burst: %d shots, depth %d (%d buffers), %d bursts taken\n",
+        mBurstShots, mBurstDepth, numCapture, mBurstsTaken);
+    if (mLastBurstTime > 0)
+        out.appendFormat("    last burst: %d shots in %lld ms, %.2f shots/s\n",
+            mLastBurstShots, mLastBurstTime / 1000000LL,
+            mLastBurstShots * 1e9 / mLastBurstTime);
+
+#ifdef USE_ION
+    ion_cache_limit_bytes();
+    ion_stats_lock.lock();
+    out.appendFormat("  ion: %d allocations, %d bytes\n", ion_allocs_in_use, ion_bytes_in_use);
+    out.appendFormat("    cache: %d buffers, %d bytes resident (limit %d), %d hits, %d misses",
+        ion_cache_count, ion_cache_bytes, ion_cache_limit, ion_cache_hits, ion_cache_misses);
+    if (ion_cache_hits + ion_cache_misses > 0)
+        out.appendFormat(", %d%% hit rate",
+            ion_cache_hits * 100 / (ion_cache_hits + ion_cache_misses));
+    out.append("\n");
+    if (ion_allocs_untracked > 0)
+        out.appendFormat("    %d allocations untracked (over %d)\n",
+            ion_allocs_untracked, MAX_ION_ALLOCS);
+    ion_stats_lock.unlock();
+#endif
+
+    static const char *lock_names[LOCK_MAX] = {
+        "callback", "display", "record_frame", "frame_thread"
+    };
+    out.append("  lock contention:\n");
+    for (int i = 0; i < LOCK_MAX; i++)
+        out.appendFormat("    %-12s %d/%d\n", lock_names[i],
+            android_atomic_acquire_load(&mLockContended[i]),
+            android_atomic_acquire_load(&mLockAcquired[i]));
+
+    write(fd, out.string(), out.size());
+    return NO_ERROR;
+}
+
 QualcommCameraHardware::~QualcommCameraHardware()
 {
     ALOGI("~QualcommCameraHardware E");
@@ -3869,6 +5410,8 @@ status_t QualcommCameraHardware::startPreviewInternal()
         ALOGV("startPreview X: preview already running.");
         return NO_ERROR;
     }
+    // Starting the stream resets sensor state; push everything again.
+    invalidateParams();
     if (mZslEnable) {
         //call init
         ALOGI("ZSL Enable called");
@@ -3945,7 +5488,7 @@ status_t QualcommCameraHardware::startPreviewInternal()
             }
         }
         /* Flush the Busy Q */
-        cam_frame_flush_video();
+        mVideoBusyQueue.flush();
         /* Need to flush the free Qs as these are initalized in initPreview.*/
         LINK_camframe_release_all_frames(CAM_VIDEO_FRAME);
         LINK_camframe_release_all_frames(CAM_PREVIEW_FRAME);
@@ -4000,18 +5543,13 @@ void QualcommCameraHardware::stopPreviewInternal()
 {
     ALOGI("stopPreviewInternal E: %d", mCameraRunning);
     mPreviewStopping = true;
+    invalidateParams();
     if (mCameraRunning && mPreviewWindow != NULL) {
         /* For 3D mode, we need to exit the video thread.*/
         if (mIs3DModeOn) {
             mRecordingState = 0;
-            mVideoThreadWaitLock.lock();
             ALOGI("%s: 3D mode, exit video thread", __FUNCTION__);
-            mVideoThreadExit = 1;
-            mVideoThreadWaitLock.unlock();
-
-            pthread_mutex_lock(&g_busy_frame_queue.mut);
-            pthread_cond_signal(&g_busy_frame_queue.wait);
-            pthread_mutex_unlock(&g_busy_frame_queue.mut);
+            mVideoBusyQueue.requestExit();
         }
 
         // Cancel auto focus.
@@ -4019,15 +5557,11 @@ void QualcommCameraHardware::stopPreviewInternal()
             cancelAutoFocusInternal();
         }
 
-        // make mSmoothzoomThreadExit true
-        mSmoothzoomThreadLock.lock();
-        mSmoothzoomThreadExit = true;
-        mSmoothzoomThreadLock.unlock();
-        // singal smooth zoom thread , so that it can exit gracefully
+        // Stop smooth zoom where it is; the worker exits without a
+        // final CAMERA_MSG_ZOOM.
         mSmoothzoomThreadWaitLock.lock();
-        if (mSmoothzoomThreadRunning)
-            mSmoothzoomThreadWait.signal();
-
+        mSmoothzoomThreadExit = true;
+        mSmoothzoomThreadWait.signal();
         mSmoothzoomThreadWaitLock.unlock();
 
         Mutex::Autolock l(&mCamframeTimeoutLock);
@@ -4085,18 +5619,12 @@ void QualcommCameraHardware::stopPreviewInternal()
             if (mCurrentTarget == TARGET_MSM7630 ||
                 mCurrentTarget == TARGET_QSD8250 ||
                 mCurrentTarget == TARGET_MSM8660) {
-                mVideoThreadWaitLock.lock();
-                ALOGV("in stopPreviewInternal: making mVideoThreadExit 1");
-                mVideoThreadExit = 1;
-                mVideoThreadWaitLock.unlock();
                 //if stop is called, if so exit video thread.
-                pthread_mutex_lock(&(g_busy_frame_queue.mut));
-                pthread_cond_signal(&(g_busy_frame_queue.wait));
-                pthread_mutex_unlock(&(g_busy_frame_queue.mut));
+                mVideoBusyQueue.requestExit();
 
                 ALOGE(" flush video and release all frames");
                 /* Flush the Busy Q */
-                cam_frame_flush_video();
+                mVideoBusyQueue.flush();
                 /* Flush the Free Q */
                 LINK_camframe_release_all_frames(CAM_VIDEO_FRAME);
             }
@@ -4122,7 +5650,7 @@ void QualcommCameraHardware::stopPreview()
     }
     if (mPreviewWindow != NULL) {
         private_handle_t *handle;
-        for (int cnt = 0; cnt < (mZslEnable? (MAX_SNAPSHOT_BUFFERS-2) : numCapture); cnt++) {
+        for (int cnt = 0; cnt < mStreamPostviews; cnt++) {
             if (mPreviewWindow != NULL && mThumbnailBuffer[cnt] != NULL) {
                 handle = (private_handle_t *)(*mThumbnailBuffer[cnt]);
                 ALOGE("%s:  Cancelling postview buffer %d ", __FUNCTION__, handle->fd);
@@ -4160,6 +5688,10 @@ void QualcommCameraHardware::stopPreview()
         }
     }
     stopPreviewInternal();
+#ifdef USE_ION
+    /* Idle point: drop buffers nobody has asked for in a while. */
+    ion_cache_trim(ion_cache_limit_bytes());
+#endif
     ALOGV("stopPreview: X");
 }
 
@@ -4171,10 +5703,9 @@ void QualcommCameraHardware::runAutoFocus()
     mAutoFocusThreadLock.lock();
     // Skip autofocus if focus mode is infinity.
 
-    const char *focusMode = mParameters.get(CameraParameters::KEY_FOCUS_MODE);
-    if (mParameters.get(CameraParameters::KEY_FOCUS_MODE) == 0 ||
-        strcmp(focusMode, CameraParameters::FOCUS_MODE_INFINITY) == 0 ||
-        strcmp(focusMode, CameraParameters::FOCUS_MODE_CONTINUOUS_VIDEO) == 0) {
+    int focusMode = settings().focusMode;
+    if (focusMode == NOT_FOUND || focusMode == DONT_CARE ||
+        focusMode == AF_MODE_CAF_VID) {
         goto done;
     }
 
@@ -4185,9 +5716,7 @@ void QualcommCameraHardware::runAutoFocus()
         return;
     }
 
-    afMode = (isp3a_af_mode_t)attr_lookup(focus_modes,
-        sizeof(focus_modes) / sizeof(str_map),
-        mParameters.get(CameraParameters::KEY_FOCUS_MODE));
+    afMode = (isp3a_af_mode_t)focusMode;
 
     /* This will block until either AF completes or is cancelled. */
     ALOGV("af start (mode %d)", afMode);
@@ -4217,7 +5746,7 @@ void QualcommCameraHardware::runAutoFocus()
     {
         Mutex::Autolock pl(&mParametersLock);
         if (mHasAutoFocusSupport && updateFocusDistances(focusMode) != NO_ERROR) {
-            ALOGE("%s: updateFocusDistances failed for %s", __FUNCTION__, focusMode);
+            ALOGE("%s: updateFocusDistances failed for %d", __FUNCTION__, focusMode);
         }
     }
 
@@ -4380,26 +5909,79 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
     mJpegThreadWaitLock.unlock();
     mm_camera_ops_type_t current_ops_type = (mSnapshotFormat == PICTURE_FORMAT_JPEG) ?
         CAMERA_OPS_CAPTURE_AND_ENCODE : CAMERA_OPS_RAW_CAPTURE;
+    mBurstRoundShots = numCapture;
+    mBurstShotsLeft = 0;
     if (strTexturesOn == true) {
         current_ops_type = CAMERA_OPS_CAPTURE;
         mCamOps.mm_camera_start(current_ops_type, &mImageCaptureParms, NULL);
     } else if (mSnapshotFormat == PICTURE_FORMAT_JPEG) {
         if (!mZslEnable || mZslFlashEnable) {
-            mCamOps.mm_camera_start(current_ops_type, &mImageCaptureParms, &mImageEncodeParms);
+            /* Burst: each round hands the encoder every buffer it has, so
+             * readout of the next shot overlaps encode of the previous one.
+             * Later rounds reuse the same registered buffers. */
+            nsecs_t burstStart = systemTime();
+            int taken = 0;
+            mBurstShotsLeft = mBurstShots;
+            while (mBurstShotsLeft > 0) {
+                mBurstRoundShots = mBurstShotsLeft < numCapture ? mBurstShotsLeft : numCapture;
+                mBurstShotsLeft -= mBurstRoundShots;
+                mImageCaptureParms.num_captures = mBurstRoundShots;
+                if (taken > 0) {
+                    mCamOps.mm_camera_deinit(current_ops_type, NULL, NULL);
+                    mCamOps.mm_camera_init(current_ops_type, NULL, NULL);
+                    invalidateParams();
+                    if (!setCaptureParms()) {
+                        ALOGE("%s: burst round %d: capture parameters lost, stopping",
+                            __FUNCTION__, taken / numCapture + 1);
+                        break;
+                    }
+                    mShotStartTime = systemTime();
+                    numJpegReceived = 0;
+                    mJpegThreadWaitLock.lock();
+                    mJpegThreadRunning = true;
+                    mJpegThreadWaitLock.unlock();
+                }
+                mCamOps.mm_camera_start(current_ops_type, &mImageCaptureParms, &mImageEncodeParms);
+                mJpegThreadWaitLock.lock();
+                while (mJpegThreadRunning) {
+                    ALOGV("%s: waiting for jpeg callback.", __FUNCTION__);
+                    mJpegThreadWait.wait(mJpegThreadWaitLock);
+                    ALOGV("%s: jpeg callback received.", __FUNCTION__);
+                }
+                mJpegThreadWaitLock.unlock();
+
+                /* A failed or cancelled shot ends the whole burst. */
+                if (numJpegReceived < mBurstRoundShots)
+                    break;
+                taken += mBurstRoundShots;
+                mSnapshotCancelLock.lock();
+                bool cancelled = mSnapshotCancel;
+                mSnapshotCancelLock.unlock();
+                if (cancelled)
+                    break;
+            }
+            mBurstShotsLeft = 0;
+            if (taken > 1) {
+                mLastBurstShots = taken;
+                mLastBurstTime = systemTime() - burstStart;
+                mBurstsTaken++;
+                ALOGI("%s: burst of %d shots in %lld ms", __FUNCTION__, taken,
+                    mLastBurstTime / 1000000LL);
+            }
         } else {
             notifyShutter(TRUE);
             initZslParameter();
             ALOGE("snapshot mZslCapture.thumbnail %d %d %d", mZslCaptureParms.thumbnail_width,
                 mZslCaptureParms.thumbnail_height,mZslCaptureParms.num_captures);
             mCamOps.mm_camera_start(current_ops_type, &mZslCaptureParms, &mImageEncodeParms);
+            mJpegThreadWaitLock.lock();
+            while (mJpegThreadRunning) {
+                ALOGV("%s: waiting for jpeg callback.", __FUNCTION__);
+                mJpegThreadWait.wait(mJpegThreadWaitLock);
+                ALOGV("%s: jpeg callback received.", __FUNCTION__);
+            }
+            mJpegThreadWaitLock.unlock();
         }
-        mJpegThreadWaitLock.lock();
-        while (mJpegThreadRunning) {
-            ALOGV("%s: waiting for jpeg callback.", __FUNCTION__);
-            mJpegThreadWait.wait(mJpegThreadWaitLock);
-            ALOGV("%s: jpeg callback received.", __FUNCTION__);
-        }
-        mJpegThreadWaitLock.unlock();
 
         //cleanup
         if (!mZslEnable || mZslFlashEnable)
@@ -4424,6 +6006,10 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
     if (!mZslEnable || mZslFlashEnable)
         mCamOps.mm_camera_deinit(current_ops_type, NULL, NULL);
     mZslFlashEnable  = false;
+#ifdef USE_ION
+    /* Snapshot-sized buffers are not worth holding between captures. */
+    ion_cache_trim(0);
+#endif
     mSnapshotThreadWaitLock.lock();
     mSnapshotThreadRunning = false;
     mSnapshotThreadWait.signal();
@@ -4452,6 +6038,12 @@ status_t QualcommCameraHardware::takePicture()
         return takeLiveSnapshotInternal();
     }
 
+    nsecs_t shotTime = systemTime();
+    if (mLastShotTime != 0)
+        mShotToShot.record(shotTime - mLastShotTime);
+    mLastShotTime = shotTime;
+    mShotStartTime = shotTime;
+
     if (strTexturesOn == true) {
         mEncodePendingWaitLock.lock();
         while (mEncodePending) {
@@ -4482,9 +6074,8 @@ status_t QualcommCameraHardware::takePicture()
         }
     }
 
-    if (mParameters.getPictureFormat() != 0 &&
-        !strcmp(mParameters.getPictureFormat(),
-            CameraParameters::PIXEL_FORMAT_RAW)) {
+    Settings s = settings();
+    if (s.rawPicture) {
         mSnapshotFormat = PICTURE_FORMAT_RAW;
         // HACK: Raw ZSL capture is not supported yet
         mZslFlashEnable = true;
@@ -4500,7 +6091,7 @@ status_t QualcommCameraHardware::takePicture()
             }
         }
     } else {
-        int rotation = mParameters.getInt(CameraParameters::KEY_ROTATION);
+        int rotation = s.rotation;
         native_set_parms(CAMERA_PARM_JPEG_ROTATION, sizeof(int), &rotation);
     }
 
@@ -4515,8 +6106,20 @@ status_t QualcommCameraHardware::takePicture()
     if (strTexturesOn == true)
         current_ops_type = CAMERA_OPS_CAPTURE;
 
-    if (!mZslEnable || mZslFlashEnable)
+    if (!mZslEnable || mZslFlashEnable) {
         mCamOps.mm_camera_init(current_ops_type, NULL, NULL);
+        invalidateParams();
+    }
+
+    /* A plain burst goes through the snapshot buffers in rounds of up to
+     * mBurstDepth shots, with one postview buffer per shot in a round. */
+    if (!mZslEnable && !mHdrMode && !mExpBracketMode) {
+        numCapture = postviewCount();
+        if (mBuffersInitialized && numCapture > mStreamPostviews)
+            numCapture = mStreamPostviews;
+        if (numCapture < 1)
+            numCapture = 1;
+    }
 
     if (mSnapshotFormat == PICTURE_FORMAT_JPEG) {
         if (!mZslEnable || mZslFlashEnable) {
@@ -4672,6 +6275,214 @@ status_t QualcommCameraHardware::cancelPicture()
     return rc;
 }
 
+/* Keys each setter reads, indexed by PARAM_*. */
+const char * const *QualcommCameraHardware::paramKeys(int id)
+{
+    static const char * const camera_mode[] = { CameraParameters::KEY_CAMERA_MODE, NULL };
+    static const char * const preview_size[] = { CameraParameters::KEY_PREVIEW_SIZE, NULL };
+    static const char * const record_size[] = { CameraParameters::KEY_VIDEO_SIZE,
+        CameraParameters::KEY_PREVIEW_SIZE, NULL };
+    static const char * const picture_size[] = { CameraParameters::KEY_PICTURE_SIZE, NULL };
+    static const char * const thumbnail_size[] = { CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH,
+        CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT, NULL };
+    static const char * const jpeg_quality[] = { CameraParameters::KEY_JPEG_QUALITY,
+        CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY, NULL };
+    static const char * const picture_format[] = { CameraParameters::KEY_PICTURE_FORMAT, NULL };
+    static const char * const preview_format[] = { CameraParameters::KEY_PREVIEW_FORMAT, NULL };
+    static const char * const preview_cb_size[] = { "preview-callback-size",
+        CameraParameters::KEY_PREVIEW_SIZE, NULL };
+    static const char * const effect[] = { CameraParameters::KEY_EFFECT, NULL };
+    static const char * const gps[] = { CameraParameters::KEY_GPS_PROCESSING_METHOD,
+        CameraParameters::KEY_GPS_LATITUDE, CameraParameters::KEY_GPS_LATITUDE_REF,
+        CameraParameters::KEY_GPS_LONGITUDE, CameraParameters::KEY_GPS_LONGITUDE_REF,
+        CameraParameters::KEY_GPS_ALTITUDE, CameraParameters::KEY_GPS_ALTITUDE_REF,
+        CameraParameters::KEY_GPS_STATUS, CameraParameters::KEY_EXIF_DATETIME,
+        CameraParameters::KEY_GPS_TIMESTAMP, NULL };
+    static const char * const rotation[] = { CameraParameters::KEY_ROTATION, NULL };
+    static const char * const zoom[] = { CameraParameters::KEY_ZOOM, NULL };
+    static const char * const orientation[] = { "orientation", NULL };
+    static const char * const lensshade[] = { CameraParameters::KEY_LENSSHADE, NULL };
+    static const char * const mce[] = { CameraParameters::KEY_MEMORY_COLOR_ENHANCEMENT, NULL };
+    static const char * const sharpness[] = { CameraParameters::KEY_SHARPNESS, NULL };
+    static const char * const saturation[] = { CameraParameters::KEY_SATURATION, NULL };
+    static const char * const touch_af_aec[] = { CameraParameters::KEY_TOUCH_AF_AEC,
+        "touchAfAec-dx", "touchAfAec-dy", CameraParameters::KEY_METERING_AREAS,
+        CameraParameters::KEY_PREVIEW_SIZE, NULL };
+    static const char * const scene_mode[] = { CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const contrast[] = { CameraParameters::KEY_CONTRAST,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const scene_detect[] = { CameraParameters::KEY_SCENE_DETECT, NULL };
+    static const char * const str_textures[] = { "strtextures", NULL };
+    static const char * const skin_tone[] = { CameraParameters::KEY_SKIN_TONE_ENHANCEMENT, NULL };
+    static const char * const antibanding[] = { CameraParameters::KEY_ANTIBANDING, NULL };
+    static const char * const redeye[] = { CameraParameters::KEY_REDEYE_REDUCTION, NULL };
+    static const char * const denoise[] = { CameraParameters::KEY_DENOISE, NULL };
+    static const char * const fps_range[] = { CameraParameters::KEY_PREVIEW_FPS_RANGE, NULL };
+    static const char * const recording_hint[] = { CameraParameters::KEY_RECORDING_HINT, NULL };
+    /* The setters below only run with scene mode off; a scene change
+     * has to push them again. */
+    static const char * const frame_rate[] = { CameraParameters::KEY_PREVIEW_FRAME_RATE,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const auto_exposure[] = { CameraParameters::KEY_AUTO_EXPOSURE,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const exposure_comp[] = { CameraParameters::KEY_EXPOSURE_COMPENSATION,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const white_balance[] = { CameraParameters::KEY_WHITE_BALANCE,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const flash_mode[] = { CameraParameters::KEY_FLASH_MODE,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const focus_mode[] = { CameraParameters::KEY_FOCUS_MODE,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const brightness[] = { "luma-adaptation",
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const iso_mode[] = { CameraParameters::KEY_ISO_MODE,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const focus_areas[] = { CameraParameters::KEY_FOCUS_AREAS,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const metering_areas[] = { CameraParameters::KEY_METERING_AREAS,
+        CameraParameters::KEY_SCENE_MODE, NULL };
+    static const char * const zone_af[] = { CameraParameters::KEY_SELECTABLE_ZONE_AF,
+        CameraParameters::KEY_FOCUS_MODE, NULL };
+    static const char * const hfr_mode[] = { CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE, NULL };
+
+    switch (id) {
+    case PARAM_CAMERA_MODE:     return camera_mode;
+    case PARAM_PREVIEW_SIZE:    return preview_size;
+    case PARAM_RECORD_SIZE:     return record_size;
+    case PARAM_PICTURE_SIZE:    return picture_size;
+    case PARAM_THUMBNAIL_SIZE:  return thumbnail_size;
+    case PARAM_JPEG_QUALITY:    return jpeg_quality;
+    case PARAM_PICTURE_FORMAT:  return picture_format;
+    case PARAM_PREVIEW_FORMAT:  return preview_format;
+    case PARAM_PREVIEW_CB_SIZE: return preview_cb_size;
+    case PARAM_EFFECT:          return effect;
+    case PARAM_GPS:             return gps;
+    case PARAM_ROTATION:        return rotation;
+    case PARAM_ZOOM:            return zoom;
+    case PARAM_ORIENTATION:     return orientation;
+    case PARAM_LENSSHADE:       return lensshade;
+    case PARAM_MCE:             return mce;
+    case PARAM_SHARPNESS:       return sharpness;
+    case PARAM_SATURATION:      return saturation;
+    case PARAM_TOUCH_AF_AEC:    return touch_af_aec;
+    case PARAM_SCENE_MODE:      return scene_mode;
+    case PARAM_CONTRAST:        return contrast;
+    case PARAM_SCENE_DETECT:    return scene_detect;
+    case PARAM_STR_TEXTURES:    return str_textures;
+    case PARAM_SKIN_TONE:       return skin_tone;
+    case PARAM_ANTIBANDING:     return antibanding;
+    case PARAM_REDEYE:          return redeye;
+    case PARAM_DENOISE:         return denoise;
+    case PARAM_FPS_RANGE:       return fps_range;
+    case PARAM_RECORDING_HINT:  return recording_hint;
+    case PARAM_FRAME_RATE:      return frame_rate;
+    case PARAM_AUTO_EXPOSURE:   return auto_exposure;
+    case PARAM_EXPOSURE_COMP:   return exposure_comp;
+    case PARAM_WHITE_BALANCE:   return white_balance;
+    case PARAM_FLASH:           return flash_mode;
+    case PARAM_FOCUS_MODE:      return focus_mode;
+    case PARAM_BRIGHTNESS:      return brightness;
+    case PARAM_ISO:             return iso_mode;
+    case PARAM_FOCUS_AREAS:     return focus_areas;
+    case PARAM_METERING_AREAS:  return metering_areas;
+    case PARAM_ZONE_AF:         return zone_af;
+    case PARAM_HFR:             return hfr_mode;
+    }
+    return NULL;
+}
+
+/* Keys a setter writes besides the ones it reads, or NULL. */
+const char * const *QualcommCameraHardware::paramOutputs(int id)
+{
+    static const char * const flash_mode[] = { "num-snaps-per-shutter", NULL };
+    static const char * const focus_mode[] = { CameraParameters::KEY_FOCUS_DISTANCES, NULL };
+    static const char * const touch_af_aec[] = { "touch-index-aec", "touch-index-af", NULL };
+
+    switch (id) {
+    case PARAM_FLASH:           return flash_mode;
+    case PARAM_FOCUS_MODE:      return focus_mode;
+    case PARAM_TOUCH_AF_AEC:    return touch_af_aec;
+    }
+    return NULL;
+}
+
+/* Setters whose effect depends on more than their keys: the ZSL switch
+ * other setters read, preview/record geometry that the record size, 3D
+ * and HFR paths rewrite, the capture count the flash resets, the AF state
+ * behind the focus mode and touch AF, the camera mode behind the preview
+ * format, and the HFR restart. These run on every setParameters(). */
+bool QualcommCameraHardware::paramAlwaysApplies(int id)
+{
+    switch (id) {
+    case PARAM_CAMERA_MODE:
+    case PARAM_PREVIEW_SIZE:
+    case PARAM_RECORD_SIZE:
+    case PARAM_PREVIEW_FORMAT:
+    case PARAM_TOUCH_AF_AEC:
+    case PARAM_FLASH:
+    case PARAM_FOCUS_MODE:
+    case PARAM_HFR:
+        return true;
+    }
+    return false;
+}
+
+static void param_signature(String8 &sig, const CameraParameters& params,
+    const char * const *keys)
+{
+    sig.setTo("");
+    if (keys == NULL)
+        return;
+    for (int i = 0; keys[i] != NULL; i++) {
+        const char *value = params.get(keys[i]);
+        /* ';' never appears in a parameter value */
+        sig.append(value != NULL ? value : "\x01");
+        sig.append(";");
+    }
+}
+
+status_t QualcommCameraHardware::applyParam(int id, ParamSetter set,
+    const CameraParameters& params)
+{
+    const char * const *keys = paramKeys(id);
+    const char * const *outputs = paramOutputs(id);
+    String8 wanted, current, written;
+
+    // Also catches a reset from a setter earlier in this same call.
+    if (android_atomic_release_cas(1, 0, &mParamsInvalid) == 0) {
+        for (int i = 0; i < PARAM_SETTER_MAX; i++)
+            mParamSignature[i].setTo("");
+    }
+
+    param_signature(wanted, params, keys);
+    param_signature(current, mParameters, keys);
+    if (wanted == mParamSignature[id] && wanted == current && !paramAlwaysApplies(id)) {
+        mParamsSkipped++;
+        return NO_ERROR;
+    }
+
+    mParamsApplied++;
+    param_signature(written, mParameters, outputs);
+    status_t rc = (this->*set)(params);
+    String8 after, writtenAfter;
+    param_signature(after, mParameters, keys);
+    param_signature(writtenAfter, mParameters, outputs);
+    if (after != current || writtenAfter != written)
+        paramsChanged();
+    if (rc == NO_ERROR)
+        mParamSignature[id] = wanted;
+    else
+        mParamSignature[id].setTo("");
+    return rc;
+}
+
+/* Makes the next setParameters() push every setting again. Safe to call
+ * with or without mParametersLock held. */
+void QualcommCameraHardware::invalidateParams()
+{
+    android_atomic_release_store(1, &mParamsInvalid);
+}
+
 status_t QualcommCameraHardware::setParameters(const CameraParameters& params)
 {
     ALOGV("setParameters: E params = %p", &params);
@@ -4680,71 +6491,72 @@ status_t QualcommCameraHardware::setParameters(const CameraParameters& params)
     Mutex::Autolock pl(&mParametersLock);
     status_t rc, final_rc = NO_ERROR;
     if (mSnapshotThreadRunning) {
-        if ((rc = setCameraMode(params)))  final_rc = rc;
-        if ((rc = setPreviewSize(params)))  final_rc = rc;
-        if ((rc = setRecordSize(params)))  final_rc = rc;
-        if ((rc = setPictureSize(params)))  final_rc = rc;
-        if ((rc = setJpegThumbnailSize(params))) final_rc = rc;
-        if ((rc = setJpegQuality(params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_CAMERA_MODE, &QualcommCameraHardware::setCameraMode, params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_PREVIEW_SIZE, &QualcommCameraHardware::setPreviewSize, params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_RECORD_SIZE, &QualcommCameraHardware::setRecordSize, params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_PICTURE_SIZE, &QualcommCameraHardware::setPictureSize, params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_THUMBNAIL_SIZE, &QualcommCameraHardware::setJpegThumbnailSize, params))) final_rc = rc;
+        if ((rc = applyParam(PARAM_JPEG_QUALITY, &QualcommCameraHardware::setJpegQuality, params)))  final_rc = rc;
         return final_rc;
     }
-    if ((rc = setCameraMode(params)))  final_rc = rc;
-    if ((rc = setPreviewSize(params)))  final_rc = rc;
-    if ((rc = setRecordSize(params)))  final_rc = rc;
-    if ((rc = setPictureSize(params)))  final_rc = rc;
-    if ((rc = setJpegThumbnailSize(params))) final_rc = rc;
-    if ((rc = setJpegQuality(params)))  final_rc = rc;
-    if ((rc = setPictureFormat(params))) final_rc = rc;
-    if ((rc = setPreviewFormat(params)))   final_rc = rc;
-    if ((rc = setEffect(params)))       final_rc = rc;
-    if ((rc = setGpsLocation(params)))  final_rc = rc;
-    if ((rc = setRotation(params)))     final_rc = rc;
-    if ((rc = setZoom(params)))         final_rc = rc;
-    if ((rc = setOrientation(params)))  final_rc = rc;
-    if ((rc = setLensshadeValue(params)))  final_rc = rc;
-    if ((rc = setMCEValue(params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_CAMERA_MODE, &QualcommCameraHardware::setCameraMode, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_PREVIEW_SIZE, &QualcommCameraHardware::setPreviewSize, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_RECORD_SIZE, &QualcommCameraHardware::setRecordSize, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_PICTURE_SIZE, &QualcommCameraHardware::setPictureSize, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_THUMBNAIL_SIZE, &QualcommCameraHardware::setJpegThumbnailSize, params))) final_rc = rc;
+    if ((rc = applyParam(PARAM_JPEG_QUALITY, &QualcommCameraHardware::setJpegQuality, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_PICTURE_FORMAT, &QualcommCameraHardware::setPictureFormat, params))) final_rc = rc;
+    if ((rc = applyParam(PARAM_PREVIEW_FORMAT, &QualcommCameraHardware::setPreviewFormat, params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_PREVIEW_CB_SIZE, &QualcommCameraHardware::setPreviewCallbackSize, params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_EFFECT, &QualcommCameraHardware::setEffect, params)))       final_rc = rc;
+    if ((rc = applyParam(PARAM_GPS, &QualcommCameraHardware::setGpsLocation, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_ROTATION, &QualcommCameraHardware::setRotation, params)))     final_rc = rc;
+    if ((rc = applyParam(PARAM_ZOOM, &QualcommCameraHardware::setZoom, params)))         final_rc = rc;
+    if ((rc = applyParam(PARAM_ORIENTATION, &QualcommCameraHardware::setOrientation, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_LENSSHADE, &QualcommCameraHardware::setLensshadeValue, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_MCE, &QualcommCameraHardware::setMCEValue, params)))  final_rc = rc;
     //if ((rc = setHDRImaging(params)))  final_rc = rc;
+    // Depends on mHdrMode and feeds numCapture; always applied.
     if ((rc = setExpBracketing(params)))  final_rc = rc;
-    if ((rc = setPictureFormat(params))) final_rc = rc;
-    if ((rc = setSharpness(params)))    final_rc = rc;
-    if ((rc = setSaturation(params)))   final_rc = rc;
-    if ((rc = setTouchAfAec(params)))   final_rc = rc;
-    if ((rc = setSceneMode(params)))    final_rc = rc;
-    if ((rc = setContrast(params)))     final_rc = rc;
-    if ((rc = setSceneDetect(params)))  final_rc = rc;
-    if ((rc = setStrTextures(params)))   final_rc = rc;
-    if ((rc = setPreviewFormat(params)))   final_rc = rc;
-    if ((rc = setSkinToneEnhancement(params)))   final_rc = rc;
-    if ((rc = setAntibanding(params)))  final_rc = rc;
-    if ((rc = setRedeyeReduction(params)))  final_rc = rc;
-    if ((rc = setDenoise(params)))  final_rc = rc;
-    if ((rc = setPreviewFpsRange(params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_SHARPNESS, &QualcommCameraHardware::setSharpness, params)))    final_rc = rc;
+    if ((rc = applyParam(PARAM_SATURATION, &QualcommCameraHardware::setSaturation, params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_TOUCH_AF_AEC, &QualcommCameraHardware::setTouchAfAec, params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_SCENE_MODE, &QualcommCameraHardware::setSceneMode, params)))    final_rc = rc;
+    if ((rc = applyParam(PARAM_CONTRAST, &QualcommCameraHardware::setContrast, params)))     final_rc = rc;
+    if ((rc = applyParam(PARAM_SCENE_DETECT, &QualcommCameraHardware::setSceneDetect, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_STR_TEXTURES, &QualcommCameraHardware::setStrTextures, params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_SKIN_TONE, &QualcommCameraHardware::setSkinToneEnhancement, params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_ANTIBANDING, &QualcommCameraHardware::setAntibanding, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_REDEYE, &QualcommCameraHardware::setRedeyeReduction, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_DENOISE, &QualcommCameraHardware::setDenoise, params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_FPS_RANGE, &QualcommCameraHardware::setPreviewFpsRange, params)))  final_rc = rc;
+    // These depend on mZslEnable and numCapture rather than on params alone.
     if ((rc = setZslParam(params)))  final_rc = rc;
     if ((rc = setSnapshotCount(params)))  final_rc = rc;
-    if ((rc = setRecordingHint(params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_RECORDING_HINT, &QualcommCameraHardware::setRecordingHint, params)))   final_rc = rc;
     const char *str = params.get(CameraParameters::KEY_SCENE_MODE);
     int32_t value = attr_lookup(scenemode, sizeof(scenemode) / sizeof(str_map), str);
 
     if ((value != NOT_FOUND) && (value == CAMERA_BESTSHOT_OFF)) {
-        if ((rc = setPreviewFrameRate(params))) final_rc = rc;
+        if ((rc = applyParam(PARAM_FRAME_RATE, &QualcommCameraHardware::setPreviewFrameRate, params))) final_rc = rc;
     //    if ((rc = setPreviewFrameRateMode(params))) final_rc = rc;
-        if ((rc = setAutoExposure(params))) final_rc = rc;
-        if ((rc = setExposureCompensation(params))) final_rc = rc;
-        if ((rc = setWhiteBalance(params))) final_rc = rc;
-        if ((rc = setFlash(params)))        final_rc = rc;
-        if ((rc = setFocusMode(params)))    final_rc = rc;
-        if ((rc = setBrightness(params)))   final_rc = rc;
-        if ((rc = setISOValue(params)))  final_rc = rc;
-        if ((rc = setFocusAreas(params)))  final_rc = rc;
-        if ((rc = setMeteringAreas(params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_AUTO_EXPOSURE, &QualcommCameraHardware::setAutoExposure, params))) final_rc = rc;
+        if ((rc = applyParam(PARAM_EXPOSURE_COMP, &QualcommCameraHardware::setExposureCompensation, params))) final_rc = rc;
+        if ((rc = applyParam(PARAM_WHITE_BALANCE, &QualcommCameraHardware::setWhiteBalance, params))) final_rc = rc;
+        if ((rc = applyParam(PARAM_FLASH, &QualcommCameraHardware::setFlash, params)))        final_rc = rc;
+        if ((rc = applyParam(PARAM_FOCUS_MODE, &QualcommCameraHardware::setFocusMode, params)))    final_rc = rc;
+        if ((rc = applyParam(PARAM_BRIGHTNESS, &QualcommCameraHardware::setBrightness, params)))   final_rc = rc;
+        if ((rc = applyParam(PARAM_ISO, &QualcommCameraHardware::setISOValue, params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_FOCUS_AREAS, &QualcommCameraHardware::setFocusAreas, params)))  final_rc = rc;
+        if ((rc = applyParam(PARAM_METERING_AREAS, &QualcommCameraHardware::setMeteringAreas, params)))  final_rc = rc;
     }
     //selectableZoneAF needs to be invoked after continuous AF
-    if ((rc = setSelectableZoneAf(params)))   final_rc = rc;
+    if ((rc = applyParam(PARAM_ZONE_AF, &QualcommCameraHardware::setSelectableZoneAf, params)))   final_rc = rc;
     // setHighFrameRate needs to be done at end, as there can
     // be a preview restart, and need to use the updated parameters
-    if ((rc = setHighFrameRate(params)))  final_rc = rc;
+    if ((rc = applyParam(PARAM_HFR, &QualcommCameraHardware::setHighFrameRate, params)))  final_rc = rc;
 
-    ALOGV("setParameters: X");
+    ALOGV("setParameters: X applied %d skipped %d", mParamsApplied, mParamsSkipped);
     return final_rc;
 }
 
@@ -4754,68 +6566,164 @@ CameraParameters QualcommCameraHardware::getParameters() const
     return mParameters;
 }
 
+/* Returns a malloc'd copy of the flattened parameters; the caller frees it
+ * (put_parameters). Only re-flattens when mParameters has changed since the
+ * last call.
+ */
+char *QualcommCameraHardware::getParametersString()
+{
+    Mutex::Autolock fl(&mFlatParamsLock);
+    if (android_atomic_acquire_load(&mParamGeneration) != mFlatParamsGeneration) {
+        Mutex::Autolock pl(&mParametersLock);
+        mFlatParamsGeneration = android_atomic_acquire_load(&mParamGeneration);
+        mFlatParams = mParameters.flatten();
+        mFlatParamsBuilt++;
+    } else {
+        mFlatParamsReused++;
+    }
+    return strdup(mFlatParams.string());
+}
+
+/* For keys the HAL derives itself: only bumps the generation when the
+ * stored value actually changes.
+ */
+void QualcommCameraHardware::setParamIfChanged(const char *key, const char *value)
+{
+    const char *cur = mParameters.get(key);
+    if (cur == NULL || strcmp(cur, value)) {
+        mParameters.set(key, value);
+        paramsChanged();
+    }
+}
+
+/* Parses the defaults once, before the first setParameters(); from then
+ * on the setters keep mSettings current as they store each key.
+ */
+void QualcommCameraHardware::loadSettings()
+{
+    Mutex::Autolock sl(&mSettingsLock);
+    Settings& s = mSettings;
+    mParameters.getPictureSize(&s.pictureWidth, &s.pictureHeight);
+    s.thumbnailWidth = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH);
+    s.thumbnailHeight = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT);
+    s.jpegQuality = mParameters.getInt(CameraParameters::KEY_JPEG_QUALITY);
+    s.thumbnailQuality = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY);
+    s.rotation = mParameters.getInt(CameraParameters::KEY_ROTATION);
+    s.zoom = mParameters.getInt(CameraParameters::KEY_ZOOM);
+    s.focalLength = mParameters.getFloat(CameraParameters::KEY_FOCAL_LENGTH);
+    s.rawPicture = attr_lookup(picture_formats, sizeof(picture_formats) / sizeof(str_map),
+        mParameters.getPictureFormat()) == PICTURE_FORMAT_RAW;
+    s.focusMode = attr_lookup(focus_modes, sizeof(focus_modes) / sizeof(str_map),
+        mParameters.get(CameraParameters::KEY_FOCUS_MODE));
+    s.flashMode = attr_lookup(flash, sizeof(flash) / sizeof(str_map),
+        mParameters.get(CameraParameters::KEY_FLASH_MODE));
+    s.isoMode = attr_lookup(iso, sizeof(iso) / sizeof(str_map),
+        mParameters.get(CameraParameters::KEY_ISO_MODE));
+    s.hfrMode = attr_lookup(hfr, sizeof(hfr) / sizeof(str_map),
+        mParameters.get(CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE));
+}
+
+/* Only takes mSettingsLock, so it is safe to call from inside a setter
+ * or with mLock held.
+ */
+QualcommCameraHardware::Settings QualcommCameraHardware::settings()
+{
+    Mutex::Autolock sl(&mSettingsLock);
+    return mSettings;
+}
+
 status_t QualcommCameraHardware::setHistogramOn()
 {
     ALOGV("setHistogramOn: EX");
-    mStatsWaitLock.lock();
-    mSendData = true;
-    if (mStatsOn == CAMERA_HISTOGRAM_ENABLE) {
-        mStatsWaitLock.unlock();
+    Mutex::Autolock l(&mStatsWaitLock);
+    android_atomic_release_store(1, &mStatsRequested);
+    if (android_atomic_acquire_load(&mStatsOn) == CAMERA_HISTOGRAM_ENABLE)
         return NO_ERROR;
-    }
 
-    mStatSize = sizeof(uint32_t) * HISTOGRAM_STATS_SIZE;
-    mCurrent = -1;
-    /*Currently the Ashmem is multiplying the buffer size with total number
-    of buffers and page aligning. This causes a crash in JNI as each buffer
-    individually expected to be page aligned  */
-    int page_size_minus_1 = getpagesize() - 1;
-    int32_t mAlignedStatSize = ((mStatSize + page_size_minus_1) & (~page_size_minus_1));
-    for (int cnt = 0; cnt < 3; cnt++) {
-        mStatsMapped[cnt] = mGetMemory(-1, mStatSize, 1, mCallbackCookie);
-        if (mStatsMapped[cnt] == NULL) {
-            ALOGE("Failed to get camera memory for stats heap index: %d", cnt);
-            mStatsWaitLock.unlock();
-            return false;
-        } else {
-            ALOGV("Received following info for stats mapped data:%p,handle:%p, size:%d,release:%p",
-            mStatsMapped[cnt]->data ,mStatsMapped[cnt]->handle, mStatsMapped[cnt]->size, mStatsMapped[cnt]->release);
+    /* The slots outlive histogram on/off; they go in release(). */
+    if (mStatsMapped[0] == NULL) {
+        mStatSize = sizeof(uint32_t) * HISTOGRAM_STATS_SIZE;
+        /* Each buffer is mapped on its own: one ashmem region split three
+         * ways is not page aligned per buffer, which JNI trips over. */
+        for (int cnt = 0; cnt < 3; cnt++) {
+            mStatsMapped[cnt] = mGetMemory(-1, mStatSize, 1, mCallbackCookie);
+            if (mStatsMapped[cnt] == NULL) {
+                ALOGE("Failed to get camera memory for stats heap index: %d", cnt);
+                releaseStatsBuffers();
+                return NO_MEMORY;
+            }
         }
     }
-    mStatsOn = CAMERA_HISTOGRAM_ENABLE;
-    mStatsWaitLock.unlock();
-    mCfgControl.mm_camera_set_parm(CAMERA_PARM_HISTOGRAM, &mStatsOn);
+    mStatsBuffer.reset();
+
+    if (!mStatsSoftware &&
+        !mCfgControl.mm_camera_is_supported(CAMERA_PARM_HISTOGRAM)) {
+        ALOGI("setHistogramOn: no VFE histogram, using preview frames");
+        mStatsSoftware = true;
+    }
+    android_atomic_release_store(CAMERA_HISTOGRAM_ENABLE, &mStatsOn);
+    if (!mStatsSoftware) {
+        int on = CAMERA_HISTOGRAM_ENABLE;
+        mCfgControl.mm_camera_set_parm(CAMERA_PARM_HISTOGRAM, &on);
+    }
     return NO_ERROR;
 }
 
 status_t QualcommCameraHardware::setHistogramOff()
 {
     ALOGV("setHistogramOff: EX");
-    mStatsWaitLock.lock();
-    if (mStatsOn == CAMERA_HISTOGRAM_DISABLE) {
-        mStatsWaitLock.unlock();
+    Mutex::Autolock l(&mStatsWaitLock);
+    if (android_atomic_acquire_load(&mStatsOn) == CAMERA_HISTOGRAM_DISABLE)
         return NO_ERROR;
+    android_atomic_release_store(CAMERA_HISTOGRAM_DISABLE, &mStatsOn);
+    if (!mStatsSoftware) {
+        int off = CAMERA_HISTOGRAM_DISABLE;
+        mCfgControl.mm_camera_set_parm(CAMERA_PARM_HISTOGRAM, &off);
     }
-    mStatsOn = CAMERA_HISTOGRAM_DISABLE;
-    mStatsWaitLock.unlock();
-
-    mCfgControl.mm_camera_set_parm(CAMERA_PARM_HISTOGRAM, &mStatsOn);
+    return NO_ERROR;
+}
 
-    mStatsWaitLock.lock();
+/* Only once no producer can run: the driver is gone or never started. */
+void QualcommCameraHardware::releaseStatsBuffers()
+{
+    android_atomic_release_store(CAMERA_HISTOGRAM_DISABLE, &mStatsOn);
     for (int i = 0; i < 3; i++) {
         if (mStatsMapped[i] != NULL) {
             mStatsMapped[i]->release(mStatsMapped[i]);
             mStatsMapped[i] = NULL;
         }
     }
-
-    mStatsWaitLock.unlock();
-    return NO_ERROR;
 }
 
-status_t QualcommCameraHardware::runFaceDetection()
+/* CAMERA_CMD_START/STOP_FACE_DETECTION: results are sent as
+ * CAMERA_MSG_PREVIEW_METADATA until stopped, or until preview stops when
+ * the software detector is in use. */
+status_t QualcommCameraHardware::runFaceDetection(bool start)
 {
-    return BAD_VALUE;
+    if (start) {
+        if (!mCameraRunning) {
+            ALOGE("%s: preview is not running", __FUNCTION__);
+            return INVALID_OPERATION;
+        }
+        // The callback needs a data buffer even though only the metadata
+        // is used.
+        if (mFaceMetaMem == NULL) {
+            mFaceMetaMem = mGetMemory(-1, 1, 1, mCallbackCookie);
+            if (mFaceMetaMem == NULL || mFaceMetaMem->data == NULL) {
+                ALOGE("%s: mGetMemory failed", __FUNCTION__);
+                if (mFaceMetaMem != NULL)
+                    mFaceMetaMem->release(mFaceMetaMem);
+                mFaceMetaMem = NULL;
+                return NO_MEMORY;
+            }
+        }
+    }
+    Mutex::Autolock l(&mMetaDataWaitLock);
+    mFaceDetectOn = start;
+    mFaceFrameCount = 0;
+    mFacesLast = 0;
+    mNextFaceId = 1;
+    return NO_ERROR;
 }
 
 void *smoothzoom_thread(void *user)
@@ -4847,79 +6755,156 @@ status_t QualcommCameraHardware::sendCommand(int32_t command, int32_t arg1,
         ALOGV("histogram set to off");
         return setHistogramOff();
     case CAMERA_CMD_HISTOGRAM_SEND_DATA:
-        mStatsWaitLock.lock();
-        if (mStatsOn == CAMERA_HISTOGRAM_ENABLE)
-            mSendData = true;
-        mStatsWaitLock.unlock();
+        if (android_atomic_acquire_load(&mStatsOn) == CAMERA_HISTOGRAM_ENABLE)
+            android_atomic_release_store(1, &mStatsRequested);
         return NO_ERROR;
+    case CAMERA_CMD_START_FACE_DETECTION:
+        return runFaceDetection(true);
+    case CAMERA_CMD_STOP_FACE_DETECTION:
+        return runFaceDetection(false);
+    case CAMERA_CMD_START_SMOOTH_ZOOM:
+        return startSmoothZoom(arg1);
+    case CAMERA_CMD_STOP_SMOOTH_ZOOM:
+        return stopSmoothZoom();
     case CAMERA_CMD_ENABLE_FOCUS_MOVE_MSG: /* Stub this for now. */
         return NO_ERROR;
    }
    return BAD_VALUE;
 }
 
-void QualcommCameraHardware::runSmoothzoomThread(void *data) {
+bool QualcommCameraHardware::supportsSmoothZoom()
+{
+    return zoomSupported && mMaxZoom > 1 && mSmoothZoomRangeMs > 0;
+}
 
-    ALOGV("runSmoothzoomThread: Current zoom %d - "
-          "Target %d", mParameters.getInt(CameraParameters::KEY_ZOOM), mTargetSmoothZoom);
-    int current_zoom = mParameters.getInt(CameraParameters::KEY_ZOOM);
-    int step = (current_zoom > mTargetSmoothZoom)? -1: 1;
+/* CAMERA_CMD_START_SMOOTH_ZOOM. While a zoom is running this only leaves
+ * a new target for the worker; back-to-back calls collapse into one. */
+status_t QualcommCameraHardware::startSmoothZoom(int level)
+{
+    if (!supportsSmoothZoom())
+        return INVALID_OPERATION;
+    if (level < 0 || level > mMaxZoom - 1) {
+        ALOGE("%s: zoom %d out of range 0-%d", __FUNCTION__, level, mMaxZoom - 1);
+        return BAD_VALUE;
+    }
+    if (!mCameraRunning) {
+        ALOGE("%s: preview is not running", __FUNCTION__);
+        return INVALID_OPERATION;
+    }
 
-    if (current_zoom == mTargetSmoothZoom) {
-        ALOGV("Smoothzoom target zoom value is same as "
-             "current zoom value, return...");
-        if (!mPreviewStopping)
-            mNotifyCallback(CAMERA_MSG_ZOOM,
-                current_zoom, 1, mCallbackCookie);
-        else
-            ALOGV("Not issuing callback since preview is stopping");
-        return;
+    Mutex::Autolock l(&mSmoothzoomThreadWaitLock);
+    if (mSmoothZoomPending != -1)
+        mSmoothZoomCoalesced++;
+    mSmoothZoomPending = level;
+    // A worker told to exit by stopPreview may still be winding down;
+    // it simply carries on with the new target.
+    mSmoothzoomThreadExit = false;
+    if (mSmoothzoomThreadRunning) {
+        mSmoothzoomThreadWait.signal();
+        return NO_ERROR;
+    }
+    mSmoothZoomLevel = settings().zoom;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    mSmoothzoomThreadRunning = !pthread_create(&mSmoothzoomThread,
+                                      &attr,
+                                      smoothzoom_thread,
+                                      (void*)NULL);
+    if (!mSmoothzoomThreadRunning) {
+        mSmoothZoomPending = -1;
+        return UNKNOWN_ERROR;
     }
+    return NO_ERROR;
+}
 
-    CameraParameters p = getParameters();
+/* CAMERA_CMD_STOP_SMOOTH_ZOOM: the worker stops at the level it has
+ * reached and reports it with the stopped flag set. */
+status_t QualcommCameraHardware::stopSmoothZoom()
+{
+    Mutex::Autolock l(&mSmoothzoomThreadWaitLock);
+    if (mSmoothzoomThreadRunning) {
+        mSmoothZoomPending = kSmoothZoomStop;
+        mSmoothzoomThreadWait.signal();
+    }
+    return NO_ERROR;
+}
 
-    mSmoothzoomThreadWaitLock.lock();
-    mSmoothzoomThreadRunning = true;
-    mSmoothzoomThreadWaitLock.unlock();
+/* One smooth zoom step: just the VFE zoom and KEY_ZOOM, none of the rest
+ * of setParameters(). */
+bool QualcommCameraHardware::setZoomLevel(int level)
+{
+    int32_t zoom_value = level;
+    if (!native_set_parms(CAMERA_PARM_ZOOM, sizeof(zoom_value), &zoom_value))
+        return false;
+    Mutex::Autolock pl(&mParametersLock);
+    mParameters.set(CameraParameters::KEY_ZOOM, level);
+    paramsChanged();
+    Mutex::Autolock sl(&mSettingsLock);
+    mSettings.zoom = level;
+    return true;
+}
 
-    int i = current_zoom;
-    while (true) {  // Thread loop
-        mSmoothzoomThreadLock.lock();
-        if (mSmoothzoomThreadExit) {
-            ALOGV("Exiting smoothzoom thread, as stop smoothzoom called");
-            mSmoothzoomThreadLock.unlock();
-            break;
-        }
-        mSmoothzoomThreadLock.unlock();
+void QualcommCameraHardware::runSmoothzoomThread(void *data)
+{
+    nsecs_t perLevel = (nsecs_t)mSmoothZoomRangeMs * 1000000LL / (mMaxZoom - 1);
+    nsecs_t start = 0, lastStep = 0;
+    int from = 0;
 
-        if ((i < 0) || (i > mMaxZoom)) {
-            ALOGE(" ERROR : beyond supported zoom values, break..");
-            break;
-        }
-        // update zoom
-        p.set(CameraParameters::KEY_ZOOM, i);
-        setZoom(p);
-        if (!mPreviewStopping) {
-            // give call back to zoom listener in app
-            mNotifyCallback(CAMERA_MSG_ZOOM, i, (mTargetSmoothZoom-i == 0)?1:0,
-                    mCallbackCookie);
-        } else {
-            ALOGV("Preview is stopping. Breaking out of smooth zoom loop");
-            break;
+    mSmoothzoomThreadWaitLock.lock();
+    while (!mSmoothzoomThreadExit) {
+        nsecs_t now = systemTime();
+        if (mSmoothZoomPending != -1) {
+            // (Re)start the ramp from the level already reached.
+            if (mSmoothZoomPending == kSmoothZoomStop)
+                mTargetSmoothZoom = mSmoothZoomLevel;
+            else
+                mTargetSmoothZoom = mSmoothZoomPending;
+            if (start != 0)
+                mSmoothZoomRetargets++;
+            mSmoothZoomPending = -1;
+            from = mSmoothZoomLevel;
+            start = now;
+        }
+        int level = mSmoothZoomLevel;
+        int target = mTargetSmoothZoom;
+        int moved = perLevel > 0 ? (int)((now - start) / perLevel) : abs(target - from);
+        if (moved > abs(target - from))
+            moved = abs(target - from);
+        int next = target > from ? from + moved : from - moved;
+
+        if (level != target && (next == level || now - lastStep < kSmoothZoomMinStep)) {
+            // Sleep until the next level is due, unless retargeted.
+            nsecs_t due = start + (nsecs_t)(abs(level - from) + 1) * perLevel;
+            if (due < lastStep + kSmoothZoomMinStep)
+                due = lastStep + kSmoothZoomMinStep;
+            mSmoothzoomThreadWait.waitRelative(mSmoothzoomThreadWaitLock, due - now);
+            continue;
         }
-        if (i == mTargetSmoothZoom)
-            break;
 
-        i+=step;
-
-        /* wait on singal, which will be signalled on
-         * receiving next preview frame */
+        mSmoothzoomThreadWaitLock.unlock();
+        bool ok = next == level || setZoomLevel(next);
         mSmoothzoomThreadWaitLock.lock();
-        mSmoothzoomThreadWait.wait(mSmoothzoomThreadWaitLock);
+        if (!ok) {
+            ALOGE("%s: setting zoom %d failed, stopping at %d", __FUNCTION__, next, level);
+            next = level;
+            mTargetSmoothZoom = level;
+        } else if (next != level) {
+            mSmoothZoomSteps++;
+        }
+        mSmoothZoomLevel = next;
+        lastStep = systemTime();
+        // A retarget that came in meanwhile keeps the zoom going.
+        bool done = next == mTargetSmoothZoom && mSmoothZoomPending == -1;
+        if (mSmoothzoomThreadExit || mPreviewStopping)
+            break;
         mSmoothzoomThreadWaitLock.unlock();
-    } // while loop over, exiting thread
-
-    mSmoothzoomThreadWaitLock.lock();
+        mNotifyCallback(CAMERA_MSG_ZOOM, next, done ? 1 : 0, mCallbackCookie);
+        mSmoothzoomThreadWaitLock.lock();
+        if (done && mSmoothZoomPending == -1)
+            break;
+    }
+    mSmoothZoomPending = -1;
     mSmoothzoomThreadRunning = false;
     mSmoothzoomThreadWaitLock.unlock();
     ALOGV("Exiting Smooth Zoom Thread");
@@ -4979,9 +6964,24 @@ QualcommCameraHardware *QualcommCameraHardware::getInstance()
 void QualcommCameraHardware::receiveRecordingFrame(struct msm_frame *frame)
 {
     ALOGV("receiveRecordingFrame E");
+    int index = frame ? mapvideoBuffer(frame) : -1;
+    // The slot leaves the driver before returns are looked for: the
+    // encoder only defers a return while it sees a slot with the driver.
+    if (index >= 0)
+        android_atomic_release_store(SLOT_HAL, &mRecordSlotOwner[index]);
+    android_memory_barrier();
+    // Frames the encoder gave back while the return path was busy.
+    if (android_atomic_acquire_load(&mRecordReturned))
+        returnRecordFrames();
     // post busy frame
     if (frame) {
-        cam_frame_post_video(frame);
+        android_atomic_inc(&mRecordFramesReceived);
+        if (!mVideoBusyQueue.post(frame)) {
+            android_atomic_inc(&mRecordFramesDropped);
+            if (index >= 0)
+                mRecordSlotOwner[index] = SLOT_DRIVER;
+            LINK_camframe_add_frame(CAM_VIDEO_FRAME, frame);
+        }
     }
     else
         ALOGE("in receiveRecordingFrame frame is NULL");
@@ -5010,17 +7010,37 @@ void QualcommCameraHardware::receiveLiveSnapshot(uint32_t jpeg_size)
 
 void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
 {
+    nsecs_t received = systemTime();
+
     ALOGV("receivePreviewFrame E");
+    android_atomic_inc(&mPreviewFramesReceived);
     if (!mCameraRunning) {
         ALOGE("ignoring preview callback--camera has been stopped");
+        android_atomic_inc(&mPreviewDrops[PREVIEW_DROP_STOPPED]);
         LINK_camframe_add_frame(CAM_PREVIEW_FRAME,frame);
         return;
     }
     if (mCurrentTarget == TARGET_MSM7627A && liveshot_state == LIVESHOT_IN_PROGRESS) {
         LINK_set_liveshot_frame(frame);
     }
-    if (mPreviewBusyQueue.add(frame) == false)
+
+    /* Stamp before queueing: the preview thread may pick the frame up
+     * as soon as it is added. */
+    int slot = mapBuffer(frame);
+    nsecs_t queued = systemTime();
+    if (slot >= 0 && slot < kTotalPreviewBufferCount) {
+        mPreviewReceivedAt[slot] = received;
+        mPreviewQueuedAt[slot] = queued;
+        mPreviewSlotOwner[slot] = SLOT_HAL;
+    }
+    if (mPreviewBusyQueue.add(frame) == false) {
+        android_atomic_inc(&mPreviewDrops[PREVIEW_DROP_QUEUE]);
+        if (slot >= 0 && slot < kTotalPreviewBufferCount)
+            mPreviewSlotOwner[slot] = SLOT_DRIVER;
         LINK_camframe_add_frame(CAM_PREVIEW_FRAME, frame);
+    } else {
+        mPreviewLatency[PREVIEW_STAGE_RECEIVE].record(queued - received);
+    }
     ALOGV("receivePreviewFrame X");
 }
 
@@ -5030,32 +7050,54 @@ void QualcommCameraHardware::receiveCameraStats(camstats_type stype, camera_prev
         ALOGE("ignoring stats callback--camera has been stopped");
         return;
     }
+    if (android_atomic_acquire_load(&mStatsOn) == CAMERA_HISTOGRAM_DISABLE || mStatsSoftware)
+        return;
+
+    uint32_t *out = (uint32_t *)mStatsMapped[mStatsBuffer.back()]->data;
+    out[0] = histinfo->max_value;
+    memcpy(out + 1, histinfo->buffer, sizeof(uint32_t) * 256);
+    publishStats();
+    ALOGV("receiveCameraStats X");
+}
+
+/* Publishes the back slot, and hands the newest histogram to the app if
+ * it asked for one. */
+void QualcommCameraHardware::publishStats()
+{
+    if (mStatsBuffer.publish())
+        android_atomic_inc(&mStatsOverwritten);
+    android_atomic_inc(&mStatsPublished);
+    if (android_atomic_release_cas(1, 0, &mStatsRequested) != 0)
+        return;
 
     mCallbackLock.lock();
     int msgEnabled = mMsgEnabled;
     camera_data_callback scb = mDataCallback;
     void *sdata = mCallbackCookie;
     mCallbackLock.unlock();
-    mStatsWaitLock.lock();
-    if (mStatsOn == CAMERA_HISTOGRAM_DISABLE) {
-        mStatsWaitLock.unlock();
+
+    int slot = mStatsBuffer.acquire();
+    if (slot < 0 || scb == NULL || !(msgEnabled & CAMERA_MSG_STATS_DATA)) {
+        android_atomic_release_store(1, &mStatsRequested);
         return;
     }
-    if (!mSendData) {
-        mStatsWaitLock.unlock();
-    } else {
-        mSendData = false;
-        mCurrent = (mCurrent+1)%3;
-        *(uint32_t *)((unsigned int)(mStatsMapped[mCurrent]->data)) = histinfo->max_value;
-        memcpy((uint32_t *)((unsigned int)mStatsMapped[mCurrent]->data + sizeof(int32_t)), (uint32_t *)histinfo->buffer,(sizeof(int32_t) * 256));
-
-        mStatsWaitLock.unlock();
+    android_atomic_inc(&mStatsDelivered);
+    scb(CAMERA_MSG_STATS_DATA, mStatsMapped[slot], data_counter, NULL, sdata);
+}
 
-        if (scb != NULL && (msgEnabled & CAMERA_MSG_STATS_DATA))
-            scb(CAMERA_MSG_STATS_DATA, mStatsMapped[mCurrent], data_counter, NULL,sdata);
+/* Software stand-in for the VFE histogram, from a preview frame's Y plane
+ * subsampled 2x each way. Only runs when the app is waiting for one. */
+void QualcommCameraHardware::computeSoftwareStats(int slot)
+{
+    if (!mStatsSoftware || mPreviewFormat != CAMERA_YUV_420_NV21 ||
+        android_atomic_acquire_load(&mStatsOn) == CAMERA_HISTOGRAM_DISABLE ||
+        android_atomic_acquire_load(&mStatsRequested) == 0)
+        return;
 
-    }
-    ALOGV("receiveCameraStats X");
+    uint32_t *out = (uint32_t *)mStatsMapped[mStatsBuffer.back()]->data;
+    out[0] = nv21_luma_histogram((const uint8_t *)frames[slot].buffer,
+        previewWidth, previewHeight, previewWidth, 2, out + 1);
+    publishStats();
 }
 
 bool QualcommCameraHardware::initRecord()
@@ -5087,8 +7129,8 @@ bool QualcommCameraHardware::initRecord()
      */
     mRecordFrameSize = PAD_TO_4K(recordBufferSize);
     bool dis_disable = 0;
-    const char *str = mParameters.get(CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE);
-    if ((str != NULL) && (strcmp(str, CameraParameters::VIDEO_HFR_OFF))) {
+    int hfrMode = settings().hfrMode;
+    if (hfrMode != NOT_FOUND && hfrMode != CAMERA_HFR_MODE_OFF) {
         ALOGI("%s: HFR is ON, DIS has to be OFF", __FUNCTION__);
         dis_disable = 1;
     }
@@ -5101,13 +7143,20 @@ bool QualcommCameraHardware::initRecord()
     }
     ALOGV("mRecordFrameSize = %d", mRecordFrameSize);
 
+    mRecordIndex.clear();
     for (int cnt = 0; cnt < kRecordBufferCount; cnt++) {
 #ifdef USE_ION
         int ion_heap = ION_CP_MM_HEAP_ID;
         if (allocate_ion_memory(&record_main_ion_fd[cnt], &record_alloc[cnt], &record_ion_info_fd[cnt],
                 ion_heap, mRecordFrameSize, &mRecordfd[cnt]) < 0) {
-            ALOGE("%s: allocate ion memory failed!\n", __func__);
-            return NULL;
+            /* Short on memory: the idle snapshot pool goes first. */
+            ALOGI("%s: evicting snapshot pool", __func__);
+            releaseSnapshotPool();
+            if (allocate_ion_memory(&record_main_ion_fd[cnt], &record_alloc[cnt], &record_ion_info_fd[cnt],
+                    ion_heap, mRecordFrameSize, &mRecordfd[cnt]) < 0) {
+                ALOGE("%s: allocate ion memory failed!\n", __func__);
+                return NULL;
+            }
         }
 #else
         const char *pmem_region;
@@ -5131,6 +7180,7 @@ bool QualcommCameraHardware::initRecord()
             mRecordMapped[cnt]->data ,mRecordMapped[cnt]->handle, mRecordMapped[cnt]->size, mRecordMapped[cnt]->release);
         }
         recordframes[cnt].buffer = (unsigned int)mRecordMapped[cnt]->data;
+        mRecordIndex.add((const void *)recordframes[cnt].buffer, cnt);
         recordframes[cnt].fd = mRecordfd[cnt];
         recordframes[cnt].y_off = 0;
         recordframes[cnt].cbcr_off = CbCrOffset;
@@ -5158,7 +7208,7 @@ bool QualcommCameraHardware::initRecord()
 
     // initial setup : buffers 1,2,3 with kernel , 4 with camframe , 5,6,7,8 in free Q
     // flush the busy Q
-    cam_frame_flush_video();
+    mVideoBusyQueue.flush();
 
     mVideoThreadWaitLock.lock();
     while (mVideoThreadRunning) {
@@ -5197,8 +7247,8 @@ status_t QualcommCameraHardware::setDIS()
         video_frame_cbcroffset = PAD_TO_2K(videoWidth * videoHeight);
 
     disCtrl.dis_enable = mDisEnabled;
-    const char *str = mParameters.get(CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE);
-    if (str != NULL && strcmp(str, CameraParameters::VIDEO_HFR_OFF)) {
+    int hfrMode = settings().hfrMode;
+    if (hfrMode != NOT_FOUND && hfrMode != CAMERA_HFR_MODE_OFF) {
         ALOGI("%s: HFR is ON, setting DIS as OFF", __FUNCTION__);
         disCtrl.dis_enable = 0;
     }
@@ -5255,7 +7305,8 @@ status_t QualcommCameraHardware::startRecording()
             for (int cnt = 0; cnt < kRecordBufferCount; cnt++) {
                 if (mStoreMetaDataInFrame) {
                     ALOGE("startRecording : meta data mode enabled");
-                    metadata_memory[cnt] = mGetMemory(-1, sizeof(struct encoder_media_buffer_type), 1, mCallbackCookie);
+                    metadata_memory[cnt] = mGetMemory(-1, sizeof(struct encoder_media_buffer_type) +
+                        sizeof(struct record_slot_tag), 1, mCallbackCookie);
                     struct encoder_media_buffer_type * packet =
                         (struct encoder_media_buffer_type  *)metadata_memory[cnt]->data;
                     packet->meta_handle = native_handle_create(1, 2); //1 fd, 1 offset and 1 size
@@ -5264,6 +7315,9 @@ status_t QualcommCameraHardware::startRecording()
                     nh->data[0] = mRecordfd[cnt];
                     nh->data[1] = 0;
                     nh->data[2] = mRecordFrameSize;
+                    struct record_slot_tag *tag = (struct record_slot_tag *)(packet + 1);
+                    tag->magic = RECORD_SLOT_MAGIC;
+                    tag->slot = cnt;
                 }
             }
             ALOGV(" in startREcording : calling start_recording");
@@ -5272,13 +7326,14 @@ status_t QualcommCameraHardware::startRecording()
             // Remove the left out frames in busy Q and them in free Q.
             // this should be done before starting video_thread so that,
             // frames in previous recording are flushed out.
-            ALOGV("frames in busy Q = %d", g_busy_frame_queue.num_of_frames);
-            while (g_busy_frame_queue.num_of_frames > 0) {
-                msm_frame *vframe = cam_frame_get_video();
+            ALOGV("frames in busy Q = %d", mVideoBusyQueue.count());
+            msm_frame *vframe;
+            while ((vframe = mVideoBusyQueue.get()) != NULL) {
                 LINK_camframe_add_frame(CAM_VIDEO_FRAME, vframe);
             }
-            ALOGV("frames in busy Q = %d after deQueing", g_busy_frame_queue.num_of_frames);
+            ALOGV("frames in busy Q = %d after deQueing", mVideoBusyQueue.count());
             //Clear the dangling buffers and put them in free queue
+            android_atomic_and(0, &mRecordReturned);
             for (int cnt = 0; cnt < kRecordBufferCount; cnt++) {
                 if (record_buffers_tracking_flag[cnt] == true) {
                     ALOGI("Dangling buffer: offset = %d, buffer = %d", cnt,
@@ -5286,9 +7341,17 @@ status_t QualcommCameraHardware::startRecording()
                     LINK_camframe_add_frame(CAM_VIDEO_FRAME,&recordframes[cnt]);
                     record_buffers_tracking_flag[cnt] = false;
                 }
+                mRecordSlotOwner[cnt] = SLOT_DRIVER;
             }
+            android_atomic_release_store(0, &mRecordFramesReceived);
+            android_atomic_release_store(0, &mRecordFramesDropped);
+            android_atomic_release_store(0, &mRecordReturns);
+            android_atomic_release_store(0, &mRecordReturnsDeferred);
+            mVideoBatches = 0;
+            mVideoBatchMax = 0;
+            mRecordStartTime = systemTime();
+            mVideoBusyQueue.resetExit();
             mVideoThreadWaitLock.lock();
-            mVideoThreadExit = 0;
             pthread_attr_t attr;
             pthread_attr_init(&attr);
             pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -5349,14 +7412,15 @@ status_t QualcommCameraHardware::startRecordingInternal()
         // Remove the left out frames in busy Q and them in free Q.
         // this should be done before starting video_thread so that,
         // frames in previous recording are flushed out.
-        ALOGV("frames in busy Q = %d", g_busy_frame_queue.num_of_frames);
-        while (g_busy_frame_queue.num_of_frames > 0) {
-            msm_frame *vframe = cam_frame_get_video();
+        ALOGV("frames in busy Q = %d", mVideoBusyQueue.count());
+        msm_frame *vframe;
+        while ((vframe = mVideoBusyQueue.get()) != NULL) {
             LINK_camframe_add_frame(CAM_VIDEO_FRAME, vframe);
         }
-        ALOGV("frames in busy Q = %d after deQueing", g_busy_frame_queue.num_of_frames);
+        ALOGV("frames in busy Q = %d after deQueing", mVideoBusyQueue.count());
 
         //Clear the dangling buffers and put them in free queue
+        android_atomic_and(0, &mRecordReturned);
         for (int cnt = 0; cnt < kRecordBufferCount; cnt++) {
             if (record_buffers_tracking_flag[cnt] == true) {
                 ALOGI("Dangling buffer: offset = %d, buffer = %d", cnt, (unsigned int)recordframes[cnt].buffer);
@@ -5371,8 +7435,8 @@ status_t QualcommCameraHardware::startRecordingInternal()
 
         // Start video thread and wait for busy frames to be encoded, this thread
         // should be closed in stopRecording
+        mVideoBusyQueue.resetExit();
         mVideoThreadWaitLock.lock();
-        mVideoThreadExit = 0;
         pthread_attr_t attr;
         pthread_attr_init(&attr);
         pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -5425,14 +7489,9 @@ void QualcommCameraHardware::stopRecording()
             return;
         }
 
-        mVideoThreadWaitLock.lock();
-        mVideoThreadExit = 1;
-        mVideoThreadWaitLock.unlock();
+        mVideoBusyQueue.requestExit();
         native_stop_ops(CAMERA_OPS_VIDEO_RECORDING, NULL);
 
-        pthread_mutex_lock(&(g_busy_frame_queue.mut));
-        pthread_cond_signal(&(g_busy_frame_queue.wait));
-        pthread_mutex_unlock(&(g_busy_frame_queue.mut));
         for (int cnt = 0; cnt < kRecordBufferCount; cnt++) {
             if (mStoreMetaDataInFrame && (metadata_memory[cnt] != NULL)) {
                 struct encoder_media_buffer_type * packet =
@@ -5454,58 +7513,84 @@ void QualcommCameraHardware::stopRecording()
         }
     }
     mRecordingState = 0; // recording not started
+#ifdef USE_ION
+    ion_cache_trim(0);
+#endif
     ALOGV("stopRecording: X");
 }
 
+/* Hands the record frames the encoder released back to the driver. Runs
+ * on the frame thread, or with mFrameThreadWaitLock held while it runs. */
+void QualcommCameraHardware::returnRecordFrames()
+{
+    int32_t pending = android_atomic_and(0, &mRecordReturned);
+    for (int cnt = 0; pending != 0; cnt++, pending >>= 1) {
+        if (!(pending & 1))
+            continue;
+        //Reset the track flag for this frame buffer
+        record_buffers_tracking_flag[cnt] = false;
+        mRecordSlotOwner[cnt] = SLOT_DRIVER;
+        LINK_camframe_add_frame(CAM_VIDEO_FRAME, &recordframes[cnt]);
+    }
+}
+
+/* Called from the encoder's thread once per frame. On 7x30 class targets
+ * the slot is posted to mRecordReturned and handed to the driver here if
+ * the frame thread lock is free, otherwise by the frame thread with its
+ * next frame. There is no next frame when the driver holds no record
+ * buffers, so in that case this waits for the lock, which is only ever
+ * held briefly. */
 void QualcommCameraHardware::releaseRecordingFrame(const void *opaque)
 {
-    ALOGE("%s : BEGIN, opaque = 0x%p",__func__, opaque);
-    Mutex::Autolock rLock(&mRecordFrameLock);
-    mReleasedRecordingFrame = true;
-    mRecordWait.signal();
+    if (mCurrentTarget != TARGET_MSM7630 &&
+        mCurrentTarget != TARGET_QSD8250 &&
+        mCurrentTarget != TARGET_MSM8660) {
+        // The preview thread waits for each frame to come back.
+        lockCounted(mRecordFrameLock, LOCK_RECORD_FRAME);
+        mReleasedRecordingFrame = true;
+        mRecordWait.signal();
+        mRecordFrameLock.unlock();
+        return;
+    }
 
-    // Ff 7x30 : add the frame to the free camframe queue
-    if (mCurrentTarget == TARGET_MSM7630 ||
-        mCurrentTarget == TARGET_QSD8250 ||
-        mCurrentTarget == TARGET_MSM8660) {
-        ssize_t offset;
-        size_t size;
-        msm_frame *releaseframe = NULL;
-        int cnt;
-        for (cnt = 0; cnt < kRecordBufferCount; cnt++) {
-            if (mStoreMetaDataInFrame) {
-                if (metadata_memory[cnt] && metadata_memory[cnt]->data == opaque) {
-                    ALOGV("in release recording frame(meta) found match , releasing buffer %d", (unsigned int)recordframes[cnt].buffer);
-                    releaseframe = &recordframes[cnt];
-                    break;
-                }
-            } else {
-                if (recordframes[cnt].buffer && ((unsigned long)opaque == recordframes[cnt].buffer) ) {
-                    ALOGV("in release recording frame found match , releasing buffer %d", (unsigned int)recordframes[cnt].buffer);
-                    releaseframe = &recordframes[cnt];
-                    break;
-                }
-            }
-        }
-        if (cnt < kRecordBufferCount) {
-            // do this only if frame thread is running
-            mFrameThreadWaitLock.lock();
-            if (mFrameThreadRunning) {
-                //Reset the track flag for this frame buffer
-                record_buffers_tracking_flag[cnt] = false;
-                LINK_camframe_add_frame(CAM_VIDEO_FRAME,releaseframe);
-            }
+    int cnt = -1;
+    if (mStoreMetaDataInFrame) {
+        const struct record_slot_tag *tag = (const struct record_slot_tag *)
+            ((const struct encoder_media_buffer_type *)opaque + 1);
+        if (tag->magic == RECORD_SLOT_MAGIC && tag->slot >= 0 && tag->slot < kRecordBufferCount &&
+            metadata_memory[tag->slot] != NULL && metadata_memory[tag->slot]->data == opaque)
+            cnt = tag->slot;
+    } else {
+        cnt = mRecordIndex.lookup(opaque);
+    }
+    if (cnt < 0 || cnt >= kRecordBufferCount) {
+        ALOGE("%s: unknown buffer %p", __FUNCTION__, opaque);
+        return;
+    }
 
-            mFrameThreadWaitLock.unlock();
-        } else {
-            ALOGE("in release recordingframe XXXXX error , buffer not found");
-            for (int i = 0; i < kRecordBufferCount; i++) {
-                ALOGE(" recordframes[%d].buffer = %d", i, (unsigned int)recordframes[i].buffer);
-            }
+    android_atomic_or(1 << cnt, &mRecordReturned);
+    android_atomic_inc(&mRecordReturns);
+
+    android_atomic_inc(&mLockAcquired[LOCK_FRAME_THREAD]);
+    if (mFrameThreadWaitLock.tryLock() != NO_ERROR) {
+        android_atomic_inc(&mLockContended[LOCK_FRAME_THREAD]);
+        // Pairs with the barrier in receiveRecordingFrame(): either it
+        // sees the returned bit, or this sees its slot leave the driver.
+        android_memory_barrier();
+        int withDriver = 0;
+        for (int i = 0; i < kRecordBufferCount; i++)
+            if (android_atomic_acquire_load(&mRecordSlotOwner[i]) == SLOT_DRIVER)
+                withDriver++;
+        if (withDriver > 0) {
+            android_atomic_inc(&mRecordReturnsDeferred);
+            return;
         }
+        mFrameThreadWaitLock.lock();
     }
-
-    ALOGV("releaseRecordingFrame X");
+    // do this only if frame thread is running
+    if (mFrameThreadRunning)
+        returnRecordFrames();
+    mFrameThreadWaitLock.unlock();
 }
 
 bool QualcommCameraHardware::recordingEnabled()
@@ -5542,6 +7627,36 @@ void QualcommCameraHardware::notifyShutter(bool mPlayShutterSoundOnly)
 }
 
 // ReceiveRawPicture for ICS
+/* CAMERA_MSG_POSTVIEW_FRAME: the main image shrunk to thumbnail size in
+ * software, instead of asking the VFE for one more output. */
+void QualcommCameraHardware::sendPostviewFrame(struct msm_frame *mainframe)
+{
+    int width = mThumbnailWidth & ~1;
+    int height = mThumbnailHeight & ~1;
+    if (mainframe == NULL || mIs3DModeOn || mPreviewFormat != CAMERA_YUV_420_NV21 ||
+        width < 2 || height < 2)
+        return;
+
+    camera_memory_t *mem = mGetMemory(-1, width * height * 3 / 2, 1, mCallbackCookie);
+    if (mem == NULL || mem->data == NULL) {
+        ALOGE("%s: mGetMemory failed", __FUNCTION__);
+        if (mem != NULL)
+            mem->release(mem);
+        return;
+    }
+    const uint8_t *base = (const uint8_t *)mainframe->buffer;
+    if (nv21_scale(NV21_SCALE_BOX, base + mainframe->y_off, base + mainframe->cbcr_off,
+            mPictureWidth, mPictureHeight, mPictureWidth,
+            (uint8_t *)mem->data, width, height) == 0) {
+        mDataCallback(CAMERA_MSG_POSTVIEW_FRAME, mem, data_counter, NULL, mCallbackCookie);
+        mPostviewFramesScaled++;
+    } else {
+        ALOGE("%s: scaling %dx%d to %dx%d failed", __FUNCTION__,
+            mPictureWidth, mPictureHeight, width, height);
+    }
+    mem->release(mem);
+}
+
 void QualcommCameraHardware::receiveRawPicture(status_t status,struct msm_frame *postviewframe, struct msm_frame *mainframe)
 {
     ALOGE("%s: E", __FUNCTION__);
@@ -5553,6 +7668,9 @@ void QualcommCameraHardware::receiveRawPicture(status_t status,struct msm_frame
     }
     mSnapshotThreadWaitLock.unlock();
 
+    if (status == NO_ERROR && mShotStartTime != 0)
+        mShotToRaw.record(systemTime() - mShotStartTime);
+
     if (status != NO_ERROR) {
         ALOGE("%s: Failed to get Snapshot Image", __FUNCTION__);
         if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
@@ -5621,7 +7739,9 @@ void QualcommCameraHardware::receiveRawPicture(status_t status,struct msm_frame
         int index = mapThumbnailBuffer(postviewframe);
         ALOGE("receiveRawPicture : mapThumbnailBuffer returned %d", index);
         private_handle_t *handle;
-        if (mThumbnailBuffer[index] != NULL && mZslEnable == false) {
+        /* Later burst rounds reuse postview buffers already queued. */
+        bool firstRound = (mBurstShotsLeft + mBurstRoundShots == mBurstShots);
+        if (mThumbnailBuffer[index] != NULL && mZslEnable == false && firstRound) {
             handle = (private_handle_t *)(*mThumbnailBuffer[index]);
             ALOGV("%s: Queueing postview buffer for display %d",
                 __FUNCTION__,handle->fd);
@@ -5642,6 +7762,8 @@ void QualcommCameraHardware::receiveRawPicture(status_t status,struct msm_frame
                 NULL, mCallbackCookie);
         else if (mNotifyCallback && (mMsgEnabled & CAMERA_MSG_RAW_IMAGE_NOTIFY))
             mNotifyCallback(CAMERA_MSG_RAW_IMAGE_NOTIFY, 0, 0, mCallbackCookie);
+        if (mDataCallback && (mMsgEnabled & CAMERA_MSG_POSTVIEW_FRAME))
+            sendPostviewFrame(mainframe);
 
         if (strTexturesOn == true) {
             ALOGI("Raw Data given to app for processing...will wait for jpeg encode call");
@@ -5691,7 +7813,7 @@ void QualcommCameraHardware::receiveJpegPicture(status_t status, mm_camera_buffe
         index = mapJpegBuffer(encoded_buffer);
         ALOGE("receiveJpegPicutre : mapJpegBuffer index : %d", index);
     }
-    if (index < 0 || index >= (MAX_SNAPSHOT_BUFFERS-2)) {
+    if (index < 0 || index >= (mZslEnable ? (MAX_SNAPSHOT_BUFFERS-2) : numCapture)) {
         ALOGE("Jpeg index is not valid or fails. ");
         if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
             mDataCallback(CAMERA_MSG_COMPRESSED_IMAGE, NULL, data_counter, NULL, mCallbackCookie);
@@ -5702,25 +7824,46 @@ void QualcommCameraHardware::receiveJpegPicture(status_t status, mm_camera_buffe
         mJpegThreadWaitLock.unlock();
     } else {
         ALOGV("receiveJpegPicture: Index of Jpeg is %d",index);
+        if (status == NO_ERROR && mShotStartTime != 0)
+            mShotToJpeg.record(systemTime() - mShotStartTime);
 
         if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
             if (status == NO_ERROR) {
+                nsecs_t deliverStart = systemTime();
                 ALOGE("receiveJpegPicture : giving jpeg image callback to services");
-                mJpegCopyMapped = mGetMemory(-1, encoded_buffer->filled_size, 1, mCallbackCookie);
-                if (!mJpegCopyMapped) {
-                    ALOGE("%s: mGetMemory failed.\n", __func__);
+                /* Zero copy: map the encoder output again, trimmed to the
+                 * image. The mapping holds its own reference, so the heap can
+                 * be torn down underneath it, but the encoder reuses the
+                 * buffer for the next image of a burst or ZSL session; only
+                 * the last image of the last burst round can go this way. */
+                if (mJpegZeroCopy && mJpegfd[index] >= 0 && !mZslEnable &&
+                    numJpegReceived == mBurstRoundShots && mBurstShotsLeft == 0) {
+                    mJpegCopyMapped = mGetMemory(mJpegfd[index], encoded_buffer->filled_size, 1, mCallbackCookie);
+                    if (mJpegCopyMapped != NULL) {
+                        android_atomic_inc(&mJpegZeroCopyCount);
+                        mJpegLent[index] = true;
+                    }
+                }
+                if (mJpegCopyMapped == NULL) {
+                    mJpegCopyMapped = mGetMemory(-1, encoded_buffer->filled_size, 1, mCallbackCookie);
+                    if (mJpegCopyMapped != NULL) {
+                        memcpy(mJpegCopyMapped->data, mJpegMapped[index]->data, encoded_buffer->filled_size);
+                        android_atomic_inc(&mJpegCopyCount);
+                    } else {
+                        ALOGE("%s: mGetMemory failed.\n", __func__);
+                    }
                 }
-                memcpy(mJpegCopyMapped->data, mJpegMapped[index]->data, encoded_buffer->filled_size );
                 mDataCallback(CAMERA_MSG_COMPRESSED_IMAGE,mJpegCopyMapped,data_counter,NULL,mCallbackCookie);
                 if (NULL != mJpegCopyMapped) {
                     mJpegCopyMapped->release(mJpegCopyMapped);
                     mJpegCopyMapped = NULL;
                 }
+                mJpegDelivery.record(systemTime() - deliverStart);
             }
         } else {
             ALOGE("JPEG callback was cancelled--not delivering image.");
         }
-        if (numJpegReceived == numCapture) {
+        if (numJpegReceived == mBurstRoundShots) {
             mJpegThreadWaitLock.lock();
             mJpegThreadRunning = false;
             mJpegThreadWait.signal();
@@ -5808,6 +7951,8 @@ status_t QualcommCameraHardware::setCameraMode(const CameraParameters& params)
         return NO_ERROR; /* Not supported */
     }
 
+    if (mZslEnable != value)
+        invalidateParams();
     mZslEnable = value;
     mParameters.set(CameraParameters::KEY_CAMERA_MODE, value);
     return NO_ERROR;
@@ -5919,6 +8064,9 @@ status_t QualcommCameraHardware::setJpegThumbnailSize(const CameraParameters& pa
             height == jpeg_thumbnail_sizes[i].height) {
             mParameters.set(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH, width);
             mParameters.set(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT, height);
+            Mutex::Autolock sl(&mSettingsLock);
+            mSettings.thumbnailWidth = width;
+            mSettings.thumbnailHeight = height;
             return NO_ERROR;
         }
     }
@@ -5968,6 +8116,9 @@ status_t QualcommCameraHardware::setPictureSize(const CameraParameters& params)
             mParameters.setPictureSize(width, height);
             mDimension.picture_width = width;
             mDimension.picture_height = height;
+            Mutex::Autolock sl(&mSettingsLock);
+            mSettings.pictureWidth = width;
+            mSettings.pictureHeight = height;
             return NO_ERROR;
         }
     }
@@ -5979,6 +8130,9 @@ status_t QualcommCameraHardware::setPictureSize(const CameraParameters& params)
         mParameters.setPictureSize(width, height);
         mDimension.picture_width = width;
         mDimension.picture_height = height;
+        Mutex::Autolock sl(&mSettingsLock);
+        mSettings.pictureWidth = width;
+        mSettings.pictureHeight = height;
         return NO_ERROR;
     } else
         ALOGE("Invalid picture size requested: %dx%d", width, height);
@@ -5988,9 +8142,11 @@ status_t QualcommCameraHardware::setPictureSize(const CameraParameters& params)
 status_t QualcommCameraHardware::setJpegQuality(const CameraParameters& params)
 {
     status_t rc = NO_ERROR;
+    Mutex::Autolock sl(&mSettingsLock);
     int quality = params.getInt(CameraParameters::KEY_JPEG_QUALITY);
     if (quality >= 0 && quality <= 100) {
         mParameters.set(CameraParameters::KEY_JPEG_QUALITY, quality);
+        mSettings.jpegQuality = quality;
     } else {
         ALOGE("Invalid jpeg quality=%d", quality);
         rc = BAD_VALUE;
@@ -5999,6 +8155,7 @@ status_t QualcommCameraHardware::setJpegQuality(const CameraParameters& params)
     quality = params.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY);
     if (quality >= 0 && quality <= 100) {
         mParameters.set(CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY, quality);
+        mSettings.thumbnailQuality = quality;
     } else {
         ALOGE("Invalid jpeg thumbnail quality=%d", quality);
         rc = BAD_VALUE;
@@ -6161,9 +8318,23 @@ status_t QualcommCameraHardware::setPreviewFormat(const CameraParameters& params
 {
     const char *str = params.getPreviewFormat();
     int32_t previewFormat = attr_lookup(preview_formats, sizeof(preview_formats) / sizeof(str_map), str);
+    int32_t convert = NV21_CONVERT_NONE;
+    const char *convertName = CameraParameters::PIXEL_FORMAT_YUV420SP;
+    if (previewFormat == NOT_FOUND && supportsConvertedPreview()) {
+        convert = attr_lookup(converted_preview_formats,
+            sizeof(converted_preview_formats) / sizeof(str_map), str);
+        for (unsigned i = 0; i < sizeof(converted_preview_formats) / sizeof(str_map); i++) {
+            if (converted_preview_formats[i].val == convert)
+                convertName = converted_preview_formats[i].desc;
+        }
+        if (convert != NOT_FOUND)
+            previewFormat = CAMERA_YUV_420_NV21;
+    }
     if (previewFormat != NOT_FOUND) {
         mParameters.set(CameraParameters::KEY_PREVIEW_FORMAT, str);
         mPreviewFormat = previewFormat;
+        mPreviewConvert = convert;
+        mPreviewConvertName = convertName;
         if (HAL_currentCameraMode != CAMERA_MODE_3D) {
             ALOGI("Setting preview format to native");
             bool ret = native_set_parms(CAMERA_PARM_PREVIEW_FORMAT, sizeof(previewFormat),
@@ -6177,6 +8348,34 @@ status_t QualcommCameraHardware::setPreviewFormat(const CameraParameters& params
     return BAD_VALUE;
 }
 
+/* Vendor "preview-callback-size": hands the data callback frames scaled
+ * down to WxH (even, at most 8x smaller) for analysis. The display and
+ * recording keep the full preview size. */
+status_t QualcommCameraHardware::setPreviewCallbackSize(const CameraParameters& params)
+{
+    const char *str = params.get("preview-callback-size");
+    int width = 0, height = 0;
+    if (str != NULL && *str != '\0') {
+        int previewW, previewH;
+        params.getPreviewSize(&previewW, &previewH);
+        if (!supportsConvertedPreview() || sscanf(str, "%dx%d", &width, &height) != 2 ||
+            width < 2 || height < 2 || ((width | height) & 1) ||
+            width > previewW || height > previewH ||
+            width * 8 < previewW || height * 8 < previewH) {
+            ALOGE("Invalid preview callback size: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("preview-callback-size", str);
+        if (width == previewW && height == previewH)
+            width = height = 0;
+    } else {
+        mParameters.remove("preview-callback-size");
+    }
+    mPreviewCbWidth = width;
+    mPreviewCbHeight = height;
+    return NO_ERROR;
+}
+
 status_t QualcommCameraHardware::setStrTextures(const CameraParameters& params)
 {
     const char *str = params.get("strtextures");
@@ -6265,6 +8464,10 @@ status_t QualcommCameraHardware::setFlash(const CameraParameters& params)
         int32_t value = attr_lookup(flash, sizeof(flash) / sizeof(str_map), str);
         if (value != NOT_FOUND) {
             mParameters.set(CameraParameters::KEY_FLASH_MODE, str);
+            {
+                Mutex::Autolock sl(&mSettingsLock);
+                mSettings.flashMode = value;
+            }
             bool ret = native_set_parms(CAMERA_PARM_LED_MODE, sizeof(value), &value);
             if (mZslEnable && (value != LED_MODE_OFF)) {
                 mParameters.set("num-snaps-per-shutter", "1");
@@ -6326,6 +8529,18 @@ status_t QualcommCameraHardware::setMCEValue(const CameraParameters& params)
     return BAD_VALUE;
 }
 
+/* Preview frames per displayed frame for a CAMERA_HFR_MODE_* value. */
+static int32_t hfr_display_divisor(int mode)
+{
+    switch (mode) {
+    case CAMERA_HFR_MODE_60FPS:  return 2;
+    case CAMERA_HFR_MODE_90FPS:  return 3;
+    case CAMERA_HFR_MODE_120FPS: return 4;
+    case CAMERA_HFR_MODE_150FPS: return 5;
+    }
+    return 1;
+}
+
 status_t QualcommCameraHardware::setHighFrameRate(const CameraParameters& params)
 {
     if ((!mCfgControl.mm_camera_is_supported(CAMERA_PARM_HFR)) || (mIs3DModeOn)) {
@@ -6339,11 +8554,16 @@ status_t QualcommCameraHardware::setHighFrameRate(const CameraParameters& params
         if (value != NOT_FOUND) {
             int32_t temp = value;
             ALOGI("%s: setting HFR value of %s(%d)", __FUNCTION__, str, temp);
+            android_atomic_release_store(hfr_display_divisor(value), &mHFRDivisor);
             //Check for change in HFR value
             const char *oldHfr = mParameters.get(CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE);
             if (strcmp(oldHfr, str)) {
                 ALOGI("%s: old HFR: %s, new HFR %s", __FUNCTION__, oldHfr, str);
                 mParameters.set(CameraParameters::KEY_VIDEO_HIGH_FRAME_RATE, str);
+                {
+                    Mutex::Autolock sl(&mSettingsLock);
+                    mSettings.hfrMode = value;
+                }
                 mHFRMode = true;
                 if (mCameraRunning == true) {
                     mHFRThreadWaitLock.lock();
@@ -6421,7 +8641,7 @@ status_t QualcommCameraHardware::setExpBracketing(const CameraParameters& params
         temp.total_hal_frames = temp.total_frames;
         strlcpy(temp.values, exp_val, MAX_EXP_BRACKETING_LENGTH);
         ALOGI("%s: setting Exposure Bracketing value of %s", __FUNCTION__, temp.values);
-        mParameters.set("capture-burst-exposures", str);
+        setParamIfChanged("capture-burst-exposures", str);
         if (!mZslEnable) {
             numCapture = temp.total_frames;
         }
@@ -6580,6 +8800,7 @@ status_t QualcommCameraHardware::setFaceDetection(const char *str)
             mFaceDetectOn = value;
             mMetaDataWaitLock.unlock();
             mParameters.set(CameraParameters::KEY_FACE_DETECTION, str);
+            paramsChanged();
             return NO_ERROR;
         }
     }
@@ -6636,6 +8857,10 @@ status_t  QualcommCameraHardware::setISOValue(const CameraParameters& params)
             }
 
             mParameters.set(CameraParameters::KEY_ISO_MODE, str);
+            {
+                Mutex::Autolock sl(&mSettingsLock);
+                mSettings.isoMode = value;
+            }
             native_set_parms(CAMERA_PARM_ISO, sizeof(temp), &temp);
             return NO_ERROR;
         }
@@ -6783,6 +9008,19 @@ status_t QualcommCameraHardware::setGpsLocation(const CameraParameters& params)
         mParameters.remove(CameraParameters::KEY_GPS_TIMESTAMP);
     }
 
+    Mutex::Autolock sl(&mSettingsLock);
+    strlcpy(mSettings.gpsProcessingMethod, method ? method : "",
+        sizeof(mSettings.gpsProcessingMethod));
+    strlcpy(mSettings.exifDateTime, dateTime ? dateTime : "",
+        sizeof(mSettings.exifDateTime));
+    mSettings.hasGpsLatitude = latitude && latitude[0];
+    mSettings.gpsLatitude = latitude ? atof(latitude) : 0;
+    mSettings.hasGpsLongitude = longitude && longitude[0];
+    mSettings.gpsLongitude = longitude ? atof(longitude) : 0;
+    mSettings.hasGpsAltitude = altitude && altitude[0];
+    mSettings.gpsAltitude = altitude ? atof(altitude) : 0;
+    mSettings.hasGpsTimestamp = timestamp && timestamp[0];
+    mSettings.gpsTimestamp = timestamp ? atol(timestamp) : 0;
     return NO_ERROR;
 
 }
@@ -6798,6 +9036,8 @@ status_t QualcommCameraHardware::setRotation(const CameraParameters& params)
             rotation = (rotation + sensor_mount_angle)%360;
             mParameters.set(CameraParameters::KEY_ROTATION, rotation);
             mRotation = rotation;
+            Mutex::Autolock sl(&mSettingsLock);
+            mSettings.rotation = rotation;
         } else {
             ALOGE("Invalid rotation value: %d", rotation);
             rc = BAD_VALUE;
@@ -6826,6 +9066,10 @@ status_t QualcommCameraHardware::setZoom(const CameraParameters& params)
     int32_t zoom_level = params.getInt(CameraParameters::KEY_ZOOM);
     if (zoom_level >= 0 && zoom_level <= mMaxZoom-1) {
         mParameters.set(CameraParameters::KEY_ZOOM, zoom_level);
+        {
+            Mutex::Autolock sl(&mSettingsLock);
+            mSettings.zoom = zoom_level;
+        }
         int32_t zoom_value = ZOOM_STEP * zoom_level;
         bool ret = native_set_parms(CAMERA_PARM_ZOOM, sizeof(zoom_value), &zoom_value);
         rc = ret ? NO_ERROR : UNKNOWN_ERROR;
@@ -6882,9 +9126,21 @@ status_t QualcommCameraHardware::setZslParam(const CameraParameters& params)
 status_t QualcommCameraHardware::setSnapshotCount(const CameraParameters& params)
 {
     int value;
+    int maxValue = MAX_SNAPSHOT_BUFFERS - 2;
     char snapshotCount[5];
     if (!mZslEnable) {
-        value = numCapture;
+        if (mHdrMode || mExpBracketMode) {
+            value = numCapture;
+        } else {
+            /* Plain burst: value is the number of shots per shutter press;
+             * they go through the snapshot buffers numCapture at a time. */
+            const char *str = params.get("num-snaps-per-shutter");
+            if (str != NULL) {
+                value = atoi(str);
+            } else
+                value = 1;
+            maxValue = MAX_BURST_SHOTS;
+        }
     } else {
         /* ZSL case: Get value from App */
         const char *str = params.get("num-snaps-per-shutter");
@@ -6894,19 +9150,22 @@ status_t QualcommCameraHardware::setSnapshotCount(const CameraParameters& params
             value = 1;
     }
     /* Sanity check */
-    if (value > MAX_SNAPSHOT_BUFFERS -2)
-        value = MAX_SNAPSHOT_BUFFERS -2;
+    if (value > maxValue)
+        value = maxValue;
     else if (value < 1)
         value = 1;
     snprintf(snapshotCount, sizeof(snapshotCount),"%d",value);
-    numCapture = value;
-    mParameters.set("num-snaps-per-shutter", snapshotCount);
+    mBurstShots = value;
+    /* Plain bursts size their rounds in takePicture(). */
+    if (mZslEnable || mHdrMode || mExpBracketMode)
+        numCapture = value;
+    setParamIfChanged("num-snaps-per-shutter", snapshotCount);
     ALOGI("%s setting num-snaps-per-shutter to %s", __FUNCTION__, snapshotCount);
     return NO_ERROR;
 
 }
 
-status_t QualcommCameraHardware::updateFocusDistances(const char *focusmode)
+status_t QualcommCameraHardware::updateFocusDistances(int focusMode)
 {
     ALOGV("%s: IN", __FUNCTION__);
     focus_distances_info_t focusDistances;
@@ -6918,13 +9177,14 @@ status_t QualcommCameraHardware::updateFocusDistances(const char *focusmode)
         str.append(buffer);
         snprintf(buffer, sizeof(buffer), ",%f", focusDistances.focus_distance[1]);
         str.append(buffer);
-        if (strcmp(focusmode, CameraParameters::FOCUS_MODE_INFINITY) == 0)
+        if (focusMode == DONT_CARE)
             snprintf(buffer, sizeof(buffer), ",%s", "Infinity");
         else
             snprintf(buffer, sizeof(buffer), ",%f", focusDistances.focus_distance[2]);
         str.append(buffer);
         ALOGI("%s: setting KEY_FOCUS_DISTANCES as %s", __FUNCTION__, str.string());
         mParameters.set(CameraParameters::KEY_FOCUS_DISTANCES, str.string());
+        paramsChanged();
         return NO_ERROR;
     }
     ALOGE("%s: get CAMERA_PARM_FOCUS_DISTANCES failed!!!", __FUNCTION__);
@@ -6988,8 +9248,12 @@ status_t QualcommCameraHardware::setFocusMode(const CameraParameters& params)
             sizeof(focus_modes) / sizeof(str_map), str);
         if (value != NOT_FOUND) {
             mParameters.set(CameraParameters::KEY_FOCUS_MODE, str);
+            {
+                Mutex::Autolock sl(&mSettingsLock);
+                mSettings.focusMode = value;
+            }
 
-            if (mHasAutoFocusSupport && updateFocusDistances(str) != NO_ERROR) {
+            if (mHasAutoFocusSupport && updateFocusDistances(value) != NO_ERROR) {
                 ALOGE("%s: updateFocusDistances failed for %s", __FUNCTION__, str);
                 return UNKNOWN_ERROR;
             }
@@ -7039,6 +9303,8 @@ status_t QualcommCameraHardware::setPictureFormat(const CameraParameters& params
             sizeof(picture_formats) / sizeof(str_map), str);
         if (value != NOT_FOUND) {
             mParameters.set(CameraParameters::KEY_PICTURE_FORMAT, str);
+            Mutex::Autolock sl(&mSettingsLock);
+            mSettings.rawPicture = value == PICTURE_FORMAT_RAW;
         } else {
             ALOGE("Invalid Picture Format value: %s", str);
             return BAD_VALUE;
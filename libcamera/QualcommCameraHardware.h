@@ -24,6 +24,8 @@
 #include <hardware/camera.h>
 #include <gralloc_priv.h>
 #include <utils/threads.h>
+#include <utils/String8.h>
+#include <cutils/atomic.h>
 
 extern "C" {
 #ifdef USE_ION
@@ -64,6 +66,7 @@ typedef enum {
     LIVESHOT_STOPPED
 } liveshotState;
 #define MIN_UNDEQUEUD_BUFFER_COUNT 2
+#define GPS_PROCESSING_METHOD_SIZE  101
 
 struct target_map {
     const char *targetStr;
@@ -78,6 +81,47 @@ struct board_property {
     bool hasFaceDetect;
 };
 
+/* Maps a buffer address to the slot it was registered in. Open addressing
+ * over a fixed table, so lookups are constant time and never allocate.
+ */
+class BufferIndexMap {
+public:
+    BufferIndexMap();
+    void clear();
+    bool add(const void *key, int index);
+    int lookup(const void *key) const;
+private:
+    static const int kSize = 32; /* power of two, well above any buffer count */
+
+    const void *mKeys[kSize];
+    int mIndex[kSize];
+};
+
+/* Log-linear latency histogram in microseconds: exact below 16us, then
+ * four buckets per power of two. record() is lock free so it can be
+ * called from any thread; percentiles are read from the bucket counts
+ * and reported as the bucket's upper bound.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+    void reset();
+    void record(nsecs_t delta);
+    int32_t count() const;
+    uint32_t max() const;
+    uint32_t percentile(int pct) const;
+    void format(String8 &out, const char *name) const;
+private:
+    static const int kBuckets = 96;
+
+    static int bucketFor(uint32_t usecs);
+    static uint32_t bucketLimit(int bucket);
+
+    volatile int32_t mCount;
+    volatile int32_t mMax;
+    volatile int32_t mBuckets[kBuckets];
+};
+
 class QualcommCameraHardware {
 public:
     void setCallbacks(camera_notify_callback notify_cb,
@@ -105,11 +149,13 @@ public:
     virtual status_t cancelPicture();
     virtual status_t setParameters(const CameraParameters& params);
     virtual CameraParameters getParameters() const;
+    char *getParametersString();
     virtual status_t sendCommand(int32_t command, int32_t arg1, int32_t arg2);
     virtual status_t set_PreviewWindow(void *param);
     virtual status_t setPreviewWindow(preview_stream_ops_t *window);
     virtual status_t setPreviewWindow(const sp<ANativeWindow>& buf) {return NO_ERROR;};
     virtual void release();
+    virtual status_t dump(int fd);
 
     static QualcommCameraHardware *createInstance();
     static QualcommCameraHardware *getInstance();
@@ -127,7 +173,8 @@ public:
 #ifdef USE_ION
     int allocate_ion_memory(int *main_ion_fd, struct ion_allocation_data* alloc,
         struct ion_fd_data* ion_info_fd, int ion_type, int size, int *memfd);
-    int deallocate_ion_memory(int *main_ion_fd, struct ion_fd_data* ion_info_fd);
+    int deallocate_ion_memory(int *main_ion_fd, struct ion_fd_data* ion_info_fd,
+        bool reusable = true);
 #endif
     virtual ~QualcommCameraHardware();
     int storeMetaDataInBuffers(int enable);
@@ -138,7 +185,7 @@ private:
     status_t startRecordingInternal();
     status_t setHistogramOn();
     status_t setHistogramOff();
-    status_t runFaceDetection();
+    status_t runFaceDetection(bool start);
     status_t setFaceDetection(const char *str);
 
     void stopPreviewInternal();
@@ -152,7 +199,11 @@ private:
     status_t startInitialPreview();
     void stopInitialPreview();
     status_t getBuffersAndStartPreview();
+    status_t restartPreviewWithBuffers();
     void relinquishBuffers();
+    void queueFreePreviewBuffers();
+    int postviewCount();
+    bool streamGeometryUnchanged();
 
     /* These constants reflect the number of buffers that libmmcamera requires
        for preview and raw, and need to be updated when libmmcamera
@@ -195,8 +246,23 @@ private:
     bool initLiveSnapshot(int videowidth, int videoheight);
     bool initRawSnapshot();
     void deinitRaw();
+    void deinitJpegHeap(int cnt);
+    void deinitRawHeap(int cnt);
+    void releaseSnapshotPool();
     void deinitRawSnapshot();
     bool mPreviewThreadRunning;
+    friend void *preview_cb_thread(void *user);
+    void runPreviewCallbackThread();
+    void deliverPreviewFrame(camera_data_callback pcb, void *pdata, int slot);
+    void releasePreviewRef(int slot);
+    camera_memory_t *convertPreviewFrame(int slot);
+    void sendPostviewFrame(struct msm_frame *mainframe);
+    void releaseConvertBuffers();
+    bool supportsConvertedPreview();
+    int32_t windowPreviewFormat();
+    bool mPreviewCbThreadRunning;
+    Mutex mPreviewCbThreadWaitLock;
+    Condition mPreviewCbThreadWait;
     bool createSnapshotMemory(int numberOfRawBuffers, int numberOfJpegBuffers,
         bool initJpegHeap, int snapshotFormat = 1 /*PICTURE_FORMAT_JPEG*/);
     Mutex mPreviewThreadWaitLock;
@@ -215,26 +281,333 @@ private:
 	int mapFrame(buffer_handle_t *buffer);
     Mutex mHFRThreadWaitLock;
 
+    /* Single-producer (frame thread) / single-consumer (preview thread)
+     * ring. The lock is only taken when the consumer has to sleep on an
+     * empty queue, or by the producer to wake it up.
+     */
     class FrameQueue {
     private:
+        static const int32_t kMaxSize = 16; /* power of two */
+
         Mutex mQueueLock;
         Condition mQueueWait;
-        bool mInitialized;
+        volatile int32_t mInitialized;
+        volatile int32_t mWaiting;
+        volatile int32_t mHead;     /* written by the consumer only */
+        volatile int32_t mTail;     /* written by the producer only */
+        int32_t mCapacity;
 
-        Vector<struct msm_frame *> mContainer;
+        struct msm_frame *mRing[kMaxSize];
     public:
         FrameQueue();
         virtual ~FrameQueue();
         bool add(struct msm_frame *element);
         void flush();
         struct msm_frame* get();
-        void init();
+        void init(int capacity = kMaxSize);
         void deinit();
         bool isInitialized();
+        int count();
     };
 
     FrameQueue mPreviewBusyQueue;
 
+    /* Preview slots waiting for the app data callback, so the display
+     * path never runs behind it. Bounded: when full, latest-only replaces
+     * the pending frame with the new one, backlog refuses the new one.
+     */
+    class PreviewCallbackQueue {
+    public:
+        static const int kMaxSize = 8;
+    private:
+        Mutex mQueueLock;
+        Condition mQueueWait;
+        bool mExit;
+        bool mLatestOnly;
+        int mHead;
+        int mCount;
+        int mCapacity;
+
+        int mRing[kMaxSize];
+    public:
+        PreviewCallbackQueue();
+        void init(int capacity, bool latestOnly);
+        int post(int slot);
+        int get();
+        int take();
+        void requestExit();
+        int count();
+    };
+
+    PreviewCallbackQueue mPreviewCallbackQueue;
+    int mPreviewCbDepth;
+    bool mPreviewCbLatestOnly;
+    /* References to each preview slot held by the display and the
+     * callback worker; the last one out returns it to the driver. */
+    volatile int32_t mPreviewRefs[kTotalPreviewBufferCount];
+    /* NV21_CONVERT_* applied to callback frames, and the buffers the
+     * converted frames are handed out in. */
+    static const int kConvertBufferCount = 2;
+    int32_t mPreviewConvert;
+    /* Static name of the format callbacks are delivered in, for dump(),
+     * which must not read mParameters. */
+    const char *volatile mPreviewConvertName;
+    camera_memory_t *mConvertMapped[kConvertBufferCount];
+    int mConvertNext;
+    size_t mConvertSize;
+    int mConvertFrames;
+    nsecs_t mConvertTime;
+    /* Scaled callback size, 0 for the preview size, and the NV21 scratch
+     * frame used when a scaled frame is converted too. */
+    int mPreviewCbWidth;
+    int mPreviewCbHeight;
+    uint8_t *mScaleScratch;
+    size_t mScaleScratchSize;
+    int mPostviewFramesScaled;
+
+    /* Slot lookup for buffers coming back from the driver, display or
+     * encoder. Filled in when the buffers are registered. */
+    BufferIndexMap mPreviewIndex;
+    BufferIndexMap mDisplayIndex;
+    BufferIndexMap mRecordIndex;
+    BufferIndexMap mRawIndex;
+    BufferIndexMap mThumbnailIndex;
+    BufferIndexMap mJpegIndex;
+
+    /* Preview pipeline tracing. Stamps are kept per preview slot and
+     * handed from the frame thread to the preview thread through the
+     * busy queue, so they need no locking of their own.
+     */
+    enum {
+        PREVIEW_STAGE_RECEIVE,  /* driver callback -> busy queue */
+        PREVIEW_STAGE_QUEUE,    /* busy queue -> preview thread */
+        PREVIEW_STAGE_CALLBACK, /* app preview data callback */
+        PREVIEW_STAGE_ENQUEUE,  /* enqueue_buffer to the window */
+        PREVIEW_STAGE_DEQUEUE,  /* dequeue_buffer + lock_buffer */
+        PREVIEW_STAGE_DISPLAY,  /* driver callback -> window */
+        PREVIEW_STAGE_RETURN,   /* driver callback -> back to the driver */
+        PREVIEW_STAGE_MAX
+    };
+    enum {
+        PREVIEW_DROP_STOPPED,   /* arrived after the camera was stopped */
+        PREVIEW_DROP_QUEUE,     /* busy queue full */
+        PREVIEW_DROP_UNMAPPED,  /* buffer not found in the slot maps */
+        PREVIEW_DROP_HFR,       /* skipped by HFR decimation */
+        PREVIEW_DROP_DISPLAY,   /* window enqueue/dequeue failure */
+        PREVIEW_DROP_CALLBACK,  /* callback queue full */
+        PREVIEW_DROP_MAX
+    };
+    LatencyHistogram mPreviewLatency[PREVIEW_STAGE_MAX];
+    volatile int32_t mPreviewDrops[PREVIEW_DROP_MAX];
+    volatile int32_t mPreviewFramesReceived;
+    nsecs_t mPreviewReceivedAt[kTotalPreviewBufferCount];
+    nsecs_t mPreviewQueuedAt[kTotalPreviewBufferCount];
+    void resetPreviewStats();
+    void dumpPreviewStats(String8 &out);
+
+    /* Who holds each buffer slot, as reported by dump(). */
+    enum {
+        SLOT_DRIVER,
+        SLOT_HAL,
+        SLOT_DISPLAY,
+        SLOT_APP
+    };
+    volatile int32_t mPreviewSlotOwner[kTotalPreviewBufferCount];
+    volatile int32_t mRecordSlotOwner[9]; /* RECORD_BUFFERS */
+    nsecs_t mPreviewStartTime;
+    nsecs_t mRecordStartTime;
+    volatile int32_t mRecordFramesReceived;
+    volatile int32_t mRecordFramesDropped;
+    int mVideoBatches;          /* video thread only */
+    int mVideoBatchMax;
+    /* Record slots the encoder has released but the driver has not yet
+     * got back, one bit per slot. */
+    volatile int32_t mRecordReturned;
+    volatile int32_t mRecordReturns;
+    volatile int32_t mRecordReturnsDeferred;
+    void returnRecordFrames();
+
+    /* Snapshot timings, measured from takePicture(). */
+    nsecs_t mShotStartTime;
+    nsecs_t mLastShotTime;
+    LatencyHistogram mShotToRaw;
+    LatencyHistogram mShotToJpeg;
+    LatencyHistogram mShotToShot;
+    LatencyHistogram mJpegDelivery;     /* encoder done -> callback returned */
+    volatile int32_t mJpegZeroCopyCount;
+    volatile int32_t mJpegCopyCount;
+
+    /* Burst capture. A shutter press takes mBurstShots images in rounds of
+     * numCapture, which is capped at mBurstDepth snapshot buffers. Within a
+     * round the encoder works on shot k while shot k+1 is read out; the
+     * buffers stay registered from one round to the next.
+     */
+    static const int kBurstDepth = 2;
+    int mBurstShots;
+    int mBurstDepth;
+    int mBurstRoundShots;
+    int mBurstShotsLeft;            /* after the current round */
+    int32_t mBurstsTaken;
+    int32_t mLastBurstShots;
+    nsecs_t mLastBurstTime;
+
+    /* Contention on the locks taken once per frame. */
+    enum {
+        LOCK_CALLBACK,
+        LOCK_DISPLAY,
+        LOCK_RECORD_FRAME,
+        LOCK_FRAME_THREAD,
+        LOCK_MAX
+    };
+    volatile int32_t mLockAcquired[LOCK_MAX];
+    volatile int32_t mLockContended[LOCK_MAX];
+    void lockCounted(Mutex &lock, int which);
+
+    /* setParameters() only calls a setter when a key it reads differs
+     * from what it last applied successfully, or from mParameters.
+     * Setters that also depend on HAL state always run, and anything that
+     * resets the driver calls invalidateParams() so the rest are pushed
+     * again on the next call. */
+    enum {
+        PARAM_CAMERA_MODE,
+        PARAM_PREVIEW_SIZE,
+        PARAM_RECORD_SIZE,
+        PARAM_PICTURE_SIZE,
+        PARAM_THUMBNAIL_SIZE,
+        PARAM_JPEG_QUALITY,
+        PARAM_PICTURE_FORMAT,
+        PARAM_PREVIEW_FORMAT,
+        PARAM_PREVIEW_CB_SIZE,
+        PARAM_EFFECT,
+        PARAM_GPS,
+        PARAM_ROTATION,
+        PARAM_ZOOM,
+        PARAM_ORIENTATION,
+        PARAM_LENSSHADE,
+        PARAM_MCE,
+        PARAM_SHARPNESS,
+        PARAM_SATURATION,
+        PARAM_TOUCH_AF_AEC,
+        PARAM_SCENE_MODE,
+        PARAM_CONTRAST,
+        PARAM_SCENE_DETECT,
+        PARAM_STR_TEXTURES,
+        PARAM_SKIN_TONE,
+        PARAM_ANTIBANDING,
+        PARAM_REDEYE,
+        PARAM_DENOISE,
+        PARAM_FPS_RANGE,
+        PARAM_RECORDING_HINT,
+        PARAM_FRAME_RATE,
+        PARAM_AUTO_EXPOSURE,
+        PARAM_EXPOSURE_COMP,
+        PARAM_WHITE_BALANCE,
+        PARAM_FLASH,
+        PARAM_FOCUS_MODE,
+        PARAM_BRIGHTNESS,
+        PARAM_ISO,
+        PARAM_FOCUS_AREAS,
+        PARAM_METERING_AREAS,
+        PARAM_ZONE_AF,
+        PARAM_HFR,
+        PARAM_SETTER_MAX
+    };
+    typedef status_t (QualcommCameraHardware::*ParamSetter)(const CameraParameters& params);
+    String8 mParamSignature[PARAM_SETTER_MAX];
+    int32_t mParamsApplied;
+    int32_t mParamsSkipped;
+    /* Set by invalidateParams() from any thread; setParameters() clears
+     * the signatures when it sees it. */
+    volatile int32_t mParamsInvalid;
+    static const char * const *paramKeys(int id);
+    static const char * const *paramOutputs(int id);
+    static bool paramAlwaysApplies(int id);
+    status_t applyParam(int id, ParamSetter set, const CameraParameters& params);
+    void invalidateParams();
+
+    /* get_parameters() is polled constantly, so the flattened form of
+     * mParameters is cached and only rebuilt once mParamGeneration moves.
+     * Anything that changes mParameters outside setParameters() must call
+     * paramsChanged() afterwards.
+     */
+    void paramsChanged() { android_atomic_inc(&mParamGeneration); }
+    volatile int32_t mParamGeneration;
+    int32_t mFlatParamsGeneration;
+    String8 mFlatParams;
+    Mutex mFlatParamsLock;
+    int32_t mFlatParamsBuilt;
+    int32_t mFlatParamsReused;
+    void setParamIfChanged(const char *key, const char *value);
+
+    /* Typed copy of the settings read by the capture, autofocus, smooth
+     * zoom and recording paths, so those do no string work. The setters
+     * store the values they have already parsed, under mSettingsLock, next
+     * to their mParameters.set(); settings() hands out a copy.
+     * CameraParameters stays the format at the API boundary.
+     * Modes hold their str_map value, NOT_FOUND when the key is not set.
+     */
+    struct Settings {
+        int pictureWidth;
+        int pictureHeight;
+        int thumbnailWidth;
+        int thumbnailHeight;
+        int jpegQuality;
+        int thumbnailQuality;
+        int rotation;
+        int zoom;
+        float focalLength;
+        bool rawPicture;
+        int focusMode;
+        int flashMode;
+        int isoMode;
+        int hfrMode;
+        char exifDateTime[20];          /* "YYYY:MM:DD HH:MM:SS" */
+        char gpsProcessingMethod[GPS_PROCESSING_METHOD_SIZE];
+        bool hasGpsLatitude;
+        bool hasGpsLongitude;
+        bool hasGpsAltitude;
+        bool hasGpsTimestamp;
+        double gpsLatitude;
+        double gpsLongitude;
+        double gpsAltitude;
+        long gpsTimestamp;
+    };
+    Settings settings();
+    void loadSettings();
+    Settings mSettings;
+    Mutex mSettingsLock;
+
+    /* Recording frames waiting for the video thread. Storage is fixed and
+     * sized for the record buffers, so posting a frame never allocates.
+     * The queue also carries the thread's exit request, so stopping it
+     * needs neither the frame lock nor mVideoThreadWaitLock.
+     */
+    class VideoFrameQueue {
+    public:
+        static const int kMaxSize = 9; /* RECORD_BUFFERS */
+    private:
+        Mutex mQueueLock;
+        Condition mQueueWait;
+        bool mExit;
+        int mHead;
+        int mCount;
+        int mCapacity;
+
+        struct msm_frame *mRing[kMaxSize];
+    public:
+        VideoFrameQueue();
+        void init(int capacity);
+        bool post(struct msm_frame *frame);
+        struct msm_frame *get();
+        int drain(struct msm_frame **frames, int max);
+        void requestExit();
+        void resetExit();
+        void flush();
+        int count();
+    };
+
+    VideoFrameQueue mVideoBusyQueue;
+
     bool mFrameThreadRunning;
     Mutex mFrameThreadWaitLock;
     Condition mFrameThreadWait;
@@ -242,7 +615,6 @@ private:
     void runFrameThread(void *data);
 
     //720p recording video thread
-    bool mVideoThreadExit;
     bool mVideoThreadRunning;
     Mutex mVideoThreadWaitLock;
     Condition mVideoThreadWait;
@@ -250,26 +622,94 @@ private:
     void runVideoThread(void *data);
 
     // smooth zoom
+    /* The worker moves by time, not by preview frame: mSmoothZoomRangeMs
+     * to cross the whole range, setting only CAMERA_PARM_ZOOM and at most
+     * one step per kSmoothZoomMinStep. START/STOP leave a pending target
+     * it picks up from wherever it has got to, so they coalesce. All of
+     * it is under mSmoothzoomThreadWaitLock. */
+    static const int kSmoothZoomStop = -2;
+    static const nsecs_t kSmoothZoomMinStep = 16000000LL;
+    int mSmoothZoomRangeMs;
     int mTargetSmoothZoom;
+    int mSmoothZoomPending;
+    int mSmoothZoomLevel;
+    int mSmoothZoomSteps;
+    int mSmoothZoomRetargets;
+    int mSmoothZoomCoalesced;
     bool mSmoothzoomThreadExit;
     bool mSmoothzoomThreadRunning;
     Mutex mSmoothzoomThreadWaitLock;
-    Mutex mSmoothzoomThreadLock;
     Condition mSmoothzoomThreadWait;
     friend void *smoothzoom_thread(void *user);
     void runSmoothzoomThread(void* data);
+    bool supportsSmoothZoom();
+    status_t startSmoothZoom(int level);
+    status_t stopSmoothZoom();
+    bool setZoomLevel(int level);
 
     // For Histogram
-    int mStatsOn;
-    int mCurrent;
-    bool mSendData;
+    /* Three slots, lock-free: the producer fills back() and publish()es
+     * it; acquire() swaps the newest published slot to the front, where
+     * it stays until the next acquire(). A slot the app may still be
+     * reading is never written. */
+    class TripleBuffer {
+        volatile int32_t mState;    /* back | ready << 2 | front << 4 | fresh */
+    public:
+        TripleBuffer();
+        void reset();
+        int back();
+        bool publish();
+        int acquire();
+    };
+
+    TripleBuffer mStatsBuffer;
+    volatile int32_t mStatsOn;
+    /* Set by HISTOGRAM_SEND_DATA: the app is done with the front slot and
+     * wants the next histogram. */
+    volatile int32_t mStatsRequested;
+    /* Histogram computed from the preview Y plane instead of the VFE. */
+    bool mStatsSoftware;
+    volatile int32_t mStatsPublished;
+    volatile int32_t mStatsDelivered;
+    volatile int32_t mStatsOverwritten;
     Mutex mStatsWaitLock;
     Condition mStatsWait;
+    void publishStats();
+    void computeSoftwareStats(int slot);
+    void releaseStatsBuffers();
 
     //For Face Detection
     int mFaceDetectOn;
-    bool mSendMetaData;
     Mutex mMetaDataWaitLock;
+    /* No hardware detector: the preview thread hands a worker one slot
+     * every mFaceInterval frames, and skips while it is still busy. */
+    bool mFaceSoftware;
+    int mFaceInterval;
+    int mFaceFrameCount;
+    int mFaceSlot;
+    bool mFaceThreadRunning;
+    bool mFaceThreadExit;
+    Condition mFaceWait;
+    Condition mFaceThreadWait;
+    int mFacesLast;
+    /* Last faces sent, so a face keeps its id while it overlaps the
+     * one it was in the previous result. */
+    static const int kMaxFaces = 4;    /* NV21_MAX_FACES; MAX_ROI is less */
+    camera_face_t mFacesPrev[kMaxFaces];
+    int32_t mNextFaceId;
+    camera_memory_t *mFaceMetaMem;
+    static const int kFaceAnalysisWidth = 160;
+    uint8_t *mFaceScratch;
+    int mFaceFramesAnalysed;
+    int mFaceFramesSkipped;
+    int mFacesFound;
+    nsecs_t mFaceTime;
+    friend void *face_thread(void *user);
+    void runFaceThread();
+    void postFaceFrame(int slot, struct msm_frame *frame);
+    void analyzeFaces(int slot);
+    void assignFaceIds(camera_face_t *faces, int count);
+    void deliverFaces(camera_face_t *faces, int count);
 
     bool mShutterPending;
     Mutex mShutterLock;
@@ -302,6 +742,7 @@ private:
 
     void initDefaultParameters();
     bool initImageEncodeParameters(int size);
+    bool setCaptureParms();
     bool initZslParameter(void);
     status_t setCameraMode(const CameraParameters& params);
     status_t setPreviewSize(const CameraParameters& params);
@@ -343,16 +784,17 @@ private:
     status_t setSceneDetect(const CameraParameters& params);
     status_t setStrTextures(const CameraParameters& params);
     status_t setPreviewFormat(const CameraParameters& params);
+    status_t setPreviewCallbackSize(const CameraParameters& params);
     status_t setSelectableZoneAf(const CameraParameters& params);
     status_t setHighFrameRate(const CameraParameters& params);
     status_t setRedeyeReduction(const CameraParameters& params);
     status_t setDenoise(const CameraParameters& params);
     status_t setZslParam(const CameraParameters& params);
     status_t setSnapshotCount(const CameraParameters& params);
-    void setGpsParameters(void);
+    void setGpsParameters(const Settings& s);
     void setExifInfo(void);
     bool isValidDimension(int w, int h);
-    status_t updateFocusDistances(const char *focusmode);
+    status_t updateFocusDistances(int focusMode);
     int mStoreMetaDataInFrame;
 
     Mutex mLock;
@@ -386,6 +828,8 @@ private:
     pthread_t mFrameThread;
     pthread_t mVideoThread;
     pthread_t mPreviewThread;
+    pthread_t mPreviewCbThread;
+    pthread_t mFaceThread;
     pthread_t mSnapshotThread;
     pthread_t mDeviceOpenThread;
     pthread_t mSmoothzoomThread;
@@ -399,9 +843,24 @@ private:
     void *mThumbnailMapped[MAX_SNAPSHOT_BUFFERS];
     int mRawfd[MAX_SNAPSHOT_BUFFERS];
     int mRawSnapshotfd;
-    int mJpegfd[MAX_SNAPSHOT_BUFFERS];
+    int mJpegfd[MAX_SNAPSHOT_BUFFERS];  /* -1 unless ION backed */
+    bool mJpegZeroCopy;
+    bool mJpegLent[MAX_SNAPSHOT_BUFFERS]; /* app holds a zero-copy view */
+
+    /* Non-ZSL raw and JPEG snapshot heaps stay allocated and registered
+     * from one capture to the next while the picture geometry is
+     * unchanged; the pool key is the layout they were created with.
+     */
+    bool mSnapshotPoolEnabled;
+    int mSnapshotPoolSize;
+    int mSnapshotPoolCbCrOffset;
+    int mSnapshotPoolYOffset;
+    int32_t mSnapshotPoolHits;
+    int32_t mSnapshotPoolMisses;
     int mRecordfd[9];
     camera_memory_t *mPreviewMapped[kPreviewBufferCount + MIN_UNDEQUEUD_BUFFER_COUNT];
+    /* NV21 data callback wrappers, trimmed to w*h*3/2 for CTS */
+    camera_memory_t *mPreviewCbMapped[kPreviewBufferCount + MIN_UNDEQUEUD_BUFFER_COUNT];
     camera_memory_t *mRawMapped[MAX_SNAPSHOT_BUFFERS];
     camera_memory_t *mJpegMapped[MAX_SNAPSHOT_BUFFERS];
     camera_memory_t *mRawSnapshotMapped;
@@ -420,6 +879,9 @@ private:
     struct ion_fd_data raw_ion_info_fd[MAX_SNAPSHOT_BUFFERS];
     struct ion_fd_data raw_snapshot_ion_info_fd;
     struct ion_fd_data record_ion_info_fd[9];
+    int jpeg_main_ion_fd[MAX_SNAPSHOT_BUFFERS];
+    struct ion_allocation_data jpeg_alloc[MAX_SNAPSHOT_BUFFERS];
+    struct ion_fd_data jpeg_ion_info_fd[MAX_SNAPSHOT_BUFFERS];
 #endif
 
     struct msm_frame frames[kPreviewBufferCount + MIN_UNDEQUEUD_BUFFER_COUNT];
@@ -463,12 +925,28 @@ private:
     cam_3d_frame_format_t mSnapshot3DFormat;
     bool mSnapshotCancel;
     bool mHFRMode;
+    /* Display 1 of every mHFRDivisor preview frames; set by setHighFrameRate */
+    volatile int32_t mHFRDivisor;
+    uint32_t mHFRFrameCount;    /* preview thread only */
     Mutex mSnapshotCancelLock;
     int mActualPictWidth;
     int mActualPictHeight;
     bool mUseJpegDownScaling;
     bool mPreviewStopping;
     bool mInHFRThread;
+    /* Geometry the display buffers were dequeued for. A mode switch that
+     * keeps it restarts with the same buffers (mRetainBuffers) instead of
+     * cancelling and dequeueing them again. */
+    preview_stream_ops_t *mStreamWindow;
+    int mStreamWidth;
+    int mStreamHeight;
+    int mStreamFormat;
+    int mStreamPostviews;
+    uint32_t mPreviewActiveMask;
+    bool mRetainBuffers;
+    int mStreamReconfigs;
+    int mStreamRestarts;
+    nsecs_t mLastModeSwitchTime;
     bool mHdrMode;
     bool mExpBracketMode;
     bool mMultiTouch;
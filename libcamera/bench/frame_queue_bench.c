@@ -0,0 +1,343 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Times the preview busy queue (QualcommCameraHardware::FrameQueue, frame
+ * thread -> preview thread) against the mutex/condition/Vector queue it
+ * replaced. Both are transcribed here in C so the bench builds without
+ * libutils; keep them in step with QualcommCameraHardware.cpp.
+ *
+ * Two runs per queue:
+ *   paced      one frame every period, as the driver delivers them: cost
+ *              of add() on the frame thread and add -> get hand-off latency
+ *   saturated  back-to-back frames with as many in flight as there are
+ *              preview buffers: throughput
+ * Usage: frame_queue_bench [frames] [period_us]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RING_SIZE 16    /* FrameQueue::kMaxSize */
+#define IN_FLIGHT 4     /* NUM_PREVIEW_BUFFERS on 7x30 */
+
+struct frame {
+    long long posted;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Baseline: every add() and get() takes the lock, add() always signals and
+ * get() shifts the array down like Vector::removeAt(0). */
+struct locked_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    int initialized;
+    int count;
+    struct frame *items[RING_SIZE];
+};
+
+static void locked_init(struct locked_queue *q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wait, NULL);
+    q->initialized = 1;
+    q->count = 0;
+}
+
+static int locked_add(struct locked_queue *q, struct frame *f)
+{
+    pthread_mutex_lock(&q->lock);
+    /* Vector grew without bound; the driver never had more than
+     * IN_FLIGHT buffers to queue, so bound it the same as the ring. */
+    if (!q->initialized || q->count == IN_FLIGHT) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    q->items[q->count++] = f;
+    pthread_cond_signal(&q->wait);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+static struct frame *locked_get(struct locked_queue *q)
+{
+    struct frame *f;
+    pthread_mutex_lock(&q->lock);
+    while (q->initialized && q->count == 0)
+        pthread_cond_wait(&q->wait, &q->lock);
+    if (!q->initialized) {
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+    f = q->items[0];
+    q->count--;
+    memmove(q->items, q->items + 1, q->count * sizeof(q->items[0]));
+    pthread_mutex_unlock(&q->lock);
+    return f;
+}
+
+static int locked_count(struct locked_queue *q)
+{
+    int n;
+    pthread_mutex_lock(&q->lock);
+    n = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+/* Current: single-producer/single-consumer ring; the lock is only taken
+ * when the consumer sleeps on an empty ring or the producer wakes it. The
+ * builtins stand in for android_atomic_* as they are inlined on ARM. */
+struct ring_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    volatile int initialized;
+    volatile int waiting;
+    volatile int head;
+    volatile int tail;
+    int capacity;
+    struct frame *ring[RING_SIZE];
+};
+
+static int acquire_load(volatile int *p)
+{
+    int v = *p;
+    __sync_synchronize();
+    return v;
+}
+
+static void release_store(int v, volatile int *p)
+{
+    __sync_synchronize();
+    *p = v;
+}
+
+static void ring_init(struct ring_queue *q, int capacity)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wait, NULL);
+    q->waiting = 0;
+    q->head = 0;
+    q->tail = 0;
+    q->capacity = capacity;
+    release_store(1, &q->initialized);
+}
+
+static int ring_add(struct ring_queue *q, struct frame *f)
+{
+    int tail;
+    if (!acquire_load(&q->initialized))
+        return 0;
+    tail = q->tail;
+    if ((unsigned)(tail - acquire_load(&q->head)) >= (unsigned)q->capacity)
+        return 0;
+    q->ring[tail & (RING_SIZE - 1)] = f;
+    release_store((int)((unsigned)tail + 1), &q->tail);
+    __sync_synchronize();
+    if (acquire_load(&q->waiting)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->wait);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return 1;
+}
+
+static struct frame *ring_get(struct ring_queue *q)
+{
+    for (;;) {
+        int head;
+        if (!acquire_load(&q->initialized))
+            return NULL;
+        head = q->head;
+        if (head != acquire_load(&q->tail)) {
+            struct frame *f = q->ring[head & (RING_SIZE - 1)];
+            release_store((int)((unsigned)head + 1), &q->head);
+            return f;
+        }
+        pthread_mutex_lock(&q->lock);
+        release_store(1, &q->waiting);
+        __sync_synchronize();
+        while (q->initialized && head == acquire_load(&q->tail))
+            pthread_cond_wait(&q->wait, &q->lock);
+        release_store(0, &q->waiting);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+static int ring_count(struct ring_queue *q)
+{
+    return (int)((unsigned)acquire_load(&q->tail) - (unsigned)acquire_load(&q->head));
+}
+
+struct run {
+    int ring;               /* 0: locked_queue, 1: ring_queue */
+    struct locked_queue lq;
+    struct ring_queue rq;
+    int frames;
+    long long *latency;     /* per frame, ns */
+};
+
+static int queue_add(struct run *r, struct frame *f)
+{
+    return r->ring ? ring_add(&r->rq, f) : locked_add(&r->lq, f);
+}
+
+static struct frame *queue_get(struct run *r)
+{
+    return r->ring ? ring_get(&r->rq) : locked_get(&r->lq);
+}
+
+static int queue_count(struct run *r)
+{
+    return r->ring ? ring_count(&r->rq) : locked_count(&r->lq);
+}
+
+static void *consumer(void *data)
+{
+    struct run *r = data;
+    int i;
+    for (i = 0; i < r->frames; i++) {
+        struct frame *f = queue_get(r);
+        if (f == NULL)
+            break;
+        r->latency[i] = now_ns() - f->posted;
+    }
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void start(struct run *r, int ring, int frames)
+{
+    memset(r, 0, sizeof(*r));
+    r->ring = ring;
+    r->frames = frames;
+    r->latency = calloc(frames, sizeof(r->latency[0]));
+    if (ring)
+        ring_init(&r->rq, IN_FLIGHT);
+    else
+        locked_init(&r->lq);
+}
+
+static void paced(int ring, int frames, int period_us)
+{
+    struct run r;
+    struct frame *pool;
+    pthread_t thread;
+    struct timespec next;
+    long long add_ns = 0, add_max = 0;
+    int i, drops = 0;
+
+    start(&r, ring, frames);
+    pool = calloc(frames, sizeof(*pool));
+    pthread_create(&thread, NULL, consumer, &r);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (i = 0; i < frames; i++) {
+        long long t0, t;
+        /* The frame thread sleeps in the driver between frames. */
+        next.tv_nsec += period_us * 1000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        t0 = now_ns();
+        pool[i].posted = t0;
+        while (!queue_add(&r, &pool[i])) {
+            drops++;
+            sched_yield();
+            t0 = now_ns();
+        }
+        t = now_ns() - t0;
+        add_ns += t;
+        if (t > add_max)
+            add_max = t;
+    }
+    pthread_join(thread, NULL);
+
+    qsort(r.latency, frames, sizeof(r.latency[0]), cmp_ll);
+    printf("  %-8s paced      add %6.0f ns avg %7lld max   hand-off %7lld ns p50 %8lld p99 %8lld max   %d full\n",
+        ring ? "ring" : "locked", (double)add_ns / frames, add_max,
+        r.latency[frames / 2], r.latency[frames * 99 / 100], r.latency[frames - 1],
+        drops);
+    free(pool);
+    free(r.latency);
+}
+
+static void saturated(int ring, int frames)
+{
+    struct run r;
+    struct frame *pool;
+    pthread_t thread;
+    long long t0, t;
+    int i;
+
+    start(&r, ring, frames);
+    pool = calloc(frames, sizeof(*pool));
+    pthread_create(&thread, NULL, consumer, &r);
+
+    t0 = now_ns();
+    for (i = 0; i < frames; i++) {
+        /* The driver only has IN_FLIGHT buffers to fill. */
+        while (queue_count(&r) >= IN_FLIGHT)
+            sched_yield();
+        pool[i].posted = now_ns();
+        while (!queue_add(&r, &pool[i]))
+            sched_yield();
+    }
+    pthread_join(thread, NULL);
+    t = now_ns() - t0;
+
+    printf("  %-8s saturated %6.0f ns/frame\n", ring ? "ring" : "locked",
+        (double)t / frames);
+    free(pool);
+    free(r.latency);
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 20000;
+    int period_us = argc > 2 ? atoi(argv[2]) : 500;
+    int ring;
+
+    if (frames < 100)
+        frames = 100;
+    if (period_us < 1)
+        period_us = 1;
+
+    printf("frame queue, %d frames, %d us period, %d in flight\n",
+        frames, period_us, IN_FLIGHT);
+    for (ring = 0; ring <= 1; ring++)
+        paced(ring, frames, period_us);
+    for (ring = 0; ring <= 1; ring++)
+        saturated(ring, frames * 10);
+    return 0;
+}
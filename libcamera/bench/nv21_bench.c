@@ -0,0 +1,284 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Times the NV21 preview converters, the scaler and the luma histogram
+ * against their C versions and checks that both produce the same bytes,
+ * then runs the face detector on synthetic frames and times it at the
+ * analysis size the HAL uses.
+ * Usage: nv21_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nv21_convert.h"
+#include "nv21_faces.h"
+#include "nv21_scale.h"
+#include "nv21_stats.h"
+
+typedef void (*convert_fn)(const uint8_t *, const uint8_t *, int, int, uint8_t *);
+
+static const struct {
+    const char *name;
+    int format;
+    convert_fn fast;
+    convert_fn ref;
+} kernels[] = {
+    { "nv12",     NV21_CONVERT_NV12,     nv21_to_nv12,   nv21_to_nv12_c },
+    { "yv12",     NV21_CONVERT_YV12,     nv21_to_yv12,   nv21_to_yv12_c },
+    { "rgb565",   NV21_CONVERT_RGB565,   nv21_to_rgb565, nv21_to_rgb565_c },
+    { "rgba8888", NV21_CONVERT_RGBA8888, nv21_to_rgba,   nv21_to_rgba_c },
+};
+
+static const struct {
+    int width;
+    int height;
+} sizes[] = {
+    { 640, 480 },
+    { 1280, 720 },
+    { 174, 144 },   /* odd multiple of 2, exercises the tail paths */
+};
+
+static const struct {
+    int sw, sh, dw, dh;
+    int filter;
+    const char *use;
+} scales[] = {
+    { 2592, 1944, 512, 384, NV21_SCALE_BOX,      "thumbnail" },
+    { 1280,  720, 320, 180, NV21_SCALE_BOX,      "analysis" },
+    { 1280,  720, 640, 360, NV21_SCALE_BILINEAR, "callback" },
+    {  640,  480, 320, 240, NV21_SCALE_BILINEAR, "callback" },
+    {  640,  480, 174, 144, NV21_SCALE_BOX,      "odd" },
+};
+
+static uint8_t *noise(size_t len)
+{
+    uint8_t *buf = malloc(len);
+    size_t i;
+    /* Full-range noise so the clamps are hit as well as mid-tones. */
+    srand(len);
+    for (i = 0; i < len; i++)
+        buf[i] = rand() & 0xff;
+    return buf;
+}
+
+/* Fill an ellipse in both planes; chroma is sampled at 2x2 block centres. */
+static void ellipse(uint8_t *frame, int w, int h, int cx, int cy, int rx, int ry,
+                    int luma, int v, int u)
+{
+    uint8_t *vu = frame + w * h;
+    int x, y;
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            long dx = x - cx, dy = y - cy;
+            if (dx * dx * ry * ry + dy * dy * rx * rx > (long)rx * rx * ry * ry)
+                continue;
+            if (luma >= 0)
+                frame[y * w + x] = luma;
+            if (v >= 0 && (x & 1) == 0 && (y & 1) == 0) {
+                vu[(y / 2) * w + x] = v;
+                vu[(y / 2) * w + x + 1] = u;
+            }
+        }
+    }
+}
+
+/* A grey, noisy background with a skin-toned face: dark eyes and mouth. */
+static uint8_t *face_scene(int w, int h, int cx, int cy, int rx, int ry)
+{
+    uint8_t *frame = malloc((size_t)w * h * 3 / 2);
+    size_t i;
+    srand(w * h);
+    for (i = 0; i < (size_t)w * h; i++)
+        frame[i] = 96 + (rand() & 63);
+    memset(frame + w * h, 128, (size_t)w * h / 2);
+    ellipse(frame, w, h, cx, cy, rx, ry, 170, 150, 110);
+    ellipse(frame, w, h, cx - rx * 2 / 5, cy - ry / 4, rx / 5, ry / 10, 40, -1, -1);
+    ellipse(frame, w, h, cx + rx * 2 / 5, cy - ry / 4, rx / 5, ry / 10, 40, -1, -1);
+    ellipse(frame, w, h, cx, cy + ry / 2, rx * 2 / 5, ry / 12, 60, -1, -1);
+    return frame;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double time_kernel(convert_fn fn, const uint8_t *src, int w, int h,
+                          uint8_t *dst, int iterations)
+{
+    double start = now_ms();
+    int i;
+    for (i = 0; i < iterations; i++)
+        fn(src, src + w * h, w, h, dst);
+    return (now_ms() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    int failures = 0;
+    unsigned s, k;
+
+    if (iterations <= 0)
+        iterations = 1;
+
+    printf("nv21_convert: %s, %d iterations\n", nv21_convert_impl(), iterations);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int w = sizes[s].width, h = sizes[s].height;
+        uint8_t *src = noise((size_t)w * h * 3 / 2);
+
+        for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            size_t len = nv21_converted_size(kernels[k].format, w, h);
+            uint8_t *out = calloc(1, len);
+            uint8_t *ref = calloc(1, len);
+            double fast_ms, ref_ms;
+            int same;
+
+            kernels[k].fast(src, src + w * h, w, h, out);
+            kernels[k].ref(src, src + w * h, w, h, ref);
+            same = memcmp(out, ref, len) == 0;
+            if (!same)
+                failures++;
+
+            fast_ms = time_kernel(kernels[k].fast, src, w, h, out, iterations);
+            ref_ms = time_kernel(kernels[k].ref, src, w, h, ref, iterations);
+            printf("%4dx%-4d %-9s %7.3f ms  c %7.3f ms  x%.2f  %s\n",
+                   w, h, kernels[k].name, fast_ms, ref_ms,
+                   fast_ms > 0 ? ref_ms / fast_ms : 0.0,
+                   same ? "ok" : "MISMATCH");
+            free(out);
+            free(ref);
+        }
+        free(src);
+    }
+
+    printf("nv21_scale: %s\n", nv21_scale_impl());
+    for (s = 0; s < sizeof(scales) / sizeof(scales[0]); s++) {
+        int sw = scales[s].sw, sh = scales[s].sh;
+        int dw = scales[s].dw, dh = scales[s].dh;
+        int filter = scales[s].filter;
+        size_t len = (size_t)dw * dh * 3 / 2;
+        uint8_t *src = noise((size_t)sw * sh * 3 / 2);
+        uint8_t *out = calloc(1, len);
+        uint8_t *ref = calloc(1, len);
+        double fast_ms, ref_ms, start;
+        int same, i;
+
+        nv21_scale(filter, src, src + sw * sh, sw, sh, sw, out, dw, dh);
+        nv21_scale_c(filter, src, src + sw * sh, sw, sh, sw, ref, dw, dh);
+        same = memcmp(out, ref, len) == 0;
+        if (!same)
+            failures++;
+
+        start = now_ms();
+        for (i = 0; i < iterations; i++)
+            nv21_scale(filter, src, src + sw * sh, sw, sh, sw, out, dw, dh);
+        fast_ms = (now_ms() - start) / iterations;
+        start = now_ms();
+        for (i = 0; i < iterations; i++)
+            nv21_scale_c(filter, src, src + sw * sh, sw, sh, sw, ref, dw, dh);
+        ref_ms = (now_ms() - start) / iterations;
+
+        /* Throughput counts source pixels, which is what the cost scales with. */
+        printf("%4dx%-4d -> %4dx%-4d %-8s %-9s %7.1f MP/s  c %7.1f MP/s  %s\n",
+               sw, sh, dw, dh, filter == NV21_SCALE_BOX ? "box" : "bilinear",
+               scales[s].use, sw * sh / 1000.0 / fast_ms, sw * sh / 1000.0 / ref_ms,
+               same ? "ok" : "MISMATCH");
+        free(src);
+        free(out);
+        free(ref);
+    }
+
+    printf("nv21_luma_histogram\n");
+    for (s = 0; s < 2; s++) {
+        int w = sizes[s].width, h = sizes[s].height;
+        uint8_t *src = noise((size_t)w * h);
+        int step;
+
+        for (step = 1; step <= 2; step++) {
+            uint32_t bins[256], ref[256];
+            double fast_ms, ref_ms, start;
+            int same, i;
+
+            same = nv21_luma_histogram(src, w, h, w, step, bins) ==
+                nv21_luma_histogram_c(src, w, h, w, step, ref) &&
+                memcmp(bins, ref, sizeof(bins)) == 0;
+            if (!same)
+                failures++;
+
+            start = now_ms();
+            for (i = 0; i < iterations; i++)
+                nv21_luma_histogram(src, w, h, w, step, bins);
+            fast_ms = (now_ms() - start) / iterations;
+            start = now_ms();
+            for (i = 0; i < iterations; i++)
+                nv21_luma_histogram_c(src, w, h, w, step, ref);
+            ref_ms = (now_ms() - start) / iterations;
+            printf("%4dx%-4d step %d  %7.3f ms  c %7.3f ms  %s\n",
+                   w, h, step, fast_ms, ref_ms, same ? "ok" : "MISMATCH");
+        }
+        free(src);
+    }
+
+    /* Same path as the HAL: box down to the analysis size, then detect. */
+    printf("nv21_detect_faces\n");
+    for (s = 0; s < 2; s++) {
+        int w = sizes[s].width, h = sizes[s].height;
+        int aw = 160, ah = 120;
+        int cx = w / 2, cy = h / 2 - h / 20, rx = w / 8, ry = h / 4;
+        uint8_t *scene = face_scene(w, h, cx, cy, rx, ry);
+        uint8_t *small = malloc((size_t)aw * ah * 3 / 2);
+        uint8_t *empty = noise((size_t)aw * ah * 3 / 2);
+        nv21_face_t faces[NV21_MAX_FACES];
+        double scale_ms, detect_ms, start;
+        int found, ok, i;
+
+        nv21_scale(NV21_SCALE_BOX, scene, scene + w * h, w, h, w, small, aw, ah);
+        found = nv21_detect_faces(small, small + aw * ah, aw, ah, faces, NV21_MAX_FACES);
+        /* The box should land within a few analysis pixels of the ellipse. */
+        ok = found == 1 &&
+            abs(faces[0].left - (cx - rx) * aw / w) <= 3 &&
+            abs(faces[0].right - (cx + rx) * aw / w) <= 3 &&
+            abs(faces[0].top - (cy - ry) * ah / h) <= 3 &&
+            abs(faces[0].bottom - (cy + ry) * ah / h) <= 3 &&
+            nv21_detect_faces(empty, empty + aw * ah, aw, ah, faces, NV21_MAX_FACES) == 0;
+        if (!ok)
+            failures++;
+
+        start = now_ms();
+        for (i = 0; i < iterations; i++)
+            nv21_scale(NV21_SCALE_BOX, scene, scene + w * h, w, h, w, small, aw, ah);
+        scale_ms = (now_ms() - start) / iterations;
+        start = now_ms();
+        for (i = 0; i < iterations; i++)
+            nv21_detect_faces(small, small + aw * ah, aw, ah, faces, NV21_MAX_FACES);
+        detect_ms = (now_ms() - start) / iterations;
+        printf("%4dx%-4d -> %dx%d  scale %6.3f ms  detect %6.3f ms  %d face(s)  %s\n",
+               w, h, aw, ah, scale_ms, detect_ms, found, ok ? "ok" : "FAIL");
+        free(scene);
+        free(small);
+        free(empty);
+    }
+
+    return failures ? 1 : 0;
+}
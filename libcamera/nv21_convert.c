@@ -0,0 +1,375 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * NV21 conversion kernels for the preview callback path.
+ *
+ * RGB output uses BT.601 video range in 6-bit fixed point:
+ *   R = (74 (Y-16) + 102 (V-128)) >> 6
+ *   G = (74 (Y-16) -  52 (V-128) - 25 (U-128)) >> 6
+ *   B = (74 (Y-16) + 129 (U-128)) >> 6
+ * The sums fit in 16 bits except where the result clamps to 255 anyway,
+ * so the SIMD paths use saturating 16-bit arithmetic and produce the same
+ * bytes as the C path.
+ */
+
+#include <string.h>
+
+#include "nv21_convert.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NV21_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define NV21_SSE2 1
+#endif
+
+#define ALIGN16(x) (((x) + 15) & ~15)
+
+static inline uint8_t clamp8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* C row kernels; x0 is where a SIMD loop stopped (always even). */
+
+static void swap_row_c(const uint8_t *src, int x0, int n, uint8_t *dst)
+{
+    int x;
+    for (x = x0; x < n; x += 2) {
+        dst[x] = src[x + 1];
+        dst[x + 1] = src[x];
+    }
+}
+
+static void split_row_c(const uint8_t *vu, int x0, int n, uint8_t *v, uint8_t *u)
+{
+    int x;
+    for (x = x0; x < n; x++) {
+        v[x] = vu[2 * x];
+        u[x] = vu[2 * x + 1];
+    }
+}
+
+static void rgb_row_c(const uint8_t *y, const uint8_t *vu, int x0, int width,
+                      uint8_t *dst, int rgba)
+{
+    int x, k;
+    for (x = x0; x < width; x += 2) {
+        int v = vu[x] - 128;
+        int u = vu[x + 1] - 128;
+        int rc = 102 * v;
+        int gc = -52 * v - 25 * u;
+        int bc = 129 * u;
+        for (k = 0; k < 2; k++) {
+            int yt = 74 * (y[x + k] - 16);
+            uint8_t r = clamp8((yt + rc) >> 6);
+            uint8_t g = clamp8((yt + gc) >> 6);
+            uint8_t b = clamp8((yt + bc) >> 6);
+            if (rgba) {
+                uint8_t *p = dst + 4 * (x + k);
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+                p[3] = 255;
+            } else {
+                ((uint16_t *)dst)[x + k] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            }
+        }
+    }
+}
+
+#if NV21_NEON
+
+static void swap_row(const uint8_t *src, int n, uint8_t *dst)
+{
+    int x = 0;
+    for (; x + 16 <= n; x += 16)
+        vst1q_u8(dst + x, vrev16q_u8(vld1q_u8(src + x)));
+    swap_row_c(src, x, n, dst);
+}
+
+static void split_row(const uint8_t *vu, int n, uint8_t *v, uint8_t *u)
+{
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16x2_t p = vld2q_u8(vu + 2 * x);
+        vst1q_u8(v + x, p.val[0]);
+        vst1q_u8(u + x, p.val[1]);
+    }
+    split_row_c(vu, x, n, v, u);
+}
+
+static inline void rgb_store8(uint8x8_t yh, int16x8_t rc, int16x8_t gc, int16x8_t bc,
+                              uint8_t *dst, int rgba)
+{
+    int16x8_t yt = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yh)),
+        vdupq_n_s16(16)), 74);
+    uint8x8_t r = vqshrun_n_s16(vqaddq_s16(yt, rc), 6);
+    uint8x8_t g = vqshrun_n_s16(vqaddq_s16(yt, gc), 6);
+    uint8x8_t b = vqshrun_n_s16(vqaddq_s16(yt, bc), 6);
+    if (rgba) {
+        uint8x8x4_t o;
+        o.val[0] = r;
+        o.val[1] = g;
+        o.val[2] = b;
+        o.val[3] = vdup_n_u8(255);
+        vst4_u8(dst, o);
+    } else {
+        uint16x8_t p = vshll_n_u8(r, 8);
+        p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+        p = vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+        vst1q_u16((uint16_t *)dst, p);
+    }
+}
+
+static void rgb_row(const uint8_t *y, const uint8_t *vu, int width, uint8_t *dst, int rgba)
+{
+    const int bpp = rgba ? 4 : 2;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t yy = vld1q_u8(y + x);
+        uint8x8x2_t c = vld2_u8(vu + x);
+        int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c.val[0])), vdupq_n_s16(128));
+        int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c.val[1])), vdupq_n_s16(128));
+        int16x8x2_t r2 = vzipq_s16(vmulq_n_s16(v, 102), vmulq_n_s16(v, 102));
+        int16x8_t gc = vaddq_s16(vmulq_n_s16(v, -52), vmulq_n_s16(u, -25));
+        int16x8x2_t g2 = vzipq_s16(gc, gc);
+        int16x8x2_t b2 = vzipq_s16(vmulq_n_s16(u, 129), vmulq_n_s16(u, 129));
+        rgb_store8(vget_low_u8(yy), r2.val[0], g2.val[0], b2.val[0], dst + bpp * x, rgba);
+        rgb_store8(vget_high_u8(yy), r2.val[1], g2.val[1], b2.val[1], dst + bpp * (x + 8), rgba);
+    }
+    rgb_row_c(y, vu, x, width, dst, rgba);
+}
+
+#elif NV21_SSE2
+
+static void swap_row(const uint8_t *src, int n, uint8_t *dst)
+{
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+        p = _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+        _mm_storeu_si128((__m128i *)(dst + x), p);
+    }
+    swap_row_c(src, x, n, dst);
+}
+
+static void split_row(const uint8_t *vu, int n, uint8_t *v, uint8_t *u)
+{
+    const __m128i lo = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(vu + 2 * x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(vu + 2 * x + 16));
+        _mm_storeu_si128((__m128i *)(v + x),
+            _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo)));
+        _mm_storeu_si128((__m128i *)(u + x),
+            _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    split_row_c(vu, x, n, v, u);
+}
+
+static void rgb_row(const uint8_t *y, const uint8_t *vu, int width, uint8_t *dst, int rgba)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo16 = _mm_set1_epi32(0xffff);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i yy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + x)), zero);
+        /* v0 u0 v1 u1 ... as 16-bit lanes; spread each to two pixels */
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(vu + x)), zero);
+        __m128i v = _mm_and_si128(c, lo16);
+        __m128i u = _mm_srli_epi32(c, 16);
+        __m128i yt = _mm_mullo_epi16(_mm_sub_epi16(yy, _mm_set1_epi16(16)), _mm_set1_epi16(74));
+        __m128i r, g, b;
+        v = _mm_sub_epi16(_mm_or_si128(v, _mm_slli_epi32(v, 16)), _mm_set1_epi16(128));
+        u = _mm_sub_epi16(_mm_or_si128(u, _mm_slli_epi32(u, 16)), _mm_set1_epi16(128));
+
+        r = _mm_adds_epi16(yt, _mm_mullo_epi16(v, _mm_set1_epi16(102)));
+        g = _mm_adds_epi16(yt, _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(-52)),
+            _mm_mullo_epi16(u, _mm_set1_epi16(-25))));
+        b = _mm_adds_epi16(yt, _mm_mullo_epi16(u, _mm_set1_epi16(129)));
+        /* clamp to 0..255, still in 16-bit lanes */
+        r = _mm_unpacklo_epi8(_mm_packus_epi16(_mm_srai_epi16(r, 6), zero), zero);
+        g = _mm_unpacklo_epi8(_mm_packus_epi16(_mm_srai_epi16(g, 6), zero), zero);
+        b = _mm_unpacklo_epi8(_mm_packus_epi16(_mm_srai_epi16(b, 6), zero), zero);
+
+        if (rgba) {
+            __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+            __m128i ba = _mm_or_si128(b, _mm_set1_epi16((short)0xff00));
+            _mm_storeu_si128((__m128i *)(dst + 4 * x), _mm_unpacklo_epi16(rg, ba));
+            _mm_storeu_si128((__m128i *)(dst + 4 * x + 16), _mm_unpackhi_epi16(rg, ba));
+        } else {
+            __m128i p = _mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xf8)), 8);
+            p = _mm_or_si128(p, _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xfc)), 3));
+            p = _mm_or_si128(p, _mm_srli_epi16(b, 3));
+            _mm_storeu_si128((__m128i *)(dst + 2 * x), p);
+        }
+    }
+    rgb_row_c(y, vu, x, width, dst, rgba);
+}
+
+#else
+
+static void swap_row(const uint8_t *src, int n, uint8_t *dst)
+{
+    swap_row_c(src, 0, n, dst);
+}
+
+static void split_row(const uint8_t *vu, int n, uint8_t *v, uint8_t *u)
+{
+    split_row_c(vu, 0, n, v, u);
+}
+
+static void rgb_row(const uint8_t *y, const uint8_t *vu, int width, uint8_t *dst, int rgba)
+{
+    rgb_row_c(y, vu, 0, width, dst, rgba);
+}
+
+#endif
+
+const char *nv21_convert_impl(void)
+{
+#if NV21_NEON
+    return "neon";
+#elif NV21_SSE2
+    return "sse2";
+#else
+    return "c";
+#endif
+}
+
+size_t nv21_converted_size(int format, int width, int height)
+{
+    switch (format) {
+    case NV21_CONVERT_YV12: {
+        int ystride = ALIGN16(width);
+        int cstride = ALIGN16(ystride / 2);
+        return (size_t)ystride * height + (size_t)cstride * height;
+    }
+    case NV21_CONVERT_RGB565:
+        return (size_t)width * height * 2;
+    case NV21_CONVERT_RGBA8888:
+        return (size_t)width * height * 4;
+    }
+    return (size_t)width * height * 3 / 2;
+}
+
+/* The frame-level loops are shared by the SIMD and C paths; only the row
+ * kernels differ. */
+
+#define NV12_BODY(SWAP)                                                     \
+    int row;                                                                \
+    memcpy(dst, y, (size_t)width * height);                                 \
+    for (row = 0; row < height / 2; row++)                              \
+        SWAP(vu + row * width, width, dst + (size_t)width * height + row * width);
+
+#define YV12_BODY(SPLIT)                                                    \
+    int ystride = ALIGN16(width);                                           \
+    int cstride = ALIGN16(ystride / 2);                                     \
+    uint8_t *vp = dst + (size_t)ystride * height;                           \
+    uint8_t *up = vp + (size_t)cstride * (height / 2);                      \
+    int row;                                                                \
+    for (row = 0; row < height; row++)                                  \
+        memcpy(dst + row * ystride, y + row * width, width);                \
+    for (row = 0; row < height / 2; row++)                              \
+        SPLIT(vu + row * width, width / 2, vp + row * cstride, up + row * cstride);
+
+#define RGB_BODY(ROW, BPP, RGBA)                                            \
+    int row;                                                                \
+    for (row = 0; row < height; row++)                                  \
+        ROW(y + row * width, vu + (row / 2) * width, width,                 \
+            dst + (size_t)row * width * (BPP), RGBA);
+
+static void swap_row_c0(const uint8_t *src, int n, uint8_t *dst)
+{
+    swap_row_c(src, 0, n, dst);
+}
+
+static void split_row_c0(const uint8_t *vu, int n, uint8_t *v, uint8_t *u)
+{
+    split_row_c(vu, 0, n, v, u);
+}
+
+static void rgb_row_c0(const uint8_t *y, const uint8_t *vu, int width, uint8_t *dst, int rgba)
+{
+    rgb_row_c(y, vu, 0, width, dst, rgba);
+}
+
+void nv21_to_nv12(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    NV12_BODY(swap_row)
+}
+
+void nv21_to_yv12(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    YV12_BODY(split_row)
+}
+
+void nv21_to_rgb565(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    RGB_BODY(rgb_row, 2, 0)
+}
+
+void nv21_to_rgba(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    RGB_BODY(rgb_row, 4, 1)
+}
+
+void nv21_to_nv12_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    NV12_BODY(swap_row_c0)
+}
+
+void nv21_to_yv12_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    YV12_BODY(split_row_c0)
+}
+
+void nv21_to_rgb565_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    RGB_BODY(rgb_row_c0, 2, 0)
+}
+
+void nv21_to_rgba_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst)
+{
+    RGB_BODY(rgb_row_c0, 4, 1)
+}
+
+void nv21_convert(int format, const uint8_t *y, const uint8_t *vu,
+                  int width, int height, uint8_t *dst)
+{
+    switch (format) {
+    case NV21_CONVERT_NV12:
+        nv21_to_nv12(y, vu, width, height, dst);
+        break;
+    case NV21_CONVERT_YV12:
+        nv21_to_yv12(y, vu, width, height, dst);
+        break;
+    case NV21_CONVERT_RGB565:
+        nv21_to_rgb565(y, vu, width, height, dst);
+        break;
+    case NV21_CONVERT_RGBA8888:
+        nv21_to_rgba(y, vu, width, height, dst);
+        break;
+    default:
+        memcpy(dst, y, (size_t)width * height);
+        memcpy(dst + (size_t)width * height, vu, (size_t)width * height / 2);
+        break;
+    }
+}
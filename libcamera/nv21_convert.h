@@ -0,0 +1,65 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef __NV21_CONVERT_H__
+#define __NV21_CONVERT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Converters from the NV21 frames the VFE produces to the formats apps
+ * can ask for in their preview callbacks. The source is a packed Y plane
+ * of width x height followed (at vu) by the interleaved VU plane; width
+ * and height must be even. Destinations are packed, except YV12 which
+ * uses the strides Android mandates (Y aligned to 16, chroma to 16).
+ *
+ * The plain entry points pick NEON or SSE2 when the build has them and
+ * fall back to C; the _c variants are always the C code, for checking.
+ */
+
+enum {
+    NV21_CONVERT_NONE,
+    NV21_CONVERT_NV12,
+    NV21_CONVERT_YV12,
+    NV21_CONVERT_RGB565,
+    NV21_CONVERT_RGBA8888
+};
+
+size_t nv21_converted_size(int format, int width, int height);
+void nv21_convert(int format, const uint8_t *y, const uint8_t *vu,
+                  int width, int height, uint8_t *dst);
+const char *nv21_convert_impl(void);
+
+void nv21_to_nv12(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+void nv21_to_yv12(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+void nv21_to_rgb565(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+void nv21_to_rgba(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+
+void nv21_to_nv12_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+void nv21_to_yv12_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+void nv21_to_rgb565_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+void nv21_to_rgba_c(const uint8_t *y, const uint8_t *vu, int width, int height, uint8_t *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NV21_CONVERT_H__ */
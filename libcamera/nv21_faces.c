@@ -0,0 +1,194 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nv21_faces.h"
+
+/* Chai & Ngan skin range; in NV21 V is Cr and U is Cb. */
+#define IS_SKIN(v, u) ((u) >= 77 && (u) <= 127 && (v) >= 133 && (v) <= 173)
+
+/* Region filters, in chroma pixels and percent. */
+#define MIN_AREA_PERMILLE 4     /* of the frame */
+#define MIN_FILL_PCT 45         /* of the bounding box; an ellipse is ~78 */
+#define MIN_ASPECT_PCT 70       /* height / width */
+#define MAX_ASPECT_PCT 220
+#define DARK_MARGIN 24          /* luma below the region mean */
+#define MIN_DARK_PERMILLE 15    /* of the upper part of the region */
+
+struct region {
+    int area;
+    int minx, miny, maxx, maxy;
+};
+
+static int find_root(int *parent, int i)
+{
+    int root = i;
+    while (parent[root] != root)
+        root = parent[root];
+    while (parent[i] != root) {
+        int next = parent[i];
+        parent[i] = root;
+        i = next;
+    }
+    return root;
+}
+
+static void unite(int *parent, int a, int b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+/* Whether the upper 60% of the box has enough pixels clearly darker than
+ * the box average: a flat skin-coloured wall or arm does not. */
+static int has_features(const uint8_t *y, int width, int left, int top, int right, int bottom)
+{
+    int feature_bottom = top + (bottom - top) * 3 / 5;
+    unsigned sum = 0, count = 0, dark = 0;
+    int mean, row, x;
+
+    for (row = top; row < bottom; row++)
+        for (x = left; x < right; x++)
+            sum += y[row * width + x];
+    count = (unsigned)(right - left) * (bottom - top);
+    if (count == 0)
+        return 0;
+    mean = sum / count;
+
+    count = 0;
+    for (row = top; row < feature_bottom; row++) {
+        for (x = left; x < right; x++) {
+            if (y[row * width + x] + DARK_MARGIN < mean)
+                dark++;
+            count++;
+        }
+    }
+    return count > 0 && dark * 1000 >= count * MIN_DARK_PERMILLE;
+}
+
+int nv21_detect_faces(const uint8_t *y, const uint8_t *vu, int width, int height,
+                      nv21_face_t *faces, int max_faces)
+{
+    int cw = width / 2, ch = height / 2;
+    int n = cw * ch;
+    int *label = malloc(n * sizeof(int));
+    int *parent = malloc((n + 1) * sizeof(int));
+    struct region *regions = NULL;
+    int labels = 0, found = 0;
+    int cx, cy, i;
+
+    if (label == NULL || parent == NULL || max_faces <= 0)
+        goto out;
+
+    /* First pass: provisional labels over the skin mask, 4-connected. */
+    for (cy = 0; cy < ch; cy++) {
+        const uint8_t *row = vu + (size_t)cy * width;
+        for (cx = 0; cx < cw; cx++) {
+            int idx = cy * cw + cx;
+            int left = cx > 0 ? label[idx - 1] : 0;
+            int up = cy > 0 ? label[idx - cw] : 0;
+            if (!IS_SKIN(row[2 * cx], row[2 * cx + 1])) {
+                label[idx] = 0;
+            } else if (left == 0 && up == 0) {
+                labels++;
+                parent[labels] = labels;
+                label[idx] = labels;
+            } else if (left == 0 || up == 0) {
+                label[idx] = left + up;
+            } else {
+                label[idx] = left < up ? left : up;
+                if (left != up)
+                    unite(parent, left, up);
+            }
+        }
+    }
+    if (labels == 0)
+        goto out;
+
+    /* Second pass: gather the extent of each connected region. */
+    regions = calloc(labels + 1, sizeof(struct region));
+    if (regions == NULL)
+        goto out;
+    for (cy = 0; cy < ch; cy++) {
+        for (cx = 0; cx < cw; cx++) {
+            struct region *r;
+            if (label[cy * cw + cx] == 0)
+                continue;
+            r = &regions[find_root(parent, label[cy * cw + cx])];
+            if (r->area++ == 0) {
+                r->minx = r->maxx = cx;
+                r->miny = r->maxy = cy;
+            } else {
+                if (cx < r->minx) r->minx = cx;
+                if (cx > r->maxx) r->maxx = cx;
+                if (cy < r->miny) r->miny = cy;
+                if (cy > r->maxy) r->maxy = cy;
+            }
+        }
+    }
+
+    for (i = 1; i <= labels; i++) {
+        struct region *r = &regions[i];
+        int bw = r->maxx - r->minx + 1, bh = r->maxy - r->miny + 1;
+        int fill, aspect, j;
+        nv21_face_t face;
+
+        if (r->area == 0 || r->area * 1000 < n * MIN_AREA_PERMILLE)
+            continue;
+        fill = r->area * 100 / (bw * bh);
+        aspect = bh * 100 / bw;
+        if (fill < MIN_FILL_PCT || aspect < MIN_ASPECT_PCT || aspect > MAX_ASPECT_PCT)
+            continue;
+
+        face.left = r->minx * 2;
+        face.top = r->miny * 2;
+        face.right = (r->maxx + 1) * 2;
+        face.bottom = (r->maxy + 1) * 2;
+        if (!has_features(y, width, face.left, face.top, face.right, face.bottom))
+            continue;
+        /* An ellipse fills about 78% of its box; score how close we are. */
+        face.score = 100 - abs(fill - 78) * 2;
+        if (face.score < 1)
+            face.score = 1;
+
+        /* Insert by size, keeping the max_faces largest. */
+        for (j = found; j > 0; j--) {
+            const nv21_face_t *prev = &faces[j - 1];
+            if ((prev->right - prev->left) * (prev->bottom - prev->top) >=
+                (face.right - face.left) * (face.bottom - face.top))
+                break;
+            if (j < max_faces)
+                faces[j] = faces[j - 1];
+        }
+        if (j < max_faces) {
+            faces[j] = face;
+            if (found < max_faces)
+                found++;
+        }
+    }
+
+out:
+    free(label);
+    free(parent);
+    free(regions);
+    return found;
+}
@@ -0,0 +1,58 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef __NV21_FACES_H__
+#define __NV21_FACES_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Software face detection for sensors without a hardware detector.
+ *
+ * This is a skin-tone blob detector rather than a trained classifier:
+ * chroma pixels in the usual Cb/Cr skin range are grouped into connected
+ * regions, and regions of face-like size, shape and fill, with darker
+ * features (eyes, brows) in their upper part, are reported. It is meant
+ * to run on a small copy of the preview (about 160x120) a few times a
+ * second; cost grows with the pixel count.
+ *
+ * width and height must be even. Rectangles are in pixels of the frame
+ * passed in, right/bottom exclusive, largest face first; score is 1-100.
+ * Returns the number of faces written, at most max_faces.
+ */
+
+#define NV21_MAX_FACES 4
+
+typedef struct {
+    int left;
+    int top;
+    int right;
+    int bottom;
+    int score;
+} nv21_face_t;
+
+int nv21_detect_faces(const uint8_t *y, const uint8_t *vu, int width, int height,
+                      nv21_face_t *faces, int max_faces);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NV21_FACES_H__ */
@@ -0,0 +1,295 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Each plane is scaled vertically first, a whole source row at a time,
+ * which is where the SIMD goes; the horizontal pass then walks the much
+ * shorter destination row in C. The VU plane is handled as a plane of
+ * two-byte pixels.
+ *
+ * BILINEAR blends the two nearest rows with a 7-bit weight and the two
+ * nearest columns with an 8-bit one, sampling at pixel centres. BOX sums
+ * the rows under each output row into 16-bit accumulators (hence the 256
+ * row limit) and divides by the covered area, rounding to nearest.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nv21_scale.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NV21_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define NV21_SSE2 1
+#endif
+
+#define MAX_BOX_ROWS 256
+
+typedef void (*blend_fn)(const uint8_t *a, const uint8_t *b, int f, int n, uint8_t *dst);
+typedef void (*accum_fn)(const uint8_t *src, int n, uint16_t *acc);
+
+/* C row kernels; x0 is where a SIMD loop stopped. */
+
+static void blend_row_c(const uint8_t *a, const uint8_t *b, int f, int x0, int n, uint8_t *dst)
+{
+    int x;
+    for (x = x0; x < n; x++)
+        dst[x] = (a[x] * (128 - f) + b[x] * f + 64) >> 7;
+}
+
+static void accum_row_c(const uint8_t *src, int x0, int n, uint16_t *acc)
+{
+    int x;
+    for (x = x0; x < n; x++)
+        acc[x] += src[x];
+}
+
+static void blend_row_c0(const uint8_t *a, const uint8_t *b, int f, int n, uint8_t *dst)
+{
+    blend_row_c(a, b, f, 0, n, dst);
+}
+
+static void accum_row_c0(const uint8_t *src, int n, uint16_t *acc)
+{
+    accum_row_c(src, 0, n, acc);
+}
+
+#if NV21_NEON
+
+static void blend_row(const uint8_t *a, const uint8_t *b, int f, int n, uint8_t *dst)
+{
+    const uint8x8_t wa = vdup_n_u8(128 - f);
+    const uint8x8_t wb = vdup_n_u8(f);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16_t pa = vld1q_u8(a + x);
+        uint8x16_t pb = vld1q_u8(b + x);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(pa), wa), vget_low_u8(pb), wb);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(pa), wa), vget_high_u8(pb), wb);
+        vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(lo, 7), vrshrn_n_u16(hi, 7)));
+    }
+    blend_row_c(a, b, f, x, n, dst);
+}
+
+static void accum_row(const uint8_t *src, int n, uint16_t *acc)
+{
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16_t p = vld1q_u8(src + x);
+        vst1q_u16(acc + x, vaddw_u8(vld1q_u16(acc + x), vget_low_u8(p)));
+        vst1q_u16(acc + x + 8, vaddw_u8(vld1q_u16(acc + x + 8), vget_high_u8(p)));
+    }
+    accum_row_c(src, x, n, acc);
+}
+
+#elif NV21_SSE2
+
+static void blend_row(const uint8_t *a, const uint8_t *b, int f, int n, uint8_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(128 - f);
+    const __m128i wb = _mm_set1_epi16(f);
+    const __m128i half = _mm_set1_epi16(64);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i pa = _mm_loadu_si128((const __m128i *)(a + x));
+        __m128i pb = _mm_loadu_si128((const __m128i *)(b + x));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, half), 7);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, half), 7);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+    }
+    blend_row_c(a, b, f, x, n, dst);
+}
+
+static void accum_row(const uint8_t *src, int n, uint16_t *acc)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i *lo = (__m128i *)(acc + x);
+        __m128i *hi = (__m128i *)(acc + x + 8);
+        _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(p, zero)));
+        _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(p, zero)));
+    }
+    accum_row_c(src, x, n, acc);
+}
+
+#else
+
+#define blend_row blend_row_c0
+#define accum_row accum_row_c0
+
+#endif
+
+const char *nv21_scale_impl(void)
+{
+#if NV21_NEON
+    return "neon";
+#elif NV21_SSE2
+    return "sse2";
+#else
+    return "c";
+#endif
+}
+
+/* Source sample for output index i, in 1/256ths, sampling at centres. */
+static void sample_pos(int i, int src, int dst, int *index, int *frac)
+{
+    long long pos = (((long long)(2 * i + 1) * src) << 15) / dst - (1 << 15);
+    if (pos < 0)
+        pos = 0;
+    *index = (int)(pos >> 16);
+    *frac = (int)(pos >> 8) & 0xff;
+    if (*index >= src - 1) {
+        *index = src - 1;
+        *frac = 0;
+    }
+}
+
+static int scale_plane_bilinear(const uint8_t *src, int sw, int sh, int stride,
+                                uint8_t *dst, int dw, int dh, int ch, blend_fn blend)
+{
+    int n = sw * ch;
+    uint8_t *row = malloc(n);
+    int *xi = malloc(dw * sizeof(int));
+    int *xf = malloc(dw * sizeof(int));
+    int x, y, c;
+
+    if (row == NULL || xi == NULL || xf == NULL) {
+        free(row);
+        free(xi);
+        free(xf);
+        return -1;
+    }
+    for (x = 0; x < dw; x++)
+        sample_pos(x, sw, dw, &xi[x], &xf[x]);
+
+    for (y = 0; y < dh; y++) {
+        const uint8_t *line;
+        int yi, yf;
+        sample_pos(y, sh, dh, &yi, &yf);
+        yf >>= 1;
+        if (yf == 0) {
+            line = src + (size_t)yi * stride;
+        } else {
+            blend(src + (size_t)yi * stride, src + (size_t)(yi + 1) * stride, yf, n, row);
+            line = row;
+        }
+        for (x = 0; x < dw; x++) {
+            const uint8_t *p = line + xi[x] * ch;
+            int f = xf[x];
+            for (c = 0; c < ch; c++) {
+                int p1 = f ? p[c + ch] : p[c];
+                *dst++ = (p[c] * (256 - f) + p1 * f + 128) >> 8;
+            }
+        }
+    }
+    free(row);
+    free(xi);
+    free(xf);
+    return 0;
+}
+
+static int scale_plane_box(const uint8_t *src, int sw, int sh, int stride,
+                           uint8_t *dst, int dw, int dh, int ch, accum_fn accum)
+{
+    int n = sw * ch;
+    uint16_t *acc = malloc(n * sizeof(uint16_t));
+    int *xs = malloc((dw + 1) * sizeof(int));
+    int x, y, c;
+
+    if (acc == NULL || xs == NULL) {
+        free(acc);
+        free(xs);
+        return -1;
+    }
+    /* Output x covers columns [xs[x], xs[x + 1]), or one when enlarging. */
+    for (x = 0; x <= dw; x++)
+        xs[x] = (int)((long long)x * sw / dw);
+
+    for (y = 0; y < dh; y++) {
+        int y0 = (int)((long long)y * sh / dh);
+        int y1 = (int)((long long)(y + 1) * sh / dh);
+        int r;
+        if (y1 <= y0)
+            y1 = y0 + 1;
+        memset(acc, 0, n * sizeof(uint16_t));
+        for (r = y0; r < y1; r++)
+            accum(src + (size_t)r * stride, n, acc);
+        for (x = 0; x < dw; x++) {
+            int x0 = xs[x], x1 = xs[x + 1] > x0 ? xs[x + 1] : x0 + 1;
+            unsigned area = (unsigned)(x1 - x0) * (y1 - y0);
+            for (c = 0; c < ch; c++) {
+                unsigned sum = 0;
+                int i;
+                for (i = x0; i < x1; i++)
+                    sum += acc[i * ch + c];
+                *dst++ = (sum + area / 2) / area;
+            }
+        }
+    }
+    free(acc);
+    free(xs);
+    return 0;
+}
+
+static int scale(int filter, const uint8_t *src_y, const uint8_t *src_vu,
+                 int src_w, int src_h, int src_stride,
+                 uint8_t *dst, int dst_w, int dst_h, blend_fn blend, accum_fn accum)
+{
+    uint8_t *dst_vu = dst + (size_t)dst_w * dst_h;
+
+    if (src_w < 2 || src_h < 2 || dst_w < 2 || dst_h < 2)
+        return -1;
+    if (filter == NV21_SCALE_BOX) {
+        if ((src_h + dst_h - 1) / dst_h > MAX_BOX_ROWS)
+            return -1;
+        if (scale_plane_box(src_y, src_w, src_h, src_stride,
+                dst, dst_w, dst_h, 1, accum))
+            return -1;
+        return scale_plane_box(src_vu, src_w / 2, src_h / 2, src_stride,
+            dst_vu, dst_w / 2, dst_h / 2, 2, accum);
+    }
+    if (scale_plane_bilinear(src_y, src_w, src_h, src_stride,
+            dst, dst_w, dst_h, 1, blend))
+        return -1;
+    return scale_plane_bilinear(src_vu, src_w / 2, src_h / 2, src_stride,
+        dst_vu, dst_w / 2, dst_h / 2, 2, blend);
+}
+
+int nv21_scale(int filter, const uint8_t *src_y, const uint8_t *src_vu,
+               int src_w, int src_h, int src_stride,
+               uint8_t *dst, int dst_w, int dst_h)
+{
+    return scale(filter, src_y, src_vu, src_w, src_h, src_stride,
+        dst, dst_w, dst_h, blend_row, accum_row);
+}
+
+int nv21_scale_c(int filter, const uint8_t *src_y, const uint8_t *src_vu,
+                 int src_w, int src_h, int src_stride,
+                 uint8_t *dst, int dst_w, int dst_h)
+{
+    return scale(filter, src_y, src_vu, src_w, src_h, src_stride,
+        dst, dst_w, dst_h, blend_row_c0, accum_row_c0);
+}
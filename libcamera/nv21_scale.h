@@ -0,0 +1,58 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef __NV21_SCALE_H__
+#define __NV21_SCALE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * NV21 resampler for thumbnails and small preview callback streams.
+ *
+ * The source Y and VU planes share src_stride; the destination is packed,
+ * Y (dst_w x dst_h) followed by VU. All dimensions must be even. BOX
+ * averages every source pixel under the destination pixel and is the one
+ * to use for large reductions; BILINEAR is cheaper and fine down to about
+ * half size. Returns 0, or -1 if the reduction is over 256x vertically or
+ * memory runs out.
+ *
+ * The row passes run on NEON or SSE2 when the build has them; the _c
+ * variant is always the C code, and produces the same bytes.
+ */
+
+enum {
+    NV21_SCALE_BOX,
+    NV21_SCALE_BILINEAR
+};
+
+int nv21_scale(int filter, const uint8_t *src_y, const uint8_t *src_vu,
+               int src_w, int src_h, int src_stride,
+               uint8_t *dst, int dst_w, int dst_h);
+int nv21_scale_c(int filter, const uint8_t *src_y, const uint8_t *src_vu,
+                 int src_w, int src_h, int src_stride,
+                 uint8_t *dst, int dst_w, int dst_h);
+const char *nv21_scale_impl(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NV21_SCALE_H__ */
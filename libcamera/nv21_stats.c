@@ -0,0 +1,100 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * A histogram is a scatter, which NEON and SSE2 cannot do, so the fast
+ * path works on 32-bit words instead of bytes and spreads consecutive
+ * pixels over four sub-histograms. That keeps one load per four pixels
+ * and stops runs of equal pixels from stalling on the same counter.
+ */
+
+#include <string.h>
+
+#include "nv21_stats.h"
+
+static uint32_t max_bin(const uint32_t bins[256])
+{
+    uint32_t max = 0;
+    int i;
+    for (i = 0; i < 256; i++)
+        if (bins[i] > max)
+            max = bins[i];
+    return max;
+}
+
+uint32_t nv21_luma_histogram_c(const uint8_t *y, int width, int height, int stride,
+                               int step, uint32_t bins[256])
+{
+    int row, x;
+
+    if (step != 2)
+        step = 1;
+    memset(bins, 0, 256 * sizeof(uint32_t));
+    for (row = 0; row < height; row += step)
+        for (x = 0; x < width; x += step)
+            bins[y[(size_t)row * stride + x]]++;
+    return max_bin(bins);
+}
+
+uint32_t nv21_luma_histogram(const uint8_t *y, int width, int height, int stride,
+                             int step, uint32_t bins[256])
+{
+    uint32_t sub[4][256];
+    int row, x, i;
+
+    if (step != 2)
+        step = 1;
+    memset(sub, 0, sizeof(sub));
+    for (row = 0; row < height; row += step) {
+        const uint8_t *line = y + (size_t)row * stride;
+        x = 0;
+        if (step == 1) {
+            for (; x + 8 <= width; x += 8) {
+                uint32_t a, b;
+                memcpy(&a, line + x, 4);
+                memcpy(&b, line + x + 4, 4);
+                sub[0][a & 0xff]++;
+                sub[1][(a >> 8) & 0xff]++;
+                sub[2][(a >> 16) & 0xff]++;
+                sub[3][a >> 24]++;
+                sub[0][b & 0xff]++;
+                sub[1][(b >> 8) & 0xff]++;
+                sub[2][(b >> 16) & 0xff]++;
+                sub[3][b >> 24]++;
+            }
+        } else {
+            /* Bytes 0 and 2 of each word are the even pixels. */
+            for (; x + 8 <= width; x += 8) {
+                uint32_t a, b;
+                memcpy(&a, line + x, 4);
+                memcpy(&b, line + x + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                a >>= 8;
+                b >>= 8;
+#endif
+                sub[0][a & 0xff]++;
+                sub[1][(a >> 16) & 0xff]++;
+                sub[2][b & 0xff]++;
+                sub[3][(b >> 16) & 0xff]++;
+            }
+        }
+        for (; x < width; x += step)
+            sub[0][line[x]]++;
+    }
+    for (i = 0; i < 256; i++)
+        bins[i] = sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+    return max_bin(bins);
+}
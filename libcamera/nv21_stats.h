@@ -0,0 +1,45 @@
+/*
+** Copyright (C) 2014 The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef __NV21_STATS_H__
+#define __NV21_STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Statistics computed in software over the Y plane of preview frames, for
+ * sensors whose driver does not provide them.
+ *
+ * nv21_luma_histogram() fills bins[256] with the luma histogram of every
+ * step'th pixel of every step'th row (step 1 or 2; anything else is
+ * treated as 1) and returns the largest bin. _c is the plain reference.
+ */
+
+uint32_t nv21_luma_histogram(const uint8_t *y, int width, int height, int stride,
+                             int step, uint32_t bins[256]);
+uint32_t nv21_luma_histogram_c(const uint8_t *y, int width, int height, int stride,
+                               int step, uint32_t bins[256]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NV21_STATS_H__ */